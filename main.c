@@ -1,8 +1,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
 #include <signal.h>
+#include <stdarg.h>
+#include <ctype.h>
+
+#if defined(__GNUC__)&&(defined(__x86_64__)||defined(__i386__))
+#include <immintrin.h>
+#endif
 
 #ifdef _WIN32
 #include <Windows.h>
@@ -29,14 +36,30 @@ void disable_input_buffering(){
 void restore_input_buffering(){
     SetConsoleMode(hStdin,fdwOldMode);
 }
+
+uint64_t monotonic_ns(){
+    return (uint64_t)GetTickCount64()*1000000;
+}
 #else
 #include <fcntl.h>
 #include <unistd.h>
 
+#include <time.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/termios.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <errno.h>
 /** Platform Specifics **/
 
 /* get keyboard status */
@@ -65,6 +88,12 @@ void restore_input_buffering(){
     tcsetattr(STDIN_FILENO,TCSANOW,&original_tio);
 }
 
+uint64_t monotonic_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec*1000000000+ts.tv_nsec;
+}
+
 void handle_interrupt(int signal){
     restore_input_buffering();
     printf("\n");
@@ -73,8 +102,135 @@ void handle_interrupt(int signal){
 #endif
 
 /* end */
-/* 65536 locations */
-uint16_t memory[UINT16_MAX];
+
+/** Keyboard **/
+
+/* a reader thread owns stdin and feeds a single producer single
+ * consumer ring. polling KBSR is then a pair of loads instead of a
+ * select() per poll, and GETC sleeps on a semaphore counting bytes. */
+
+#ifndef _WIN32
+#define HAVE_KEYBOARD_THREAD 1
+#endif
+
+#ifdef HAVE_KEYBOARD_THREAD
+
+enum{ KEYBOARD_RING=4096 };
+
+typedef struct{
+    char data[KEYBOARD_RING];
+    atomic_uint head;           /* written by the reader thread */
+    atomic_uint tail;           /* written by the machine */
+    atomic_int eof;
+    sem_t available;            /* posted once per byte and once at eof */
+    int started;
+    int from_file;              /* stdin is a regular file, always ready */
+} keyboard_queue;
+
+keyboard_queue keyboard;
+
+void keyboard_push(char c){
+    unsigned head=atomic_load_explicit(&keyboard.head,memory_order_relaxed);
+    while(head-atomic_load_explicit(&keyboard.tail,memory_order_acquire)==KEYBOARD_RING){
+        /* the program is not reading, wait for room */
+        struct timespec ts={0,1000000};
+        nanosleep(&ts,NULL);
+    }
+    keyboard.data[head%KEYBOARD_RING]=c;
+    atomic_store_explicit(&keyboard.head,head+1,memory_order_release);
+    sem_post(&keyboard.available);
+}
+
+void* keyboard_reader(void* arg){
+    char buf[256];
+    for(;;){
+        ssize_t n=read(STDIN_FILENO,buf,sizeof(buf));
+        if(n<0&&errno==EINTR){
+            continue;
+        }
+        if(n<=0){
+            atomic_store_explicit(&keyboard.eof,1,memory_order_release);
+            sem_post(&keyboard.available);
+            return NULL;
+        }
+        for(ssize_t i=0;i<n;++i){
+            keyboard_push(buf[i]);
+        }
+    }
+}
+
+/* take stdin over, returns 0 if the thread could not be started.
+ * a regular file needs no thread, it never blocks and select() would
+ * always call it ready, so reads go straight through stdio */
+int keyboard_start(){
+    struct stat st;
+    if(fstat(STDIN_FILENO,&st)==0&&S_ISREG(st.st_mode)){
+        keyboard.from_file=1;
+        return 1;
+    }
+    if(sem_init(&keyboard.available,0,0)!=0){
+        return 0;
+    }
+    /* cpu time samples belong to the machine, not the reader */
+    sigset_t mask,old;
+    sigemptyset(&mask);
+    sigaddset(&mask,SIGPROF);
+    pthread_sigmask(SIG_BLOCK,&mask,&old);
+    pthread_t thread;
+    int failed=pthread_create(&thread,NULL,keyboard_reader,NULL)!=0;
+    pthread_sigmask(SIG_SETMASK,&old,NULL);
+    if(failed){
+        sem_destroy(&keyboard.available);
+        return 0;
+    }
+    pthread_detach(thread);
+    keyboard.started=1;
+    return 1;
+}
+
+/* a byte is waiting, or stdin has ended and reads return EOF */
+int keyboard_ready(){
+    return atomic_load_explicit(&keyboard.head,memory_order_acquire)!=
+            atomic_load_explicit(&keyboard.tail,memory_order_relaxed)||
+        atomic_load_explicit(&keyboard.eof,memory_order_acquire);
+}
+
+/* sleep until keyboard_ready, consuming nothing */
+void keyboard_wait(){
+    while(!keyboard_ready()){
+        if(sem_wait(&keyboard.available)==0){
+            /* the byte is still to be taken by keyboard_getc */
+            sem_post(&keyboard.available);
+            if(!keyboard_ready()){
+                /* a spare wakeup, see keyboard_getc */
+                sem_trywait(&keyboard.available);
+            }
+        }
+    }
+}
+
+/* the next byte or EOF, blocks until one arrives */
+int keyboard_getc(){
+    for(;;){
+        unsigned tail=atomic_load_explicit(&keyboard.tail,memory_order_relaxed);
+        if(atomic_load_explicit(&keyboard.head,memory_order_acquire)!=tail){
+            char c=keyboard.data[tail%KEYBOARD_RING];
+            atomic_store_explicit(&keyboard.tail,tail+1,memory_order_release);
+            /* usually already posted, a miss only costs a spare wakeup */
+            sem_trywait(&keyboard.available);
+            return (unsigned char)c;
+        }
+        if(atomic_load_explicit(&keyboard.eof,memory_order_acquire)){
+            return EOF;
+        }
+        while(sem_wait(&keyboard.available)!=0&&errno==EINTR){
+        }
+    }
+}
+
+#endif
+
+/** Machine State **/
 
 enum{
     R_R0=0,
@@ -90,8 +246,6 @@ enum{
     R_COUNT
 };
 
-uint16_t reg[R_COUNT];
-
 /* op codes */
 enum{
     OP_BR=0,//branch
@@ -109,7 +263,14 @@ enum{
     OP_JMP, //jump
     OP_RES, //reserved(unused)
     OP_LEA, //load effective address
-    OP_TRAP //execute trap
+    OP_TRAP, //execute trap
+    OP_IDLE, //decoded only: head of a KBSR polling loop, see idle_wait
+    OP_BREAK //decoded only: stop in front of this word, see the Debugger section
+};
+
+const char* op_names[]={
+    "BR","ADD","LD","ST","JSR","AND","LDR","STR",
+    "RTI","NOT","LDI","STI","JMP","RES","LEA","TRAP"
 };
 
 /* condition flags */
@@ -129,12 +290,271 @@ enum{
     TRAP_HALT = 0x25   /* halt the program */
 };
 
+const char* trap_names[]={
+    "GETC","OUT","PUTS","IN","PUTSP","HALT"
+};
+
 /* memory mapped registers */
 enum{
     MR_KBSR=0xFE00, /* keyboard status */
-    MR_KBDR=0xFE02 /* keyboard data */
+    MR_KBDR=0xFE02, /* keyboard data */
+    MR_DSR=0xFE04,  /* display status, only with --os */
+    MR_DDR=0xFE06,  /* display data */
+    MR_PSR=0xFFFC,  /* processor status */
+    MR_MCR=0xFFFE   /* machine control, clearing bit 15 halts */
+};
+
+/* memory is tracked in 256 word pages. devices are mapped a page at a
+ * time, every other page is plain memory and loads from it cost one
+ * byte test. snapshots share the pages a machine has not stored to. */
+enum{
+    MEMORY_PAGE_SHIFT=8,
+    MEMORY_PAGES=1<<(16-MEMORY_PAGE_SHIFT)
+};
+
+struct lc3_vm;
+
+/* a device page, either handler may be NULL to use plain memory */
+typedef struct{
+    uint16_t (*read)(struct lc3_vm* vm,void* ctx,uint16_t address);
+    void (*write)(struct lc3_vm* vm,void* ctx,uint16_t address,uint16_t val);
+    void* ctx;
+} lc3_device;
+
+/* pre-decoded instruction
+ * the fields are extracted once, the first time a word is executed,
+ * and reused until mem_write touches that address again */
+typedef struct{
+    uint8_t op;
+    uint8_t dr;         /* DR, SR for stores, nzp mask for BR */
+    uint8_t sr1;        /* SR1 / BaseR */
+    uint8_t sr2;        /* SR2 */
+    uint8_t imm_flag;
+    uint8_t valid;
+    uint16_t imm;       /* sign extended imm5/offset6/PCoffset9/PCoffset11 or trapvect8 */
+} decoded_instr;
+
+/* translated basic block
+ * a straight-line run of LC-3 code ending at BR/JMP/JSR/TRAP, turned
+ * into micro-ops once. PC relative operands are resolved to absolute
+ * addresses and common instruction pairs are fused. */
+enum{ MAX_BLOCK_LEN=32 };
+
+enum{
+    UOP_ADD=0,
+    UOP_ADD_IMM,
+    UOP_AND,
+    UOP_AND_IMM,
+    UOP_NOT,
+    UOP_LD,
+    UOP_LDI,
+    UOP_LDR,
+    UOP_LEA,
+    UOP_ST,
+    UOP_STI,
+    UOP_STR,
+    /* superinstructions */
+    UOP_CONST,          /* AND R,R,#0 ; ADD R,R,#imm */
+    UOP_LDR_ADD_IMM,    /* LDR ; ADD imm */
+    /* block terminators */
+    UOP_BR,
+    UOP_ADD_IMM_BR,     /* ADD imm ; BR */
+    UOP_JMP,
+    UOP_JSR,
+    UOP_JSRR,
+    UOP_TRAP,
+    UOP_EXIT,           /* block cut short, continue at next */
+    UOP_IDLE            /* KBSR polling loop at imm, see idle_wait */
+};
+
+typedef struct{
+    uint8_t kind;
+    uint8_t a,b,c;      /* registers of the first instruction, nzp mask */
+    uint8_t d,e;        /* registers of the fused instruction */
+    uint8_t count;      /* instructions retired once this uop completes */
+    uint8_t pad;
+    uint16_t imm;       /* immediate, offset or absolute address */
+    uint16_t imm2;      /* immediate of the fused instruction or branch target */
+    uint16_t next;      /* address following this uop */
+} uop;
+
+/* native code for a block, see the JIT section */
+typedef int64_t (*jit_fn)(struct lc3_vm* vm,uint64_t budget);
+
+typedef struct block{
+    struct block* next_retired;
+    jit_fn native;      /* compiled code once the block is hot */
+    uint32_t hits;      /* executions of this start address */
+    uint16_t start;
+    uint16_t len;       /* LC-3 instructions covered */
+    uop uops[];
+} block;
+
+/* console output policy */
+enum{
+    OUTPUT_IMMEDIATE=0,     /* stdio buffering, flushed after every string */
+    OUTPUT_BUFFERED         /* held per machine until input is awaited */
+};
+
+const char* output_policy_names[]={
+    "immediate",
+    "buffered"
 };
 
+enum{
+    OUTPUT_BUFFER_SIZE=16384,
+    OUTPUT_FLUSH_MS=50      /* oldest buffered byte waits at most this long */
+};
+
+int parse_output_policy(const char* name){
+    for(int i=0;i<(int)(sizeof(output_policy_names)/sizeof(output_policy_names[0]));++i){
+        if(strcmp(name,output_policy_names[i])==0){
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* what a KBSR polling loop does while the program waits for a key */
+enum{
+    IDLE_FIXED=0,       /* sleep, then credit idle_iterations, for reproducible runs */
+    IDLE_ELAPSED,       /* sleep, then credit the iterations the wait would have run */
+    IDLE_OFF            /* spin like the hardware */
+};
+
+/* iterations credited per nanosecond slept under IDLE_ELAPSED,
+ * roughly what the threaded engine manages on a three instruction loop */
+enum{ IDLE_NS_PER_ITERATION=10 };
+
+/* iterations credited per wait by default. programs that seed a random
+ * number generator from the polling loop get the same seed for the
+ * same keys on every run; --idle elapsed brings back the wall clock */
+enum{ IDLE_ITERATIONS=1000 };
+
+/* why run_engine came back before its budget ran out on a running
+ * machine, see the Debugger section */
+enum{
+    STOP_NONE=0,
+    STOP_BREAK,         /* in front of a breakpoint */
+    STOP_WATCH,         /* after an access to a watched word */
+    STOP_INTERRUPT,     /* the user asked */
+    STOP_HALT           /* MCR was cleared, run_engine returns 0 instead */
+};
+
+struct lc3_profile;
+struct lc3_trace;
+struct lc3_debugger;
+
+/* one LC-3 machine
+ * everything an instruction can touch lives here, so a process can
+ * host as many machines as it likes. the large tables are mapped on
+ * demand and only cost memory for the pages a program actually uses. */
+typedef struct lc3_vm{
+    uint16_t* memory;           /* 65536 locations */
+    uint16_t reg[R_COUNT];
+    uint16_t cond_result;       /* last result, see cond_flags */
+    FILE* in;
+    FILE* out;
+    int input_eof;              /* a read found the input exhausted */
+    int engine;
+    uint64_t icount;            /* instructions retired, exact between run_engine calls */
+    uint64_t budget_left;       /* set by the engines, what a halted run did not use */
+
+    /* input recording and replay, see the Record and Replay section */
+    FILE* record;               /* input events are logged here */
+    uint64_t record_icount;     /* icount of the last logged event */
+    int record_eof;             /* the last logged event was EVENT_EOF */
+    struct replay_log* replay;  /* events fed back in place of input */
+
+    /* execution counts, see the Profiler section */
+    struct lc3_profile* profile;
+
+    /* a binary log of every step, see the Tracing section */
+    struct lc3_trace* trace;
+
+    /* breakpoints and watchpoints, see the Debugger section */
+    struct lc3_debugger* debug;
+    int stop;                   /* why the last run stopped short, STOP_NONE if it did not */
+
+    /* a loaded operating system, see the Operating System section */
+    int os;                     /* TRAP, RTI and RES go through the vector tables */
+    int hle;                    /* traps still on the OS's own routines run natively */
+    uint16_t psr;               /* privilege and priority, the flags live in cond_result */
+    uint16_t saved_ssp;         /* R6 of the mode that is not running */
+    uint16_t saved_usp;
+    uint16_t os_vectors[TRAP_HALT-TRAP_GETC+1];   /* x20-x25 as the OS loaded them */
+
+    /* memory mapped devices, see lc3_map_device */
+    uint8_t device_page[MEMORY_PAGES];  /* set for pages with a device */
+    lc3_device devices[MEMORY_PAGES];
+
+    /* copy-on-write snapshots, see lc3_snapshot */
+    uint8_t dirty_page[MEMORY_PAGES];   /* stored to since snapshot_pages was taken */
+    struct snapshot_page* snapshot_pages[MEMORY_PAGES];  /* last saved contents, NULL for zeros */
+
+    /* polling loops on KBSR sleep instead of spinning, see idle_wait */
+    int idle_policy;
+    uint64_t idle_iterations;   /* credited per wait under IDLE_FIXED */
+
+    /* console output held back under OUTPUT_BUFFERED */
+    int output_policy;
+    FILE* output_stream;        /* where the held output goes */
+    size_t output_len;
+    uint64_t output_since;      /* monotonic_ns of the oldest held byte */
+    char* output;               /* OUTPUT_BUFFER_SIZE, allocated by the first held byte */
+
+    /* code caches */
+    decoded_instr* decoded;     /* pre-decoded form of every word */
+    block** blocks;             /* translated blocks by start address */
+    size_t block_count;         /* live entries in blocks, skips the scans when zero */
+    uint8_t* code_words;        /* set for words with a cached decode or block */
+    block* retired_blocks;      /* freed once no block is running */
+    int code_modified;          /* a store retired a block */
+
+    /* native code, see the JIT section */
+    uint8_t* jit_arena;
+    size_t jit_used;
+    int jit_full;               /* flush the arena at the next safe point */
+    int jit_disabled;
+} lc3_vm;
+
+/* set the PC to starting position */
+/* 0x3000 is the default */
+enum{PC_START=0x3000};
+
+enum{ MEMORY_WORDS=UINT16_MAX+1 };
+
+/* large zeroed tables, mapped on demand where the platform allows */
+void* lc3_alloc(size_t size){
+#ifdef _WIN32
+    return calloc(1,size);
+#else
+    void* p=mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+    return p==MAP_FAILED?NULL:p;
+#endif
+}
+
+void lc3_free(void* p,size_t size){
+#ifdef _WIN32
+    free(p);
+#else
+    if(p){
+        munmap(p,size);
+    }
+#endif
+}
+
+/* zero a table again, handing its pages back to the system */
+void lc3_zero(void* p,size_t size){
+#ifdef _WIN32
+    memset(p,0,size);
+#else
+    if(mmap(p,size,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANONYMOUS|MAP_FIXED,-1,0)==MAP_FAILED){
+        memset(p,0,size);
+    }
+#endif
+}
+
 uint16_t swap16(uint16_t x){
     return (x<<8)|(x>>8);
 }
@@ -146,1029 +566,8358 @@ uint16_t sign_extend(uint16_t x,int bit_count){
     return x;
 }
 
-void mem_write(uint16_t address,uint16_t val){
-    memory[address]=val;
+/* drop every block covering address
+ * blocks can still be running, so they are only queued for freeing */
+void retire_blocks(lc3_vm* vm,uint16_t address){
+    for(int i=0;i<MAX_BLOCK_LEN;++i){
+        uint16_t start=address-i;
+        block* b=vm->blocks[start];
+        if(b&&(uint16_t)(address-start)<b->len){
+            vm->blocks[start]=NULL;
+            vm->block_count--;
+            b->next_retired=vm->retired_blocks;
+            vm->retired_blocks=b;
+            vm->code_modified=1;
+        }
+    }
+    vm->code_words[address]=0;
 }
 
-uint16_t mem_read(uint16_t address){
-    /* reading the memory mapped keyboard register triggers a key check */
-    if(address==MR_KBSR){
-        if(check_key()){
-            memory[MR_KBSR]=(1<<15);
-            memory[MR_KBDR]=getchar();
-        }else{
-            memory[MR_KBSR]=0;
-        }
+/* forget anything derived from the word at address */
+void invalidate_code(lc3_vm* vm,uint16_t address){
+    if(vm->code_words[address]){
+        vm->decoded[address].valid=0;
+        retire_blocks(vm,address);
     }
-    return memory[address];
 }
 
-void update_flags(uint16_t r){
-    if(reg[r]==0){
-        reg[R_COND]=FL_ZRO;
-    }else if(reg[r]>>15){
-        reg[R_COND]=FL_NEG;
+/* kept out of line so plain loads and stores stay small */
+__attribute__((noinline)) void device_write(lc3_vm* vm,uint16_t address,uint16_t val){
+    lc3_device* dev=&vm->devices[address>>MEMORY_PAGE_SHIFT];
+    if(dev->write){
+        dev->write(vm,dev->ctx,address,val);
     }else{
-        reg[R_COND]=FL_POS;
+        vm->memory[address]=val;
     }
 }
 
-void read_image_file(FILE* file){
-    /* origin tells us where in memory to place the image */
-    uint16_t origin;
-    fread(&origin,sizeof(origin),1,file);
-    origin=swap16(origin);
-
-    /* we know the maximum file size so we only need one fread */
-    uint16_t max_read=UINT16_MAX-origin;
-    uint16_t* p=memory+origin;
-    size_t read=fread(p,sizeof(uint16_t),max_read,file);
+void mem_write(lc3_vm* vm,uint16_t address,uint16_t val){
+    if(__builtin_expect(vm->device_page[address>>MEMORY_PAGE_SHIFT],0)){
+        device_write(vm,address,val);
+    }else{
+        vm->memory[address]=val;
+    }
+    vm->dirty_page[address>>MEMORY_PAGE_SHIFT]=1;
+    invalidate_code(vm,address);
+}
 
-    /* swap to little endian */
-    while(read-- >0){
-        *p=swap16(*p);
-        ++p;
+/* for writes that bypass mem_write, so the next snapshot sees them */
+void mark_dirty(lc3_vm* vm,uint16_t address,size_t words){
+    for(size_t page=address>>MEMORY_PAGE_SHIFT;page<MEMORY_PAGES&&page<<MEMORY_PAGE_SHIFT<address+words;++page){
+        vm->dirty_page[page]=1;
     }
+}
 
+/* one write for everything held back */
+void output_flush(lc3_vm* vm){
+    if(vm->output_len){
+        fwrite(vm->output,1,vm->output_len,vm->output_stream);
+        fflush(vm->output_stream);
+        vm->output_len=0;
+    }
 }
 
-int read_image(const char* image_path){
-    FILE* file=fopen(image_path,"rb");
-    if(!file){return 0;}
-    read_image_file(file);
-    fclose(file);
-    return 1;
+void output_char(lc3_vm* vm,FILE* out,char c){
+    if(vm->output_policy==OUTPUT_IMMEDIATE){
+        putc(c,out);
+        return;
+    }
+    if(!vm->output&&!(vm->output=malloc(OUTPUT_BUFFER_SIZE))){
+        /* nowhere to hold it */
+        putc(c,out);
+        return;
+    }
+    if(vm->output_stream!=out){
+        output_flush(vm);
+        vm->output_stream=out;
+    }
+    if(!vm->output_len){
+        vm->output_since=monotonic_ns();
+    }
+    vm->output[vm->output_len++]=c;
+    if(vm->output_len==OUTPUT_BUFFER_SIZE){
+        output_flush(vm);
+    }
 }
 
-/* execute trap routine */
-int execute_trap(uint16_t instr,FILE* in,FILE* out){
-    int running=1;
-    switch(instr&0xFF){
-        case TRAP_GETC:
-            {
-                uint16_t c=getc(in);
-                reg[R_R0]=c;
-            }
-            break;
-        case TRAP_OUT:
-            {
-                char c=(char)reg[R_R0&0xff];
-                putc(c,out);
-            }
-            break;
-        case TRAP_PUTS:
-            {
-                uint16_t* word=memory+reg[R_R0];
-                while(*word){
-                    putc((char)(*word&0xff),out);
-                    word++;
-                }
-                fflush(out);
-            }
-            break;
-        case TRAP_IN:
-            {
-                fprintf(out,"Enter a character: ");
-                fflush(out);
-                uint16_t c=getc(in);
-                putc((char)c,out);
-                fflush(out);
-                reg[R_R0]=c;
-            }
-            break;
-        case TRAP_PUTSP:
-            {
-                /* one char per byte(two bytes per word) */
-                uint16_t* word=memory+reg[R_R0];
-                while(*word){
-                    putc((char)(*word&0xff),out);
-                    char c=*word>>8;
-                    if(c){
-                        putc(c,out);
-                    }
-                    word++;
-                }
-                fflush(out);
-            }
-            break;
-        case TRAP_HALT:
-            {
-                fputs("HALT\n",out);
-                fflush(out);
-                running=0;
-            }
-            break;
+/* flush held output once it has waited long enough */
+void output_flush_due(lc3_vm* vm){
+    if(vm->output_len&&monotonic_ns()-vm->output_since>=(uint64_t)OUTPUT_FLUSH_MS*1000000){
+        output_flush(vm);
     }
+}
 
-    return running;
+/* the end of a string */
+void output_done(lc3_vm* vm,FILE* out){
+    if(vm->output_policy==OUTPUT_IMMEDIATE){
+        fflush(out);
+    }else{
+        output_flush_due(vm);
+    }
 }
 
-int read_and_execute_instruction(){
-    int running=1;
-    int is_max=R_PC==UINT16_MAX;
+/** Record and Replay **/
+
+/* input is the only thing that makes a run differ from the last one:
+ * which byte arrives, at which instruction, and how many iterations an
+ * idle loop was credited while it slept. a recording logs those events
+ * against vm->icount, a replay hands them back at the same counts, so
+ * the session repeats exactly, at full speed and without a terminal.
+ *
+ * the log is a magic followed by events, each a LEB128 icount delta
+ * from the previous event and a LEB128 value: a byte, EVENT_EOF,
+ * EVENT_END, or EVENT_IDLE followed by the iterations credited.
+ * exhausted input stays exhausted, so only the first of a run of
+ * EOF reads is logged. */
+#define RECORD_MAGIC "LC3REC1\n"
 
-    /* FETCH */
-    uint16_t instr=mem_read(reg[R_PC]++);
-    uint16_t op=instr>>12;
+enum{
+    EVENT_EOF=256,      /* a read found the input exhausted */
+    EVENT_IDLE,         /* an idle loop was credited */
+    EVENT_END           /* the recording stopped here */
+};
 
-    switch(op){
-        case OP_ADD:
-            {
-                uint16_t dr=(instr>>9)&0x7;
-                uint16_t sr1=(instr>>6)&0x7;
-                uint16_t imm_flag=(instr>>5)&0x1;
-                if(imm_flag){
-                    uint16_t imm5=sign_extend(instr&0x1f,5);
-                    reg[dr]=reg[sr1]+imm5;
-                }else{
-                    uint16_t sr2=instr&0x7;
-                    reg[dr]=reg[sr1]+reg[sr2];
-                }
-                update_flags(dr);
-            }
-            break;
-        case OP_AND:
-            {
-                uint16_t dr=(instr>>9)&0x7;
-                uint16_t sr1=(instr>>6)&0x7;
-                uint16_t imm_flag=(instr>>5)&0x1;
-                if(imm_flag){
-                    uint16_t imm5=sign_extend(instr&0x1f,5);
-                    reg[dr]=reg[sr1]&imm5;
-                }else{
-                    uint16_t sr2=instr&0x7;
-                    reg[dr]=reg[sr1]&reg[sr2];
-                }
-                update_flags(dr);
-            }
-            break;
-        case OP_NOT:
-            {
-                uint16_t dr=(instr>>9)&0x7;
-                uint16_t sr=(instr>>6)&0x7;
-                reg[dr]=~reg[sr];
-                update_flags(dr);
-            }
-            break;
-        case OP_BR:
-            {
-                uint16_t n_flag=(instr>>11)&0x1;
-                uint16_t z_flag=(instr>>10)&0x1;
-                uint16_t p_flag=(instr>>9) &0x1;
-
-                /* PCoffset 9 */
-                uint16_t pc_offset=sign_extend(instr&0x1ff,9);
-                /*
-                 * n_flag is set and negatiev condition flag is set
-                 * z_flag is set and zero condition flag is set
-                 * p_flag is set and positive condition flag is set
-                 * */
-                if((n_flag && (reg[R_COND]& FL_NEG))||
-                   (z_flag && (reg[R_COND]& FL_ZRO))||
-                   (p_flag && (reg[R_COND]& FL_POS))){
-                    reg[R_PC]+=pc_offset;
-                }
-            }
-            break;
-        case OP_JMP:
-            {
-                uint16_t base_r=(instr>>6)&0x7;
-                reg[R_PC]=reg[base_r];
-            }
-            break;
-        case OP_JSR:
-            {
-                /* save pc in R7 to jump back to later */
-                reg[R_R7]=reg[R_PC];
-                uint16_t imm_flag=(instr>>11)&0x1;
-                if(imm_flag){
-                    uint16_t pc_offset=sign_extend(instr&0x7ff,11);
-                    reg[R_PC]+=pc_offset;
-                }else{
-                    uint16_t base_r=(instr>>6)&0x7;
-                    reg[R_PC]=reg[base_r];
-                }
-            }
-            break;
-        case OP_LD:
-            {
-                uint16_t dr=(instr>>9)&0x7;
-                uint16_t pc_offset=sign_extend(instr&0x1ff,9);
-                /* add pc_offset to the current pc and load that memory location */
-                reg[dr]=mem_read(reg[R_PC]+pc_offset);
-                update_flags(dr);
-            }
-            break;
-        case OP_LDI:
-            {
-                uint16_t dr=(instr>>9)&0x7;
-                uint16_t pc_offset=sign_extend(instr&0x1ff,9);
-                /* add pc_offset to the current PC, look at that memory
-                 * location to get the final address */
-                reg[dr]=mem_read(mem_read(reg[R_PC]+pc_offset));
-                update_flags(dr);
-            }
-            break;
-        case OP_LDR:
-            {
-                uint16_t dr=(instr>>9)&0x7;
-                uint16_t base_r=(instr>>6)&0x7;
-                uint16_t offset=sign_extend(instr&0x3f,6);
-                reg[dr]=mem_read(reg[base_r]+offset);
-                update_flags(dr);
-            }
-            break;
-        case OP_LEA:
-            {
-                uint16_t dr=(instr>>9)&0x7;
-                uint16_t pc_offset=sign_extend(instr&0x1ff,9);
-                reg[dr]=reg[R_PC]+pc_offset;
-                update_flags(dr);
-            }
-            break;
-        case OP_ST:
-            {
-                uint16_t sr=(instr>>9)&0x7;
-                uint16_t pc_offset=sign_extend(instr&0x1ff,9);
-                mem_write(reg[R_PC]+pc_offset,reg[sr]);
-            }
-            break;
-        case OP_STI:
-            {
-                uint16_t sr=(instr>>9)&0x7;
-                uint16_t pc_offset=sign_extend(instr&0x1ff,9);
-                mem_write(mem_read(reg[R_PC]+pc_offset),reg[sr]);
-            }
-            break;
-        case OP_STR:
-            {
-                uint16_t sr=(instr>>9)&0x7;
-                uint16_t base_r=(instr>>6)&0x7;
-                uint16_t offset=sign_extend(instr& 0x3f,6);
-                mem_write(reg[base_r]+offset,reg[sr]);
-            }
-            break;
-        case OP_TRAP:
-            running=execute_trap(instr,stdin,stdout);
-            break;
-        case OP_RES:
-        case OP_RTI:
-        default:
-            abort();
-            break;
+/* instructions run at a time once nothing is due */
+enum{ REPLAY_CHUNK=1<<16 };
+
+typedef struct{
+    uint64_t icount;
+    uint32_t value;
+    uint64_t iterations;    /* for EVENT_IDLE */
+} replay_event;
+
+typedef struct replay_log{
+    replay_event* events;
+    size_t count;
+    size_t pos;             /* next event to hand out */
+    int done;               /* the program asked for input past the end */
+    int eof;                /* reads return EOF until the next byte is due */
+    int idle_due;           /* credit idle_iterations at the next idle loop */
+    uint64_t idle_iterations;
+} replay_log;
+
+void put_varint(FILE* f,uint64_t x){
+    while(x>=0x80){
+        putc((x&0x7f)|0x80,f);
+        x>>=7;
     }
+    putc(x,f);
+}
 
-    if(running&&is_max){
-        printf("Program counter overflow!\n");
-        return 0;
+int get_varint(FILE* f,uint64_t* x){
+    *x=0;
+    for(int shift=0;shift<64;shift+=7){
+        int c=getc(f);
+        if(c==EOF){
+            return 0;
+        }
+        *x|=(uint64_t)(c&0x7f)<<shift;
+        if(!(c&0x80)){
+            return 1;
+        }
     }
+    return 0;
+}
 
-    return running;
+int record_start(lc3_vm* vm,FILE* f){
+    vm->record=f;
+    vm->record_icount=vm->icount;
+    return fwrite(RECORD_MAGIC,1,strlen(RECORD_MAGIC),f)==strlen(RECORD_MAGIC);
 }
 
+void record_event(lc3_vm* vm,uint32_t value){
+    if(value==EVENT_EOF&&vm->record_eof){
+        return;
+    }
+    vm->record_eof=value==EVENT_EOF;
+    put_varint(vm->record,vm->icount-vm->record_icount);
+    put_varint(vm->record,value);
+    vm->record_icount=vm->icount;
+}
 
-/** Tests **/
+void record_end(lc3_vm* vm){
+    if(vm->record){
+        record_event(vm,EVENT_END);
+        fflush(vm->record);
+        vm->record=NULL;
+    }
+}
 
-int test_add_instr_1() {
-  int pass = 1;
+/* an interrupted recording still ends where the user stopped it */
+lc3_vm* recording_vm;
 
-  uint16_t add_instr =
+void handle_record_interrupt(int signal){
+    record_end(recording_vm);
+    handle_interrupt(signal);
+}
+
+/* NULL on a log that does not parse */
+replay_log* replay_open(FILE* f){
+    char magic[sizeof(RECORD_MAGIC)-1];
+    if(fread(magic,1,sizeof(magic),f)!=sizeof(magic)||memcmp(magic,RECORD_MAGIC,sizeof(magic))!=0){
+        return NULL;
+    }
+    replay_log* r=calloc(1,sizeof(replay_log));
+    size_t capacity=0;
+    uint64_t icount=0,delta,value;
+    while(r&&get_varint(f,&delta)){
+        replay_event e={.icount=icount+=delta};
+        int ok=get_varint(f,&value)&&value<=EVENT_END;
+        e.value=value;
+        if(ok&&value==EVENT_IDLE){
+            ok=get_varint(f,&e.iterations);
+        }
+        if(ok&&r->count==capacity){
+            capacity=capacity?capacity*2:256;
+            replay_event* events=realloc(r->events,capacity*sizeof(replay_event));
+            ok=events!=NULL;
+            if(ok){
+                r->events=events;
+            }
+        }
+        if(!ok){
+            free(r->events);
+            free(r);
+            return NULL;
+        }
+        r->events[r->count++]=e;
+    }
+    return r;
+}
+
+void replay_close(replay_log* r){
+    if(r){
+        free(r->events);
+        free(r);
+    }
+}
+
+/* the next byte is due once the machine has reached its count */
+int replay_due(lc3_vm* vm){
+    replay_log* r=vm->replay;
+    return r->pos<r->count&&r->events[r->pos].value<EVENT_IDLE&&r->events[r->pos].icount<=vm->icount;
+}
+
+int replay_ready(lc3_vm* vm){
+    replay_log* r=vm->replay;
+    if(replay_due(vm)||r->eof){
+        return 1;
+    }
+    if(r->pos==r->count){
+        r->done=1;
+    }
+    return 0;
+}
+
+int replay_getc(lc3_vm* vm){
+    replay_log* r=vm->replay;
+    if(!replay_due(vm)&&r->eof){
+        return EOF;
+    }
+    /* a blocking read takes the next byte whatever its count */
+    if(r->pos==r->count||r->events[r->pos].value>=EVENT_IDLE){
+        r->done=1;
+        return EOF;
+    }
+    uint32_t value=r->events[r->pos++].value;
+    r->eof=value==EVENT_EOF;
+    return r->eof?EOF:(int)value;
+}
+
+/** Input and Memory **/
+
+/* a byte from in, through the reader thread when it owns stdin */
+int input_getc(lc3_vm* vm,FILE* in){
+    if(vm->replay){
+        return replay_getc(vm);
+    }
+    int c;
+#ifdef HAVE_KEYBOARD_THREAD
+    if(in==stdin&&keyboard.started){
+        c=keyboard_getc();
+    }else
+#endif
+    c=getc(in);
+    if(vm->record){
+        record_event(vm,c==EOF?EVENT_EOF:(uint8_t)c);
+    }
+    return c;
+}
+
+/* the terminal is polled, any other stream is ready until it runs dry */
+int input_ready(lc3_vm* vm){
+    if(vm->replay){
+        return replay_ready(vm);
+    }
+    if(vm->in==stdin){
+#ifdef HAVE_KEYBOARD_THREAD
+        if(keyboard.started){
+            return keyboard_ready();
+        }
+        if(keyboard.from_file){
+            return 1;
+        }
+#endif
+        return check_key();
+    }
+    int c=getc(vm->in);
+    if(c==EOF){
+        vm->input_eof=1;
+        return 0;
+    }
+    ungetc(c,vm->in);
+    return 1;
+}
+
+/* sleep until input_ready would say yes */
+void input_park(lc3_vm* vm){
+#ifdef HAVE_KEYBOARD_THREAD
+    if(keyboard.started){
+        keyboard_wait();
+        return;
+    }
+#endif
+#ifdef _WIN32
+    while(!check_key()){
+    }
+#else
+    struct pollfd fd={STDIN_FILENO,POLLIN,0};
+    while(poll(&fd,1,-1)<0&&errno==EINTR){
+    }
+#endif
+}
+
+__attribute__((noinline)) uint16_t device_read(lc3_vm* vm,uint16_t address){
+    lc3_device* dev=&vm->devices[address>>MEMORY_PAGE_SHIFT];
+    if(dev->read){
+        return dev->read(vm,dev->ctx,address);
+    }
+    return vm->memory[address];
+}
+
+uint16_t mem_read(lc3_vm* vm,uint16_t address){
+    if(__builtin_expect(vm->device_page[address>>MEMORY_PAGE_SHIFT],0)){
+        return device_read(vm,address);
+    }
+    return vm->memory[address];
+}
+
+/* reading the memory mapped keyboard register triggers a key check,
+ * the program is waiting for input so show it everything so far */
+uint16_t keyboard_device_read(lc3_vm* vm,void* ctx,uint16_t address){
+    if(address==MR_KBSR){
+        output_flush(vm);
+        if(input_ready(vm)){
+            vm->memory[MR_KBSR]=(1<<15);
+            vm->memory[MR_KBDR]=input_getc(vm,vm->in);
+        }else{
+            vm->memory[MR_KBSR]=0;
+        }
+    }
+    return vm->memory[address];
+}
+
+/* condition codes are evaluated lazily: only the last result is kept
+ * and N/Z/P are derived from it when a BR or an observer asks */
+void update_flags(lc3_vm* vm,uint16_t r){
+    vm->cond_result=vm->reg[r];
+}
+
+uint16_t cond_flags(lc3_vm* vm){
+    /* shift FL_POS up by one for zero, by two for negative */
+    return FL_POS<<((vm->cond_result>>15<<1)|(vm->cond_result==0));
+}
+
+/* a result that yields the given flags, for setting them from outside.
+ * N wins over P, and no flags at all reads back as Z since a result
+ * always has exactly one */
+void set_cond_flags(lc3_vm* vm,uint16_t flags){
+    if(flags&FL_NEG){
+        vm->cond_result=0x8000;
+    }else if(flags&FL_POS){
+        vm->cond_result=1;
+    }else{
+        vm->cond_result=0;
+    }
+}
+
+/** Images **/
+
+/* image loading failures */
+enum{
+    IMAGE_OK=0,
+    IMAGE_OPEN_FAILED,
+    IMAGE_TRUNCATED,        /* no origin, or no words after it */
+    IMAGE_ODD_LENGTH,       /* a trailing half word */
+    IMAGE_TOO_LONG,         /* words past xFFFF */
+    IMAGE_BAD_CACHE         /* an .lc3img that does not check out */
+};
+
+const char* image_errors[]={
+    "ok",
+    "cannot open",
+    "truncated",
+    "odd length",
+    "runs past xFFFF",
+    "not a valid .lc3img"
+};
+
+/* where an image landed */
+typedef struct{
+    uint16_t origin;
+    uint32_t words;
+} image_span;
+
+/* .obj files are big-endian, swap n words in place */
+typedef void (*swap_fn)(uint16_t* p,size_t n);
+
+void swap16_words_generic(uint16_t* p,size_t n){
+    for(size_t i=0;i<n;++i){
+        p[i]=swap16(p[i]);
+    }
+}
+
+#if defined(__GNUC__)&&(defined(__x86_64__)||defined(__i386__))
+#define HAVE_SWAP_SIMD 1
+#endif
+
+#ifdef HAVE_SWAP_SIMD
+/* pshufb swaps the bytes of 8 or 16 words at once, the tail is scalar */
+__attribute__((target("ssse3"))) void swap16_words_ssse3(uint16_t* p,size_t n){
+    const __m128i order=_mm_setr_epi8(1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14);
+    size_t i=0;
+    for(;i+8<=n;i+=8){
+        __m128i v=_mm_loadu_si128((const __m128i*)(p+i));
+        _mm_storeu_si128((__m128i*)(p+i),_mm_shuffle_epi8(v,order));
+    }
+    swap16_words_generic(p+i,n-i);
+}
+
+__attribute__((target("avx2"))) void swap16_words_avx2(uint16_t* p,size_t n){
+    const __m256i order=_mm256_setr_epi8(1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14,
+                                         1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14);
+    size_t i=0;
+    for(;i+16<=n;i+=16){
+        __m256i v=_mm256_loadu_si256((const __m256i*)(p+i));
+        _mm256_storeu_si256((__m256i*)(p+i),_mm256_shuffle_epi8(v,order));
+    }
+    swap16_words_generic(p+i,n-i);
+}
+#endif
+
+/* the widest swap this cpu runs */
+swap_fn swap16_words_best(){
+#ifdef HAVE_SWAP_SIMD
+    if(__builtin_cpu_supports("avx2")){
+        return swap16_words_avx2;
+    }
+    if(__builtin_cpu_supports("ssse3")){
+        return swap16_words_ssse3;
+    }
+#endif
+    return swap16_words_generic;
+}
+
+int read_image_file(lc3_vm* vm,FILE* file,image_span* span){
+    /* origin tells us where in memory to place the image */
+    uint16_t origin;
+    if(fread(&origin,sizeof(origin),1,file)!=1){
+        return IMAGE_TRUNCATED;
+    }
+    origin=swap16(origin);
+
+    /* we know the maximum file size so we only need one fread,
+     * one byte more shows the image does not fit */
+    size_t max_read=(MEMORY_WORDS-origin)*sizeof(uint16_t);
+    uint16_t* p=vm->memory+origin;
+    size_t read=fread(p,1,max_read,file);
+    if(read==max_read&&getc(file)!=EOF){
+        return IMAGE_TOO_LONG;
+    }
+    if(read&1){
+        return IMAGE_ODD_LENGTH;
+    }
+    if(read==0){
+        return IMAGE_TRUNCATED;
+    }
+
+    /* swap to little endian */
+    size_t words=read/sizeof(uint16_t);
+    swap16_words_best()(p,words);
+    for(size_t i=0;i<words;++i){
+        invalidate_code(vm,origin+i);
+    }
+    span->origin=origin;
+    span->words=words;
+    return IMAGE_OK;
+}
+
+/* pre-swapped images
+ * an .lc3img holds the words of one .obj in host order, each at the
+ * file offset matching its address, so whole pages can be mapped
+ * copy-on-write straight into a machine. machines started from the
+ * same image share those pages until they store to them. */
+#define IMAGE_MAGIC "LC3IMG1"
+
+enum{
+    IMAGE_BYTE_ORDER=0x0102,
+    IMAGE_DATA_OFFSET=65536     /* past the header, aligned for any page size */
+};
+
+typedef struct{
+    char magic[8];
+    uint16_t byte_order;        /* IMAGE_BYTE_ORDER as the writer saw it */
+    uint16_t origin;
+    uint32_t words;
+    uint64_t source_size;       /* the .obj it was made from, zero if none */
+    int64_t source_mtime;
+    uint64_t source_hash;       /* of an assembled source, zero for an .obj */
+} image_header;
+
+/* look for name.lc3img next to name.obj and write it on a miss */
+int use_image_cache=0;
+
+int bytes_zero(const char* p,size_t n){
+    for(size_t i=0;i<n;++i){
+        if(p[i]){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+#ifndef _WIN32
+/* an .obj cache is current while its source keeps its size and mtime,
+ * an assembled one while its source hashes the same */
+int read_cached_image(lc3_vm* vm,const char* path,const struct stat* source,uint64_t hash,image_span* span){
+    int fd=open(path,O_RDONLY);
+    if(fd<0){
+        return IMAGE_OPEN_FAILED;
+    }
+    struct stat st;
+    image_header h;
+    if(pread(fd,&h,sizeof(h),0)!=(ssize_t)sizeof(h)||memcmp(h.magic,IMAGE_MAGIC,sizeof(h.magic))!=0||
+       h.byte_order!=IMAGE_BYTE_ORDER||h.origin+(size_t)h.words>MEMORY_WORDS||
+       (source&&(h.source_size!=(uint64_t)source->st_size||h.source_hash!=hash||
+                 (!hash&&h.source_mtime!=(int64_t)source->st_mtime)))){
+        close(fd);
+        return IMAGE_BAD_CACHE;
+    }
+
+    /* map the pages the image touches, the file is zero around the
+     * image so a page can be shared whole when the machine has nothing
+     * else in it. otherwise only read the ragged ends */
+    size_t page=sysconf(_SC_PAGESIZE);
+    size_t begin=(size_t)h.origin*2,end=begin+(size_t)h.words*2;
+    size_t map_begin=begin/page*page,map_end=(end+page-1)/page*page;
+    if(!bytes_zero((char*)vm->memory+map_begin,begin-map_begin)){
+        map_begin+=page;
+    }
+    if(!bytes_zero((char*)vm->memory+end,map_end-end)||
+       fstat(fd,&st)!=0||(size_t)st.st_size<IMAGE_DATA_OFFSET+map_end){
+        map_end-=page;
+    }
+    if(page>IMAGE_DATA_OFFSET||map_begin>=map_end||
+       mmap((char*)vm->memory+map_begin,map_end-map_begin,PROT_READ|PROT_WRITE,
+            MAP_PRIVATE|MAP_FIXED,fd,IMAGE_DATA_OFFSET+map_begin)==MAP_FAILED){
+        map_begin=map_end=end;
+    }
+    size_t head=map_begin>begin?map_begin-begin:0,tail=end>map_end?end-map_end:0;
+    int ok=pread(fd,(char*)vm->memory+begin,head,IMAGE_DATA_OFFSET+begin)==(ssize_t)head&&
+           pread(fd,(char*)vm->memory+map_end,tail,IMAGE_DATA_OFFSET+map_end)==(ssize_t)tail;
+    close(fd);
+    for(uint32_t i=0;i<h.words;++i){
+        invalidate_code(vm,h.origin+i);
+    }
+    span->origin=h.origin;
+    span->words=h.words;
+    return ok?IMAGE_OK:IMAGE_BAD_CACHE;
+}
+
+/* best effort, a machine that fails to write the cache still runs */
+void write_cached_image(lc3_vm* vm,const char* path,const image_span* span,const struct stat* source,uint64_t hash){
+    uint16_t origin=span->origin;
+    size_t words=span->words;
+    char tmp[4096];
+    if(snprintf(tmp,sizeof(tmp),"%s.XXXXXX",path)>=(int)sizeof(tmp)){
+        return;
+    }
+    /* written aside and renamed, other workers may be reading it */
+    int fd=mkstemp(tmp);
+    if(fd<0){
+        return;
+    }
+    image_header h={.byte_order=IMAGE_BYTE_ORDER,.origin=origin,.words=words,
+                    .source_size=source->st_size,.source_mtime=source->st_mtime,.source_hash=hash};
+    memcpy(h.magic,IMAGE_MAGIC,sizeof(h.magic));
+    int ok=pwrite(fd,&h,sizeof(h),0)==(ssize_t)sizeof(h)&&
+           pwrite(fd,vm->memory+origin,words*2,IMAGE_DATA_OFFSET+(off_t)origin*2)==(ssize_t)(words*2)&&
+           /* pad the last page so it can be mapped whole */
+           ftruncate(fd,IMAGE_DATA_OFFSET+((size_t)(origin+words)*2+IMAGE_DATA_OFFSET-1)/IMAGE_DATA_OFFSET*IMAGE_DATA_OFFSET)==0;
+    fchmod(fd,0644);
+    close(fd);
+    if(!ok||rename(tmp,path)!=0){
+        unlink(tmp);
+    }
+}
+
+/* name.obj or name.asm -> name.lc3img */
+int image_cache_path(const char* image_path,char* out,size_t size){
+    size_t len=strlen(image_path);
+    if(len>4&&(strcmp(image_path+len-4,".obj")==0||strcmp(image_path+len-4,".asm")==0)){
+        len-=4;
+    }
+    return snprintf(out,size,"%.*s.lc3img",(int)len,image_path)<(int)size;
+}
+#endif
+
+/* whole file in memory, so a job never touches the disk again */
+char* read_whole_file(const char* path,size_t* size){
+    FILE* file=fopen(path,"rb");
+    if(!file){
+        return NULL;
+    }
+    char* buf=NULL;
+    size_t cap=0;
+    *size=0;
+    for(;;){
+        if(*size==cap){
+            cap=cap?cap*2:4096;
+            char* grown=realloc(buf,cap);
+            if(!grown){
+                free(buf);
+                fclose(file);
+                return NULL;
+            }
+            buf=grown;
+        }
+        size_t n=fread(buf+*size,1,cap-*size,file);
+        if(!n){
+            break;
+        }
+        *size+=n;
+    }
+    fclose(file);
+    return buf;
+}
+
+int read_image(lc3_vm* vm,const char* image_path,image_span* span){
+#ifndef _WIN32
+    size_t len=strlen(image_path);
+    if(len>7&&strcmp(image_path+len-7,".lc3img")==0){
+        return read_cached_image(vm,image_path,NULL,0,span);
+    }
+    struct stat source;
+    char cache_path[4096];
+    int cached=use_image_cache&&stat(image_path,&source)==0&&
+               image_cache_path(image_path,cache_path,sizeof(cache_path));
+    if(cached&&read_cached_image(vm,cache_path,&source,0,span)==IMAGE_OK){
+        return IMAGE_OK;
+    }
+#endif
+    FILE* file=fopen(image_path,"rb");
+    if(!file){return IMAGE_OPEN_FAILED;}
+    int err=read_image_file(vm,file,span);
+    fclose(file);
+#ifndef _WIN32
+    if(cached&&err==IMAGE_OK){
+        write_cached_image(vm,cache_path,span,&source,0);
+    }
+#endif
+    return err;
+}
+
+/* load images in order, later ones win where they overlap */
+int read_images(lc3_vm* vm,char* const* paths,int count){
+    image_span* spans=calloc(count,sizeof(image_span));
+    int ok=spans!=NULL;
+    for(int i=0;ok&&i<count;++i){
+        int err=read_image(vm,paths[i],&spans[i]);
+        if(err!=IMAGE_OK){
+            fprintf(stderr,"failed to load image: %s: %s\n",paths[i],image_errors[err]);
+            ok=0;
+            break;
+        }
+        mark_dirty(vm,spans[i].origin,spans[i].words);
+        for(int k=0;k<i;++k){
+            uint32_t a=spans[i].origin,b=spans[k].origin;
+            if(a<b+spans[k].words&&b<a+spans[i].words){
+                fprintf(stderr,"warning: image %s overlaps %s at x%04X\n",paths[i],paths[k],a>b?a:b);
+            }
+        }
+    }
+    free(spans);
+    return ok;
+}
+
+decoded_instr decode_word(uint16_t instr){
+    decoded_instr out;
+    decoded_instr* d=&out;
+    d->op=instr>>12;
+    d->dr=(instr>>9)&0x7;
+    d->sr1=(instr>>6)&0x7;
+    d->sr2=instr&0x7;
+    d->imm_flag=(instr>>5)&0x1;
+    d->imm=0;
+    switch(d->op){
+        case OP_ADD:
+        case OP_AND:
+            d->imm=sign_extend(instr&0x1f,5);
+            break;
+        case OP_LDR:
+        case OP_STR:
+            d->imm=sign_extend(instr&0x3f,6);
+            break;
+        case OP_BR:
+        case OP_LD:
+        case OP_LDI:
+        case OP_LEA:
+        case OP_ST:
+        case OP_STI:
+            d->imm=sign_extend(instr&0x1ff,9);
+            break;
+        case OP_JSR:
+            d->imm_flag=(instr>>11)&0x1;
+            d->imm=sign_extend(instr&0x7ff,11);
+            break;
+        case OP_TRAP:
+            d->imm=instr&0xff;
+            break;
+    }
+    d->valid=1;
+    return out;
+}
+
+/** Idle Loops **/
+
+/* a loop that only counts while it polls the keyboard:
+ *     ADD Rn,Rn,#imm      any number, on registers other than Rd
+ *     LDI Rd,<KBSR>
+ *     BRz/BRzp <head>
+ * sleeping through it changes nothing but the counters, which are
+ * credited afterwards. 2048's GETC_SEED_LOOP is the model. */
+
+enum{ IDLE_MAX_BODY=8 };
+
+typedef struct{
+    int count;
+    uint8_t regs[IDLE_MAX_BODY];
+    uint16_t imms[IDLE_MAX_BODY];
+} idle_loop;
+
+int idle_loop_at(lc3_vm* vm,uint16_t head,idle_loop* loop){
+    loop->count=0;
+    uint16_t pc=head;
+    for(int i=0;i<IDLE_MAX_BODY;++i,++pc){
+        uint16_t instr=vm->memory[pc];
+        uint16_t op=instr>>12;
+        int dr=(instr>>9)&0x7;
+        if(op==OP_ADD&&(instr>>5&0x1)&&dr==((instr>>6)&0x7)){
+            loop->regs[loop->count]=dr;
+            loop->imms[loop->count++]=sign_extend(instr&0x1f,5);
+            continue;
+        }
+        if(op!=OP_LDI||vm->memory[(uint16_t)(pc+1+sign_extend(instr&0x1ff,9))]!=MR_KBSR){
+            return 0;
+        }
+        for(int k=0;k<loop->count;++k){
+            if(loop->regs[k]==dr){
+                return 0;
+            }
+        }
+        /* loop while KBSR reads zero, leave once bit 15 is set */
+        uint16_t br=vm->memory[(uint16_t)(pc+1)];
+        int nzp=(br>>9)&0x7;
+        return br>>12==OP_BR&&(nzp&FL_ZRO)&&!(nzp&FL_NEG)&&
+            (uint16_t)(pc+2+sign_extend(br&0x1ff,9))==head;
+    }
+    return 0;
+}
+
+void idle_fast_forward(lc3_vm* vm,const idle_loop* loop,uint64_t iterations){
+    for(int k=0;k<loop->count;++k){
+        vm->reg[loop->regs[k]]+=(uint16_t)(loop->imms[k]*iterations);
+    }
+}
+
+/* called at the head of a polling loop before it runs again. the loop
+ * is checked against memory each time, so stale marks are harmless */
+void idle_wait(lc3_vm* vm,uint16_t head){
+    idle_loop loop;
+    if(vm->replay){
+        /* the recording slept here, see run_replay */
+        if(vm->replay->idle_due&&idle_loop_at(vm,head,&loop)){
+            idle_fast_forward(vm,&loop,vm->replay->idle_iterations);
+            vm->replay->idle_due=0;
+        }
+        return;
+    }
+    if(vm->idle_policy==IDLE_OFF||vm->in!=stdin||input_ready(vm)||!idle_loop_at(vm,head,&loop)){
+        return;
+    }
+    output_flush(vm);
+    uint64_t start=monotonic_ns();
+    input_park(vm);
+    uint64_t iterations=vm->idle_policy==IDLE_FIXED?vm->idle_iterations:
+        (monotonic_ns()-start)/IDLE_NS_PER_ITERATION;
+    idle_fast_forward(vm,&loop,iterations);
+    if(vm->record){
+        record_event(vm,EVENT_IDLE);
+        put_varint(vm->record,iterations);
+    }
+}
+
+/** Profiler **/
+
+/* exact counts, gathered by a second instantiation of the interpreter
+ * so the ordinary engines carry no counting at all */
+typedef struct lc3_profile{
+    uint64_t pc[MEMORY_WORDS];          /* executions of each address */
+    uint64_t taken[MEMORY_WORDS];       /* of those, BRs that jumped */
+    uint64_t op[16];
+    uint64_t trap[256];
+} lc3_profile;
+
+/* counting is a constant NULL check, folded away in the plain copy */
+static inline __attribute__((always_inline)) void profile_count(lc3_profile* prof,uint16_t pc,const decoded_instr* d){
+    if(prof&&d->op!=OP_BREAK){
+        prof->pc[pc]++;
+        prof->op[d->op]++;
+        if(d->op==OP_TRAP){
+            prof->trap[d->imm&0xff]++;
+        }
+    }
+}
+
+/* mnemonic for the word at address, "BRnz" or "TRAP x25" style */
+void format_instr(char* out,size_t size,uint16_t instr){
+    int op=instr>>12;
+    if(op==OP_BR){
+        snprintf(out,size,"BR%s%s%s",instr&0x800?"n":"",instr&0x400?"z":"",instr&0x200?"p":"");
+    }else if(op==OP_TRAP&&(instr&0xff)>=TRAP_GETC&&(instr&0xff)<=TRAP_HALT){
+        snprintf(out,size,"%s",trap_names[(instr&0xff)-TRAP_GETC]);
+    }else if(op==OP_TRAP){
+        snprintf(out,size,"TRAP x%02X",instr&0xff);
+    }else{
+        snprintf(out,size,"%s",op_names[op]);
+    }
+}
+
+int compare_counts_desc(const void* a,const void* b){
+    uint64_t x=((const uint64_t*)a)[0],y=((const uint64_t*)b)[0];
+    return x<y?1:x>y?-1:0;
+}
+
+/* totals, then every executed address, hottest first. addresses are
+ * printed as in the assembler listings, x3000 and so on */
+void write_profile(lc3_vm* vm,FILE* out){
+    lc3_profile* prof=vm->profile;
+    uint64_t total=0,taken=0,branches=0;
+    for(int i=0;i<16;++i){
+        total+=prof->op[i];
+    }
+    fprintf(out,"instructions %llu\n\nby opcode\n",(unsigned long long)total);
+    for(int i=0;i<16;++i){
+        if(prof->op[i]){
+            fprintf(out,"  %-5s %12llu %6.2f%%\n",op_names[i],(unsigned long long)prof->op[i],100.0*prof->op[i]/total);
+        }
+    }
+    for(int pc=0;pc<MEMORY_WORDS;++pc){
+        taken+=prof->taken[pc];
+    }
+    branches=prof->op[OP_BR];
+    fprintf(out,"\nbranches %llu taken %llu not taken %llu\n\ntraps\n",
+            (unsigned long long)branches,(unsigned long long)taken,(unsigned long long)(branches-taken));
+    for(int i=0;i<256;++i){
+        if(prof->trap[i]){
+            char name[16];
+            format_instr(name,sizeof(name),0xF000|i);
+            fprintf(out,"  x%02X %-5s %12llu\n",i,name,(unsigned long long)prof->trap[i]);
+        }
+    }
+
+    /* (count, address) pairs sorted by count */
+    size_t n=0;
+    uint64_t (*hot)[2]=malloc(MEMORY_WORDS*sizeof(*hot));
+    if(!hot){
+        return;
+    }
+    for(int pc=0;pc<MEMORY_WORDS;++pc){
+        if(prof->pc[pc]){
+            hot[n][0]=prof->pc[pc];
+            hot[n++][1]=pc;
+        }
+    }
+    qsort(hot,n,sizeof(*hot),compare_counts_desc);
+    fprintf(out,"\nhot spots\n  address        count       %%  instruction\n");
+    for(size_t i=0;i<n;++i){
+        uint16_t pc=hot[i][1];
+        char name[16];
+        format_instr(name,sizeof(name),vm->memory[pc]);
+        fprintf(out,"  x%04X %14llu %6.2f%%  ",pc,(unsigned long long)hot[i][0],100.0*hot[i][0]/total);
+        if(vm->memory[pc]>>12==OP_BR){
+            fprintf(out,"%-9s %5.1f%% taken\n",name,100.0*prof->taken[pc]/hot[i][0]);
+        }else{
+            fprintf(out,"%s\n",name);
+        }
+    }
+    free(hot);
+}
+
+/** Symbols **/
+
+/* labels by address, from the assembler or its .sym output */
+typedef struct{
+    uint16_t address;
+    char* name;
+} lc3_symbol;
+
+typedef struct{
+    lc3_symbol* symbols;
+    size_t count;
+    size_t capacity;
+} symbol_table;
+
+int compare_symbols(const void* a,const void* b){
+    const lc3_symbol* x=a;
+    const lc3_symbol* y=b;
+    return (int)x->address-(int)y->address;
+}
+
+/* unsorted until sort_symbols, returns 0 if allocation fails */
+int add_symbol(symbol_table* table,const char* name,uint16_t address){
+    if(table->count==table->capacity){
+        size_t capacity=table->capacity?table->capacity*2:64;
+        lc3_symbol* symbols=realloc(table->symbols,capacity*sizeof(lc3_symbol));
+        if(!symbols){
+            return 0;
+        }
+        table->symbols=symbols;
+        table->capacity=capacity;
+    }
+    table->symbols[table->count].address=address;
+    if(!(table->symbols[table->count].name=strdup(name))){
+        return 0;
+    }
+    table->count++;
+    return 1;
+}
+
+void sort_symbols(symbol_table* table){
+    qsort(table->symbols,table->count,sizeof(lc3_symbol),compare_symbols);
+}
+
+/* lc3as writes "//<tab>LABEL    3000" under a commented header; any
+ * line of a name then a hex address, with or without the // and the
+ * x, is taken. returns 0 if allocation fails */
+int read_symbols_file(symbol_table* table,FILE* f){
+    char line[256];
+    while(fgets(line,sizeof(line),f)){
+        char name[128],address[32];
+        char* p=line;
+        char* end;
+        if(p[0]=='/'&&p[1]=='/'){
+            p+=2;
+        }
+        if(sscanf(p,"%127s %31s",name,address)!=2){
+            continue;
+        }
+        p=address[0]=='x'||address[0]=='X'?address+1:address;
+        unsigned long value=strtoul(p,&end,16);
+        if(end==p||*end||value>UINT16_MAX){
+            continue;
+        }
+        if(!add_symbol(table,name,(uint16_t)value)){
+            return 0;
+        }
+    }
+    sort_symbols(table);
+    return 1;
+}
+
+int read_symbols(symbol_table* table,const char* path){
+    FILE* f=fopen(path,"r");
+    if(!f){
+        return 0;
+    }
+    int ok=read_symbols_file(table,f);
+    fclose(f);
+    return ok;
+}
+
+void free_symbols(symbol_table* table){
+    for(size_t i=0;i<table->count;++i){
+        free(table->symbols[i].name);
+    }
+    free(table->symbols);
+    memset(table,0,sizeof(*table));
+}
+
+/* the nearest label at or below address, or the address itself */
+void symbolize(const symbol_table* table,uint16_t address,char* out,size_t size){
+    size_t lo=0,hi=table->count;
+    while(lo<hi){
+        size_t mid=(lo+hi)/2;
+        if(table->symbols[mid].address<=address){
+            lo=mid+1;
+        }else{
+            hi=mid;
+        }
+    }
+    if(lo){
+        snprintf(out,size,"%s",table->symbols[lo-1].name);
+    }else{
+        snprintf(out,size,"x%04X",address);
+    }
+}
+
+/** Assembler **/
+
+/* two passes over the source: the first places labels, the second
+ * encodes. accepts what lc3as does for the programs shipped in
+ * lc3ASM/: .ORIG, .FILL, .BLKW, .STRINGZ, .END, every opcode, BR with
+ * any of n, z and p, and the trap aliases GETC, OUT, PUTS, IN, PUTSP
+ * and HALT. labels are case sensitive, everything else is not. */
+
+enum{
+    ASM_LINE=1024,
+    ASM_TOKENS=8,
+};
+
+typedef struct{
+    const char* path;
+    int line;
+    int errors;
+    symbol_table labels;        /* in source order */
+    size_t label_index;         /* labels met so far in the second pass */
+    uint32_t pc;                /* past xFFFF once code runs off the end */
+    int origin_set;
+    int pass;
+    lc3_vm* vm;
+    image_span span;            /* first to last word written */
+    int contiguous;             /* no gaps, so the span can be cached */
+} asm_state;
+
+/* the first pass only places labels, errors are reported by the second */
+void asm_error(asm_state* a,const char* format,...){
+    va_list args;
+    if(a->pass==0){
+        return;
+    }
+    fprintf(stderr,"%s:%d: ",a->path,a->line);
+    va_start(args,format);
+    vfprintf(stderr,format,args);
+    va_end(args);
+    fprintf(stderr,"\n");
+    a->errors++;
+}
+
+/* opcodes and directives ignore case */
+int same_word(const char* a,const char* b){
+    for(;*a&&toupper((unsigned char)*a)==toupper((unsigned char)*b);++a,++b){
+    }
+    return !*a&&!*b;
+}
+
+/* splits one line on whitespace and commas, stopping at a comment.
+ * a quoted string stays one token, quotes included */
+int asm_tokenize(char* line,char** tokens){
+    int n=0;
+    char* p=line;
+    for(;;){
+        while(*p==' '||*p=='\t'||*p==','||*p=='\r'||*p=='\n'){
+            ++p;
+        }
+        if(!*p||*p==';'||n==ASM_TOKENS){
+            return n;
+        }
+        tokens[n++]=p;
+        if(*p=='"'){
+            for(++p;*p&&*p!='"';++p){
+                if(*p=='\\'&&p[1]){
+                    ++p;
+                }
+            }
+            if(*p=='"'){
+                ++p;
+            }
+        }else{
+            while(*p&&*p!=' '&&*p!='\t'&&*p!=','&&*p!=';'&&*p!='\r'&&*p!='\n'){
+                ++p;
+            }
+        }
+        if(!*p||*p==';'){
+            *p=0;
+            return n;
+        }
+        *p++=0;
+    }
+}
+
+/* #10, #-3, x3000, xFF92 or plain decimal, of any size. callers
+ * check the range so a number too big is not taken for a label */
+int asm_literal(const char* token,int32_t* value){
+    const char* p=token;
+    int base=10,negative=0;
+    if(*p=='#'){
+        ++p;
+    }else if((*p=='x'||*p=='X')&&p[1]){
+        base=16;
+        ++p;
+    }
+    if(*p=='-'){
+        negative=1;
+        ++p;
+    }
+    if(!*p){
+        return 0;
+    }
+    char* end;
+    long v=strtol(p,&end,base);
+    if(*end||!isxdigit((unsigned char)*p)){
+        return 0;
+    }
+    if(v>INT32_MAX){
+        v=INT32_MAX;
+    }
+    *value=negative?-v:v;
+    return 1;
+}
+
+/* a literal of at most 16 bits, either sign */
+int asm_number(const char* token,int32_t* value){
+    int32_t v;
+    if(!asm_literal(token,&v)||v<-0xFFFF||v>0xFFFF){
+        return 0;
+    }
+    *value=v;
+    return 1;
+}
+
+int asm_register(const char* token){
+    if((token[0]=='R'||token[0]=='r')&&token[1]>='0'&&token[1]<='7'&&!token[2]){
+        return token[1]-'0';
+    }
+    return -1;
+}
+
+/* BR with its condition bits, or -1 */
+int asm_branch(const char* op){
+    if(toupper((unsigned char)op[0])!='B'||toupper((unsigned char)op[1])!='R'){
+        return -1;
+    }
+    int mask=0;
+    const char* p=op+2;
+    if(*p=='n'||*p=='N'){
+        mask|=FL_NEG<<9;
+        ++p;
+    }
+    if(*p=='z'||*p=='Z'){
+        mask|=FL_ZRO<<9;
+        ++p;
+    }
+    if(*p=='p'||*p=='P'){
+        mask|=FL_POS<<9;
+        ++p;
+    }
+    if(*p){
+        return -1;
+    }
+    return mask?mask:0x0E00;
+}
+
+typedef struct{
+    const char* name;
+    uint16_t base;      /* opcode bits, or the whole word for fixed ones */
+    char form;          /* operands, see asm_instruction */
+} asm_op;
+
+const asm_op asm_ops[]={
+    {"ADD",0x1000,'a'}, {"AND",0x5000,'a'}, {"NOT",0x903F,'n'},
+    {"JMP",0xC000,'j'}, {"JSRR",0x4000,'j'}, {"RET",0xC1C0,'-'}, {"RTI",0x8000,'-'},
+    {"JSR",0x4800,'J'}, {"LD",0x2000,'o'}, {"LDI",0xA000,'o'}, {"LEA",0xE000,'o'},
+    {"ST",0x3000,'o'}, {"STI",0xB000,'o'}, {"LDR",0x6000,'r'}, {"STR",0x7000,'r'},
+    {"TRAP",0xF000,'t'},
+    {"GETC",0xF020,'-'}, {"OUT",0xF021,'-'}, {"PUTS",0xF022,'-'},
+    {"IN",0xF023,'-'}, {"PUTSP",0xF024,'-'}, {"HALT",0xF025,'-'},
+};
+
+const asm_op* asm_find_op(const char* token){
+    for(size_t i=0;i<sizeof(asm_ops)/sizeof(asm_op);++i){
+        if(same_word(token,asm_ops[i].name)){
+            return &asm_ops[i];
+        }
+    }
+    return NULL;
+}
+
+int asm_is_keyword(const char* token){
+    return token[0]=='.'||asm_find_op(token)||asm_branch(token)>=0;
+}
+
+/* index of the first definition of name, or -1 */
+long asm_find_label(asm_state* a,const char* name){
+    for(size_t i=0;i<a->labels.count;++i){
+        if(strcmp(a->labels.symbols[i].name,name)==0){
+            return (long)i;
+        }
+    }
+    return -1;
+}
+
+int asm_label(asm_state* a,const char* name,uint16_t* address){
+    long i=asm_find_label(a,name);
+    if(i>=0){
+        *address=a->labels.symbols[i].address;
+    }
+    return i>=0;
+}
+
+/* a label or a literal offset, checked against bits */
+uint16_t asm_offset(asm_state* a,const char* token,int bits){
+    int32_t v;
+    uint16_t address;
+    /* a hex literal may also be the field's bits, as x1F for #-1 in five */
+    int32_t max=token[0]=='x'||token[0]=='X'?(1<<bits)-1:(1<<(bits-1))-1;
+    if(a->pass==0){
+        return 0;
+    }
+    if(!asm_literal(token,&v)){
+        if(!asm_label(a,token,&address)){
+            asm_error(a,"undefined label %s",token);
+            return 0;
+        }
+        v=(int16_t)(address-(uint16_t)(a->pc+1));
+    }
+    if(v<-(1<<(bits-1))||v>max){
+        asm_error(a,"%s does not fit in %d bits",token,bits);
+    }
+    return (uint16_t)v&((1<<bits)-1);
+}
+
+int asm_reg(asm_state* a,const char* token){
+    int r=asm_register(token);
+    if(r<0){
+        asm_error(a,"expected a register, got %s",token);
+        return 0;
+    }
+    return r;
+}
+
+void asm_emit(asm_state* a,uint16_t word){
+    if(!a->origin_set){
+        asm_error(a,"code before .ORIG");
+        a->origin_set=1;
+    }
+    if(a->pc>0xFFFF){
+        /* the .obj loader rejects this as IMAGE_TOO_LONG, no wrapping */
+        if(a->pc==0x10000){
+            asm_error(a,"code %s",image_errors[IMAGE_TOO_LONG]);
+        }
+        a->pc++;
+        return;
+    }
+    if(a->pass==1){
+        uint32_t end=a->span.origin+a->span.words;
+        if(!a->span.words){
+            a->span.origin=a->pc;
+        }else if(a->pc!=end){
+            a->contiguous=0;
+        }
+        if(a->pc>=a->span.origin+a->span.words){
+            a->span.words=a->pc-a->span.origin+1;
+        }
+        a->vm->memory[a->pc]=word;
+        invalidate_code(a->vm,a->pc);
+        mark_dirty(a->vm,a->pc,1);
+    }
+    a->pc++;
+}
+
+void asm_instruction(asm_state* a,const asm_op* op,char** args,int n){
+    static const int operands[128]={['a']=3,['n']=2,['j']=1,['J']=1,['o']=2,['r']=3,['t']=1};
+    uint16_t w=op->base;
+    if(n!=operands[(int)op->form]){
+        asm_error(a,"%s takes %d operands",op->name,operands[(int)op->form]);
+        asm_emit(a,0);
+        return;
+    }
+    switch(op->form){
+        case 'a':
+            w|=asm_reg(a,args[0])<<9|asm_reg(a,args[1])<<6;
+            if(asm_register(args[2])>=0){
+                w|=asm_register(args[2]);
+            }else{
+                w|=0x20|asm_offset(a,args[2],5);
+            }
+            break;
+        case 'n':
+            w|=asm_reg(a,args[0])<<9|asm_reg(a,args[1])<<6;
+            break;
+        case 'j':
+            w|=asm_reg(a,args[0])<<6;
+            break;
+        case 'J':
+            w|=asm_offset(a,args[0],11);
+            break;
+        case 'o':
+            w|=asm_reg(a,args[0])<<9|asm_offset(a,args[1],9);
+            break;
+        case 'r':
+            w|=asm_reg(a,args[0])<<9|asm_reg(a,args[1])<<6|asm_offset(a,args[2],6);
+            break;
+        case 't':
+            {
+                int32_t v;
+                if(!asm_number(args[0],&v)||v<0||v>0xFF){
+                    asm_error(a,"bad trap vector %s",args[0]);
+                    v=0;
+                }
+                w|=v&0xFF;
+            }
+            break;
+    }
+    asm_emit(a,w);
+}
+
+/* .STRINGZ, escapes as in C plus \e */
+void asm_string(asm_state* a,const char* token){
+    size_t len=strlen(token);
+    if(len<2||token[0]!='"'||token[len-1]!='"'){
+        asm_error(a,"expected a quoted string");
+        return;
+    }
+    for(const char* p=token+1;p<token+len-1;++p){
+        char c=*p;
+        if(c=='\\'){
+            switch(*++p){
+                case 'n': c='\n'; break;
+                case 't': c='\t'; break;
+                case 'r': c='\r'; break;
+                case 'e': c=27; break;
+                case '0': c=0; break;
+                default: c=*p; break;
+            }
+        }
+        asm_emit(a,(uint8_t)c);
+    }
+    asm_emit(a,0);
+}
+
+/* returns 0 at .END */
+int asm_directive(asm_state* a,const char* name,char** args,int n){
+    int32_t v;
+    uint16_t address;
+    if(same_word(name,".END")){
+        return 0;
+    }
+    if(same_word(name,".STRINGZ")){
+        if(n==1){
+            asm_string(a,args[0]);
+        }else{
+            asm_error(a,".STRINGZ takes one string");
+        }
+        return 1;
+    }
+    if(n!=1){
+        asm_error(a,"%s takes one operand",name);
+        return 1;
+    }
+    if(same_word(name,".ORIG")){
+        if(!asm_number(args[0],&v)||v<0){
+            asm_error(a,"bad origin %s",args[0]);
+        }else{
+            a->pc=v;
+        }
+        a->origin_set=1;
+    }else if(same_word(name,".FILL")){
+        if(asm_literal(args[0],&v)){
+            if(v<-0x8000||v>0xFFFF){
+                asm_error(a,"%s does not fit in 16 bits",args[0]);
+            }
+            asm_emit(a,(uint16_t)v);
+        }else if(a->pass==0||asm_label(a,args[0],&address)){
+            asm_emit(a,a->pass?address:0);
+        }else{
+            asm_error(a,"undefined label %s",args[0]);
+            asm_emit(a,0);
+        }
+    }else if(same_word(name,".BLKW")){
+        if(!asm_number(args[0],&v)||v<0){
+            asm_error(a,"bad block size %s",args[0]);
+            v=0;
+        }
+        while(v--){
+            asm_emit(a,0);
+        }
+    }else{
+        asm_error(a,"unknown directive %s",name);
+    }
+    return 1;
+}
+
+void asm_pass(asm_state* a,const char* source,size_t size){
+    const char* p=source;
+    const char* end=source+size;
+    a->line=0;
+    a->origin_set=0;
+    a->pc=0;
+    while(p<end){
+        char line[ASM_LINE];
+        char* tokens[ASM_TOKENS];
+        const char* start=p;
+        const char* next=memchr(p,'\n',end-p);
+        size_t len=(next?next:end)-start;
+        p=next?next+1:end;
+        a->line++;
+        if(len>=sizeof(line)){
+            asm_error(a,"line too long");
+            continue;
+        }
+        memcpy(line,start,len);
+        line[len]=0;
+        int n=asm_tokenize(line,tokens);
+        if(!n){
+            continue;
+        }
+        char** t=tokens;
+        if(!asm_is_keyword(t[0])){
+            /* a label, on its own or in front of the line's instruction */
+            size_t k=strlen(t[0]);
+            if(k&&t[0][k-1]==':'){
+                t[0][k-1]=0;
+            }
+            if(a->pass==0&&!add_symbol(&a->labels,t[0],a->pc)){
+                a->pass=1;
+                asm_error(a,"out of memory");
+                a->pass=0;
+            }else if(a->pass==1&&asm_find_label(a,t[0])!=(long)a->label_index++){
+                asm_error(a,"label %s defined twice",t[0]);
+            }
+            ++t;
+            --n;
+            if(!n){
+                continue;
+            }
+        }
+        int branch=asm_branch(t[0]);
+        const asm_op* op;
+        if(t[0][0]=='.'){
+            if(!asm_directive(a,t[0],t+1,n-1)){
+                return;
+            }
+        }else if(branch>=0){
+            if(n!=2){
+                asm_error(a,"%s takes 1 operand",t[0]);
+            }
+            asm_emit(a,branch|(n==2?asm_offset(a,t[1],9):0));
+        }else if((op=asm_find_op(t[0]))){
+            asm_instruction(a,op,t+1,n-1);
+        }else{
+            asm_error(a,"expected an instruction, got %s",t[0]);
+        }
+    }
+}
+
+/* FNV-1a, the key of an assembled image in the cache. never zero, which
+ * marks an .obj cache */
+uint64_t hash_bytes(const char* p,size_t n){
+    uint64_t h=0xcbf29ce484222325ull;
+    for(size_t i=0;i<n;++i){
+        h=(h^(uint8_t)p[i])*0x100000001b3ull;
+    }
+    return h?h:1;
+}
+
+/* assembles source into vm's memory, labels are added to symbols if it
+ * is not NULL. returns 0 after printing any errors */
+int assemble(lc3_vm* vm,const char* path,const char* source,size_t size,symbol_table* symbols,image_span* span,int* contiguous){
+    asm_state a;
+    memset(&a,0,sizeof(a));
+    a.path=path;
+    a.vm=vm;
+    a.contiguous=1;
+    asm_pass(&a,source,size);
+    a.pass=1;
+    asm_pass(&a,source,size);
+    for(size_t i=0;symbols&&!a.errors&&i<a.labels.count;++i){
+        if(!add_symbol(symbols,a.labels.symbols[i].name,a.labels.symbols[i].address)){
+            asm_error(&a,"out of memory");
+        }
+    }
+    if(symbols){
+        sort_symbols(symbols);
+    }
+    free_symbols(&a.labels);
+    *span=a.span;
+    *contiguous=a.contiguous;
+    return !a.errors;
+}
+
+/* an .asm file, assembled unless --image-cache has it under the same
+ * source hash. a cached image carries no labels, so asking for symbols
+ * always assembles */
+int read_asm(lc3_vm* vm,const char* path,symbol_table* symbols){
+    size_t size;
+    char* source=read_whole_file(path,&size);
+    if(!source){
+        fprintf(stderr,"failed to read %s\n",path);
+        return 0;
+    }
+    image_span span;
+    int contiguous,ok;
+#ifndef _WIN32
+    struct stat st;
+    char cache_path[4096];
+    uint64_t hash=hash_bytes(source,size);
+    int cached=use_image_cache&&stat(path,&st)==0&&image_cache_path(path,cache_path,sizeof(cache_path));
+    if(cached&&!symbols&&read_cached_image(vm,cache_path,&st,hash,&span)==IMAGE_OK){
+        mark_dirty(vm,span.origin,span.words);
+        free(source);
+        return 1;
+    }
+#endif
+    ok=assemble(vm,path,source,size,symbols,&span,&contiguous);
+#ifndef _WIN32
+    if(ok&&cached&&contiguous&&span.words){
+        write_cached_image(vm,cache_path,&span,&st,hash);
+    }
+#endif
+    free(source);
+    return ok;
+}
+
+/** Sampler **/
+
+/* statistical profile of a full speed run. SIGPROF fires every
+ * SAMPLE_INTERVAL_US of cpu time and the handler copies the pc and
+ * the return link into a single producer single consumer ring, which
+ * run_engine drains between slices. the handler never locks or
+ * allocates, so it is safe wherever the machine was interrupted.
+ * the switch engine stores the pc every instruction; threaded, block
+ * and jit only at taken jumps and block exits, so their samples land
+ * on the start of the running basic block, which folds to the same
+ * label almost always. */
+
+#ifndef _WIN32
+#define HAVE_SAMPLER 1
+#endif
+
+#ifdef HAVE_SAMPLER
+
+enum{
+    SAMPLE_RING=1<<16,
+    SAMPLE_INTERVAL_US=1000,
+    SAMPLE_SLICE=1<<20,
+};
+
+typedef struct{
+    uint16_t pc;
+    uint16_t link;              /* R7, where the current subroutine returns */
+} lc3_sample;
+
+typedef struct{
+    lc3_sample data[SAMPLE_RING];
+    atomic_uint head;           /* written by the handler */
+    atomic_uint tail;           /* written by sample_drain */
+    atomic_uint dropped;
+    lc3_vm* vm;
+    uint32_t* keys;             /* drained samples, pc<<16|link */
+    size_t count;
+    size_t capacity;
+} sampler_state;
+
+sampler_state sampler;
+
+void handle_sample(int signal){
+    lc3_vm* vm=sampler.vm;
+    unsigned head=atomic_load_explicit(&sampler.head,memory_order_relaxed);
+    if(!vm){
+        return;
+    }
+    if(head-atomic_load_explicit(&sampler.tail,memory_order_acquire)==SAMPLE_RING){
+        atomic_fetch_add_explicit(&sampler.dropped,1,memory_order_relaxed);
+        return;
+    }
+    sampler.data[head%SAMPLE_RING]=(lc3_sample){vm->reg[R_PC],vm->reg[R_R7]};
+    atomic_store_explicit(&sampler.head,head+1,memory_order_release);
+}
+
+/* move everything the handler has pushed into sampler.keys */
+void sample_drain(){
+    unsigned tail=atomic_load_explicit(&sampler.tail,memory_order_relaxed);
+    unsigned head=atomic_load_explicit(&sampler.head,memory_order_acquire);
+    if(sampler.count+(head-tail)>sampler.capacity){
+        size_t capacity=sampler.capacity?sampler.capacity*2:SAMPLE_RING;
+        while(capacity<sampler.count+(head-tail)){
+            capacity*=2;
+        }
+        uint32_t* keys=realloc(sampler.keys,capacity*sizeof(uint32_t));
+        if(!keys){
+            return;
+        }
+        sampler.keys=keys;
+        sampler.capacity=capacity;
+    }
+    for(;tail!=head;++tail){
+        lc3_sample s=sampler.data[tail%SAMPLE_RING];
+        sampler.keys[sampler.count++]=(uint32_t)s.pc<<16|s.link;
+    }
+    atomic_store_explicit(&sampler.tail,tail,memory_order_release);
+}
+
+int sampler_start(lc3_vm* vm,unsigned interval_us){
+    struct sigaction sa;
+    memset(&sa,0,sizeof(sa));
+    sa.sa_handler=handle_sample;
+    sa.sa_flags=SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sampler.vm=vm;
+    if(sigaction(SIGPROF,&sa,NULL)!=0){
+        return 0;
+    }
+    struct itimerval timer={{0,interval_us},{0,interval_us}};
+    return setitimer(ITIMER_PROF,&timer,NULL)==0;
+}
+
+void sampler_stop(){
+    struct itimerval timer={{0,0},{0,0}};
+    setitimer(ITIMER_PROF,&timer,NULL);
+    signal(SIGPROF,SIG_IGN);
+    sample_drain();
+    sampler.vm=NULL;
+}
+
+int compare_keys(const void* a,const void* b){
+    uint32_t x=*(const uint32_t*)a,y=*(const uint32_t*)b;
+    return x<y?-1:x>y;
+}
+
+typedef struct{
+    char* stack;
+    uint64_t count;
+} folded_stack;
+
+int compare_stacks(const void* a,const void* b){
+    return strcmp(((const folded_stack*)a)->stack,((const folded_stack*)b)->stack);
+}
+
+/* one "caller;leaf count" line per stack, the format flamegraph.pl
+ * and speedscope read. R7 only names a caller when the word before it
+ * is a JSR or JSRR, and a caller that resolves to the leaf's own label
+ * is a link left over from a subroutine that already returned */
+void write_folded(lc3_vm* vm,const symbol_table* table,FILE* out){
+    folded_stack* stacks=malloc((sampler.count+1)*sizeof(folded_stack));
+    size_t n=0;
+    if(!stacks){
+        return;
+    }
+    qsort(sampler.keys,sampler.count,sizeof(uint32_t),compare_keys);
+    for(size_t i=0;i<sampler.count;){
+        size_t run=i;
+        while(run<sampler.count&&sampler.keys[run]==sampler.keys[i]){
+            ++run;
+        }
+        uint16_t pc=sampler.keys[i]>>16,link=sampler.keys[i]&0xffff;
+        char leaf[128],caller[128],stack[260];
+        symbolize(table,pc,leaf,sizeof(leaf));
+        symbolize(table,link-1,caller,sizeof(caller));
+        if(link&&vm->memory[(uint16_t)(link-1)]>>12==OP_JSR&&strcmp(caller,leaf)!=0){
+            snprintf(stack,sizeof(stack),"%s;%s",caller,leaf);
+        }else{
+            snprintf(stack,sizeof(stack),"%s",leaf);
+        }
+        stacks[n].stack=strdup(stack);
+        stacks[n].count=run-i;
+        if(stacks[n].stack){
+            ++n;
+        }
+        i=run;
+    }
+    /* different addresses fold into one label */
+    qsort(stacks,n,sizeof(folded_stack),compare_stacks);
+    for(size_t i=0;i<n;){
+        uint64_t count=0;
+        size_t run=i;
+        for(;run<n&&strcmp(stacks[run].stack,stacks[i].stack)==0;++run){
+            count+=stacks[run].count;
+        }
+        fprintf(out,"%s %llu\n",stacks[i].stack,(unsigned long long)count);
+        for(;i<run;++i){
+            free(stacks[i].stack);
+        }
+    }
+    free(stacks);
+}
+
+void sampler_reset(){
+    free(sampler.keys);
+    sampler.keys=NULL;
+    sampler.count=sampler.capacity=0;
+    atomic_store(&sampler.head,0);
+    atomic_store(&sampler.tail,0);
+    atomic_store(&sampler.dropped,0);
+}
+
+#endif
+
+/** Operating System **/
+
+/* with --os the machine runs an LC-3 operating system image the way
+ * the book describes it: TRAP and the exceptions push PSR and PC onto
+ * the supervisor stack and jump through the tables at x0000 and x0100,
+ * RTI pops them again. the user program starts at PC_START in user
+ * mode, the OS's own start up code is not run. the display and MCR
+ * are mapped for its routines. a trap whose table entry still holds
+ * the routine the image came with is run natively by execute_trap,
+ * set hle to 0 to step through the OS instead. */
+
+enum{
+    PSR_USER=1<<15,
+    PSR_PRIORITY=7<<8,
+    OS_PRIVILEGE_VECTOR=0x0100,     /* RTI in user mode */
+    OS_ILLEGAL_VECTOR=0x0101,       /* RES */
+    OS_SUPERVISOR_STACK=0x3000      /* grows down from x2FFF */
+};
+
+void lc3_map_device(lc3_vm* vm,uint8_t page,lc3_device dev);
+void stop_at_next_fetch(lc3_vm* vm,int why);
+uint16_t keyboard_device_read(lc3_vm* vm,void* ctx,uint16_t address);
+
+void trace_store(lc3_vm* vm,uint16_t address,uint16_t value);
+
+void os_push(lc3_vm* vm,uint16_t value){
+    mem_write(vm,--vm->reg[R_R6],value);
+    if(vm->trace){
+        trace_store(vm,vm->reg[R_R6],value);
+    }
+}
+
+uint16_t os_pop(lc3_vm* vm){
+    return mem_read(vm,vm->reg[R_R6]++);
+}
+
+/* switch to the supervisor stack, save where the program was and
+ * continue at the routine the table entry points to */
+void os_enter(lc3_vm* vm,uint16_t entry){
+    uint16_t psr=vm->psr|cond_flags(vm);
+    if(vm->psr&PSR_USER){
+        vm->saved_usp=vm->reg[R_R6];
+        vm->reg[R_R6]=vm->saved_ssp;
+        vm->psr&=~PSR_USER;
+    }
+    os_push(vm,psr);
+    os_push(vm,vm->reg[R_PC]);
+    vm->reg[R_PC]=mem_read(vm,entry);
+}
+
+/* 1 if execute_trap should run its own version of the trap */
+int os_trap_native(lc3_vm* vm,uint8_t vector){
+    return vm->hle&&vector>=TRAP_GETC&&vector<=TRAP_HALT&&
+           vm->memory[vector]==vm->os_vectors[vector-TRAP_GETC];
+}
+
+void os_rti(lc3_vm* vm){
+    if(!vm->os){
+        abort();
+    }
+    if(vm->psr&PSR_USER){
+        os_enter(vm,OS_PRIVILEGE_VECTOR);
+        return;
+    }
+    vm->reg[R_PC]=os_pop(vm);
+    uint16_t psr=os_pop(vm);
+    vm->psr=psr&(PSR_USER|PSR_PRIORITY);
+    set_cond_flags(vm,psr);
+    if(vm->psr&PSR_USER){
+        vm->saved_ssp=vm->reg[R_R6];
+        vm->reg[R_R6]=vm->saved_usp;
+    }
+}
+
+void os_reserved(lc3_vm* vm){
+    if(!vm->os){
+        abort();
+    }
+    os_enter(vm,OS_ILLEGAL_VECTOR);
+}
+
+/* the display is always ready, the keyboard is as without an OS */
+uint16_t os_console_read(lc3_vm* vm,void* ctx,uint16_t address){
+    if(address==MR_DSR){
+        return 1<<15;
+    }
+    return keyboard_device_read(vm,ctx,address);
+}
+
+void os_console_write(lc3_vm* vm,void* ctx,uint16_t address,uint16_t val){
+    vm->memory[address]=val;
+    if(address==MR_DDR){
+        output_char(vm,vm->out,(char)val);
+        output_flush_due(vm);
+    }
+}
+
+uint16_t os_control_read(lc3_vm* vm,void* ctx,uint16_t address){
+    if(address==MR_PSR){
+        return vm->psr|cond_flags(vm);
+    }
+    return vm->memory[address];
+}
+
+void os_control_write(lc3_vm* vm,void* ctx,uint16_t address,uint16_t val){
+    if(address==MR_PSR){
+        vm->psr=val&(PSR_USER|PSR_PRIORITY);
+        set_cond_flags(vm,val);
+        return;
+    }
+    vm->memory[address]=val;
+    if(address==MR_MCR&&!(val&(1<<15))){
+        stop_at_next_fetch(vm,STOP_HALT);
+    }
+}
+
+/* call once the OS image and the program are loaded */
+void lc3_os_start(lc3_vm* vm){
+    vm->os=1;
+    vm->hle=1;
+    vm->psr=PSR_USER;
+    vm->saved_ssp=OS_SUPERVISOR_STACK;
+    for(int v=TRAP_GETC;v<=TRAP_HALT;++v){
+        vm->os_vectors[v-TRAP_GETC]=vm->memory[v];
+    }
+    vm->memory[MR_MCR]=1<<15;
+    lc3_map_device(vm,MR_DSR>>MEMORY_PAGE_SHIFT,(lc3_device){os_console_read,os_console_write,NULL});
+    lc3_map_device(vm,MR_MCR>>MEMORY_PAGE_SHIFT,(lc3_device){os_control_read,os_control_write,NULL});
+}
+
+/** Interpreter **/
+
+void debug_decode(lc3_vm* vm,uint16_t address,decoded_instr* d);
+void retire_all_blocks(lc3_vm* vm);
+
+void decode_instr(lc3_vm* vm,uint16_t address,uint16_t instr){
+    decoded_instr* d=&vm->decoded[address];
+    idle_loop loop;
+    *d=decode_word(instr);
+    if((d->op==OP_ADD||d->op==OP_LDI)&&idle_loop_at(vm,address,&loop)){
+        d->op=OP_IDLE;
+    }
+    if(__builtin_expect(vm->stop!=STOP_NONE,0)){
+        /* any fetch after a stop, decoded again once resumed */
+        d->op=OP_BREAK;
+        d->valid=0;
+    }else if(__builtin_expect(vm->debug!=NULL,0)){
+        debug_decode(vm,address,d);
+    }
+    vm->code_words[address]=1;
+}
+
+/* stop in front of the next instruction, wherever it is: every decode
+ * and block is dropped so the next fetch decodes to OP_BREAK. the
+ * block engine finishes its block first. */
+void stop_at_next_fetch(lc3_vm* vm,int why){
+    vm->stop=why;
+    /* only the valid bits, the running instruction still reads its decode */
+    for(int i=0;i<MEMORY_WORDS;++i){
+        vm->decoded[i].valid=0;
+    }
+    retire_all_blocks(vm);
+}
+
+/* execute trap routine */
+int execute_trap(lc3_vm* vm,uint16_t instr,FILE* in,FILE* out){
+    int running=1;
+    if(vm->os&&!os_trap_native(vm,instr&0xFF)){
+        os_enter(vm,instr&0xFF);
+        return running;
+    }
+    switch(instr&0xFF){
+        case TRAP_GETC:
+            {
+                output_flush(vm);
+                int c=input_getc(vm,in);
+                vm->input_eof|=c==EOF;
+                vm->reg[R_R0]=(uint16_t)c;
+            }
+            break;
+        case TRAP_OUT:
+            {
+                char c=(char)vm->reg[R_R0&0xff];
+                output_char(vm,out,c);
+                output_flush_due(vm);
+            }
+            break;
+        case TRAP_PUTS:
+            {
+                uint16_t* word=vm->memory+vm->reg[R_R0];
+                while(*word){
+                    output_char(vm,out,(char)(*word&0xff));
+                    word++;
+                }
+                output_done(vm,out);
+            }
+            break;
+        case TRAP_IN:
+            {
+                for(const char* p="Enter a character: ";*p;++p){
+                    output_char(vm,out,*p);
+                }
+                output_flush(vm);
+                fflush(out);
+                int c=input_getc(vm,in);
+                vm->input_eof|=c==EOF;
+                output_char(vm,out,(char)c);
+                output_done(vm,out);
+                vm->reg[R_R0]=(uint16_t)c;
+            }
+            break;
+        case TRAP_PUTSP:
+            {
+                /* one char per byte(two bytes per word) */
+                uint16_t* word=vm->memory+vm->reg[R_R0];
+                while(*word){
+                    output_char(vm,out,(char)(*word&0xff));
+                    char c=*word>>8;
+                    if(c){
+                        output_char(vm,out,c);
+                    }
+                    word++;
+                }
+                output_done(vm,out);
+            }
+            break;
+        case TRAP_HALT:
+            {
+                for(const char* p="HALT\n";*p;++p){
+                    output_char(vm,out,*p);
+                }
+                output_flush(vm);
+                fflush(out);
+                running=0;
+            }
+            break;
+    }
+    /* a replay that ran out of input ends the run */
+    if(vm->replay&&vm->replay->done){
+        running=0;
+    }
+
+    return running;
+}
+
+/* one instruction, counted into prof when it is not NULL */
+static inline __attribute__((always_inline)) int execute_instruction(lc3_vm* vm,lc3_profile* prof){
+    int running=1;
+    int is_max=R_PC==UINT16_MAX;
+
+    /* FETCH */
+    uint16_t pc=vm->reg[R_PC]++;
+    decoded_instr* d=&vm->decoded[pc];
+    if(!d->valid){
+        decode_instr(vm,pc,mem_read(vm,pc));
+    }
+    decoded_instr head;
+    if(d->op==OP_IDLE){
+        idle_wait(vm,pc);
+        head=decode_word(vm->memory[pc]);
+        d=&head;
+    }
+    profile_count(prof,pc,d);
+
+    switch(d->op){
+        case OP_ADD:
+            if(d->imm_flag){
+                vm->reg[d->dr]=vm->reg[d->sr1]+d->imm;
+            }else{
+                vm->reg[d->dr]=vm->reg[d->sr1]+vm->reg[d->sr2];
+            }
+            update_flags(vm,d->dr);
+            break;
+        case OP_AND:
+            if(d->imm_flag){
+                vm->reg[d->dr]=vm->reg[d->sr1]&d->imm;
+            }else{
+                vm->reg[d->dr]=vm->reg[d->sr1]&vm->reg[d->sr2];
+            }
+            update_flags(vm,d->dr);
+            break;
+        case OP_NOT:
+            vm->reg[d->dr]=~vm->reg[d->sr1];
+            update_flags(vm,d->dr);
+            break;
+        case OP_BR:
+            /* the nzp bits line up with FL_NEG|FL_ZRO|FL_POS */
+            if(cond_flags(vm)&d->dr){
+                vm->reg[R_PC]+=d->imm;
+                if(prof){
+                    prof->taken[pc]++;
+                }
+            }
+            break;
+        case OP_JMP:
+            vm->reg[R_PC]=vm->reg[d->sr1];
+            break;
+        case OP_JSR:
+            {
+                /* save pc in R7 to jump back to later */
+                uint16_t base=vm->reg[d->sr1];
+                vm->reg[R_R7]=vm->reg[R_PC];
+                if(d->imm_flag){
+                    vm->reg[R_PC]+=d->imm;
+                }else{
+                    vm->reg[R_PC]=base;
+                }
+            }
+            break;
+        case OP_LD:
+            /* add pc_offset to the current pc and load that memory location */
+            vm->reg[d->dr]=mem_read(vm,vm->reg[R_PC]+d->imm);
+            update_flags(vm,d->dr);
+            break;
+        case OP_LDI:
+            /* add pc_offset to the current PC, look at that memory
+             * location to get the final address */
+            vm->reg[d->dr]=mem_read(vm,mem_read(vm,vm->reg[R_PC]+d->imm));
+            update_flags(vm,d->dr);
+            break;
+        case OP_LDR:
+            vm->reg[d->dr]=mem_read(vm,vm->reg[d->sr1]+d->imm);
+            update_flags(vm,d->dr);
+            break;
+        case OP_LEA:
+            vm->reg[d->dr]=vm->reg[R_PC]+d->imm;
+            update_flags(vm,d->dr);
+            break;
+        case OP_ST:
+            mem_write(vm,vm->reg[R_PC]+d->imm,vm->reg[d->dr]);
+            break;
+        case OP_STI:
+            mem_write(vm,mem_read(vm,vm->reg[R_PC]+d->imm),vm->reg[d->dr]);
+            break;
+        case OP_STR:
+            mem_write(vm,vm->reg[d->sr1]+d->imm,vm->reg[d->dr]);
+            break;
+        case OP_TRAP:
+            running=execute_trap(vm,d->imm,vm->in,vm->out);
+            break;
+        case OP_BREAK:
+            /* not run, the pc stays on it */
+            vm->reg[R_PC]=pc;
+            vm->stop=vm->stop?vm->stop:STOP_BREAK;
+            return 0;
+        case OP_RTI:
+            os_rti(vm);
+            break;
+        case OP_RES:
+            os_reserved(vm);
+            break;
+        default:
+            abort();
+            break;
+    }
+
+    if(running&&is_max){
+        printf("Program counter overflow!\n");
+        return 0;
+    }
+
+    return running;
+}
+
+int read_and_execute_instruction(lc3_vm* vm){
+    return execute_instruction(vm,NULL);
+}
+
+int run_profiled(lc3_vm* vm,uint64_t budget){
+    lc3_profile* prof=vm->profile;
+    int running=1;
+    while(running&&budget--){
+        running=execute_instruction(vm,prof);
+    }
+    vm->budget_left=budget;
+    return running;
+}
+
+
+/** Tracing **/
+
+/* every step of read_and_execute_instruction. the file is a header
+ * of the starting registers, pc and flags, then per step one tag byte
+ * and whatever the tag says follows:
+ *   TRACE_JUMP   the pc is not the one the reader expects, zigzag
+ *                varint of the difference
+ *   TRACE_INSTR  the word differs from the last one run at this pc, 2 bytes
+ *   TRACE_WRITE  an STI, zigzag varint from the last logged address. ST
+ *                and STR stores follow from the registers and are not logged
+ *   low nibble   0 for no register change, r+1 when only Rr changed,
+ *                TRACE_REGS for a mask byte. each changed register then
+ *                follows as a zigzag varint of its difference
+ *   TRACE_COND   the flags are not those of the one changed register, 1 byte
+ * ADD, AND, NOT, LEA, BR, JMP and JSR results follow from the registers
+ * and the flags, so the reader works them out, next pc included, and
+ * their steps are a bare tag. loads log the register they set. a step
+ * after a TRACE_DIFF tag gives every change and the reader expects
+ * pc+1 after it: traps, RTI, RES and the first step of each run go
+ * that way.
+ * a tag of TRACE_STORE after a step is a store the step made that the
+ * registers do not show, such as an OS mode trap's pushes: a zigzag
+ * varint from the last logged address and the 2 byte value. a tag of
+ * TRACE_SYNC sets all eight registers, 2 bytes each, and TRACE_END
+ * ends the trace. a straight line ALU step costs one byte.
+ *
+ * run_traced is an interpreter of its own that encodes as it goes,
+ * costing a few instructions a step more than untraced. full blocks
+ * go to a thread that writes them, so the run never waits unless
+ * every block is full. */
+
+#ifndef _WIN32
+#define HAVE_TRACE 1
+#endif
+
+#define TRACE_MAGIC "LC3TRC2\n"
+
+enum{
+    TRACE_JUMP=0x80,
+    TRACE_INSTR=0x40,
+    TRACE_WRITE=0x20,
+    TRACE_COND=0x10,
+    TRACE_REGS=9,           /* low nibble, a register mask follows */
+    TRACE_DIFF=0x0C,
+    TRACE_STORE=0x0D,
+    TRACE_SYNC=0x0E,
+    TRACE_END=0x0F
+};
+
+static inline uint32_t zigzag(int32_t x){
+    return ((uint32_t)x<<1)^(uint32_t)(x>>31);
+}
+
+static inline int32_t unzigzag(uint32_t x){
+    return (int32_t)(x>>1)^-(int32_t)(x&1);
+}
+
+static inline uint16_t flags_of(uint16_t value){
+    return FL_POS<<((value>>15<<1)|(value==0));
+}
+
+#ifdef HAVE_TRACE
+
+enum{
+    TRACE_BLOCK=1<<20,      /* bytes handed to the writer at once */
+    TRACE_BLOCKS=8,
+    TRACE_STORES=4,         /* noted stores a step can log */
+    TRACE_STEP_MAX=96       /* largest encoded step with its stores */
+};
+
+typedef struct lc3_trace{
+    /* the machine's end */
+    uint8_t* p;
+    uint8_t* end;               /* TRACE_STEP_MAX short of the block's end */
+    int fill;                   /* block being filled */
+    uint16_t reg[8];            /* as the reader has them after the last run */
+    uint16_t cond;              /* a result with the reader's flags */
+    uint16_t next_pc;           /* the pc the reader expects */
+    uint16_t last_write;
+    int stores;                 /* noted by the running step */
+    uint16_t store[TRACE_STORES][2];
+    uint16_t instr[MEMORY_WORDS];   /* last word run at each pc */
+
+    /* handed over through the semaphores */
+    uint8_t* block[TRACE_BLOCKS];
+    size_t used[TRACE_BLOCKS];  /* bytes filled in each block */
+    int last[TRACE_BLOCKS];     /* the block ends the trace */
+    sem_t free_blocks;
+    sem_t full_blocks;
+    pthread_t writer;
+    atomic_int failed;
+    FILE* out;
+} lc3_trace;
+
+static inline uint8_t* trace_varint(uint8_t* p,uint32_t x){
+    while(x>=0x80){
+        *p++=(x&0x7f)|0x80;
+        x>>=7;
+    }
+    *p++=x;
+    return p;
+}
+
+static inline uint8_t* trace_raw_regs(uint8_t* p,const uint16_t* reg){
+    for(int r=0;r<8;++r){
+        *p++=reg[r]&0xFF;
+        *p++=reg[r]>>8;
+    }
+    return p;
+}
+
+void* trace_writer(void* arg){
+    lc3_trace* t=arg;
+    int more=1;
+    for(int drain=0;more;drain=(drain+1)%TRACE_BLOCKS){
+        sem_wait(&t->full_blocks);
+        if(fwrite(t->block[drain],1,t->used[drain],t->out)!=t->used[drain]){
+            atomic_store(&t->failed,1);
+        }
+        more=!t->last[drain];
+        sem_post(&t->free_blocks);
+    }
+    return NULL;
+}
+
+/* hands the filled block to the writer and takes the next free one */
+void trace_hand_over(lc3_trace* t,int last){
+    t->used[t->fill]=t->p-t->block[t->fill];
+    t->last[t->fill]=last;
+    sem_post(&t->full_blocks);
+    if(last){
+        return;
+    }
+    t->fill=(t->fill+1)%TRACE_BLOCKS;
+    sem_wait(&t->free_blocks);
+    t->p=t->block[t->fill];
+    t->end=t->p+TRACE_BLOCK-TRACE_STEP_MAX;
+}
+
+/* a store the running step made behind the registers' back */
+void trace_store(lc3_vm* vm,uint16_t address,uint16_t value){
+    lc3_trace* t=vm->trace;
+    if(t->stores<TRACE_STORES){
+        t->store[t->stores][0]=address;
+        t->store[t->stores][1]=value;
+        t->stores++;
+    }
+}
+
+void lc3_trace_free(lc3_trace* t){
+    for(int i=0;i<TRACE_BLOCKS;++i){
+        free(t->block[i]);
+    }
+    free(t);
+}
+
+/* starts tracing vm from its current state. returns 0 on failure */
+int lc3_trace_start(lc3_vm* vm,FILE* out){
+    lc3_trace* t=calloc(1,sizeof(lc3_trace));
+    if(!t){
+        return 0;
+    }
+    int ok=1;
+    for(int i=0;i<TRACE_BLOCKS;++i){
+        ok&=(t->block[i]=malloc(TRACE_BLOCK))!=NULL;
+    }
+    t->out=out;
+    t->next_pc=vm->reg[R_PC];
+    memcpy(t->reg,vm->reg,sizeof(t->reg));
+    t->cond=vm->cond_result;
+    t->p=t->block[0];
+    t->end=t->p+TRACE_BLOCK-TRACE_STEP_MAX;
+
+    /* the header holds the starting registers, pc and flags */
+    uint8_t header[sizeof(TRACE_MAGIC)-1+20];
+    uint16_t start[10];
+    memcpy(header,TRACE_MAGIC,sizeof(TRACE_MAGIC)-1);
+    memcpy(start,t->reg,sizeof(t->reg));
+    start[8]=t->next_pc;
+    start[9]=flags_of(t->cond);
+    for(int i=0;i<10;++i){
+        header[sizeof(TRACE_MAGIC)-1+2*i]=start[i]&0xFF;
+        header[sizeof(TRACE_MAGIC)-1+2*i+1]=start[i]>>8;
+    }
+    ok=ok&&fwrite(header,1,sizeof(header),out)==sizeof(header);
+    if(ok){
+        sem_init(&t->free_blocks,0,TRACE_BLOCKS-1);
+        sem_init(&t->full_blocks,0,0);
+        ok=pthread_create(&t->writer,NULL,trace_writer,t)==0;
+        if(!ok){
+            sem_destroy(&t->free_blocks);
+            sem_destroy(&t->full_blocks);
+        }
+    }
+    if(!ok){
+        lc3_trace_free(t);
+        return 0;
+    }
+    vm->trace=t;
+    return 1;
+}
+
+/* ends the trace and waits for it to be written. returns 0 if a
+ * write failed */
+int lc3_trace_stop(lc3_vm* vm){
+    lc3_trace* t=vm->trace;
+    *t->p++=TRACE_END;
+    trace_hand_over(t,1);
+    pthread_join(t->writer,NULL);
+    int ok=!atomic_load(&t->failed)&&fflush(t->out)==0;
+    sem_destroy(&t->free_blocks);
+    sem_destroy(&t->full_blocks);
+    lc3_trace_free(t);
+    vm->trace=NULL;
+    return ok;
+}
+
+/* any step, run by the interpreter and diffed against the registers
+ * and flags the reader has. sets *pp past the step and returns whether
+ * the machine still runs, or -1 when it stopped in front of the step */
+static int trace_step_slow(lc3_vm* vm,lc3_trace* t,uint16_t pc,uint8_t** pp){
+    uint16_t instr=vm->memory[pc];
+    uint16_t address=0;
+    if(instr>>12==OP_STI){
+        address=vm->memory[(uint16_t)(pc+1+sign_extend(instr&0x1FF,9))];
+    }
+    vm->reg[R_PC]=pc;
+    t->stores=0;
+    int running=read_and_execute_instruction(vm);
+    if(__builtin_expect(vm->stop,0)&&!running){
+        return -1;
+    }
+
+    uint8_t* p=*pp;
+    *p++=TRACE_DIFF;
+    uint8_t* q=p+1;
+    unsigned tag=0;
+    if(pc!=t->next_pc){
+        tag|=TRACE_JUMP;
+        q=trace_varint(q,zigzag((int16_t)(pc-t->next_pc)));
+    }
+    if(instr!=t->instr[pc]){
+        tag|=TRACE_INSTR;
+        t->instr[pc]=instr;
+        *q++=instr&0xFF;
+        *q++=instr>>8;
+    }
+    if(instr>>12==OP_STI){
+        tag|=TRACE_WRITE;
+        q=trace_varint(q,zigzag((int16_t)(address-t->last_write)));
+        t->last_write=address;
+    }
+    unsigned mask=0;
+    for(int r=0;r<8;++r){
+        mask|=(vm->reg[r]!=t->reg[r])<<r;
+    }
+    uint16_t predicted=flags_of(t->cond);
+    if(mask){
+        int r=__builtin_ctz(mask);
+        if(mask==1u<<r){
+            tag|=r+1;
+            predicted=flags_of(vm->reg[r]);
+        }else{
+            tag|=TRACE_REGS;
+            *q++=mask;
+        }
+        for(;r<8;++r){
+            if(mask>>r&1){
+                q=trace_varint(q,zigzag((int16_t)(vm->reg[r]-t->reg[r])));
+                t->reg[r]=vm->reg[r];
+            }
+        }
+    }
+    uint16_t flags=cond_flags(vm);
+    if(flags!=predicted){
+        tag|=TRACE_COND;
+        *q++=flags;
+    }
+    t->cond=vm->cond_result;
+    *p=tag;
+    for(int i=0;i<t->stores;++i){
+        *q++=TRACE_STORE;
+        q=trace_varint(q,zigzag((int16_t)(t->store[i][0]-t->last_write)));
+        t->last_write=t->store[i][0];
+        *q++=t->store[i][1]&0xFF;
+        *q++=t->store[i][1]>>8;
+    }
+    t->stores=0;
+    t->next_pc=pc+1;
+    *pp=q;
+    return running;
+}
+
+/* registers set from outside between runs, by the debugger say, go
+ * in a sync record so each step's differences are its own. the first
+ * step of a run is diffed in full, which also catches flags set from
+ * outside */
+int run_traced(lc3_vm* vm,uint64_t budget){
+    lc3_trace* t=vm->trace;
+    uint16_t* reg=vm->reg;
+    uint8_t* p=t->p;
+    int running=1;
+    if(p>=t->end){
+        t->p=p;
+        trace_hand_over(t,0);
+        p=t->p;
+    }
+    if(memcmp(t->reg,reg,sizeof(t->reg))!=0){
+        *p++=TRACE_SYNC;
+        p=trace_raw_regs(p,reg);
+        memcpy(t->reg,reg,sizeof(t->reg));
+    }
+    if(budget){
+        --budget;
+        running=trace_step_slow(vm,t,reg[R_PC],&p);
+        if(running<0){
+            running=0;
+            goto out;
+        }
+    }
+
+    /* the reader's registers and flags are the machine's after each
+     * step, t->reg only catches up for a diffed one. the rest is kept
+     * in locals, the byte stores through p would otherwise reload it
+     * every step */
+    uint16_t pc=reg[R_PC];
+    uint16_t next_pc=t->next_pc;
+    uint16_t last_write=t->last_write;
+    uint8_t* end=t->end;
+    decoded_instr* decoded=vm->decoded;
+    const uint16_t* memory=vm->memory;
+    uint16_t* seen=t->instr;
+    while(running&&budget){
+        if(__builtin_expect(p>=end,0)){
+            t->p=p;
+            trace_hand_over(t,0);
+            p=t->p;
+            end=t->end;
+        }
+        --budget;
+        decoded_instr* d=&decoded[pc];
+        if(!d->valid){
+            decode_instr(vm,pc,mem_read(vm,pc));
+        }
+        uint16_t instr=memory[pc];
+        uint8_t* q=p+1;
+        unsigned tag=0;
+        if(pc!=next_pc){
+            tag|=TRACE_JUMP;
+            q=trace_varint(q,zigzag((int16_t)(pc-next_pc)));
+        }
+        if(__builtin_expect(instr!=seen[pc],0)){
+            /* seen is updated once the step is logged here */
+            tag|=TRACE_INSTR;
+            *q++=instr&0xFF;
+            *q++=instr>>8;
+        }
+        uint16_t next=pc+1;
+        unsigned dr=d->dr;
+        uint16_t old=reg[dr];
+        uint16_t value;
+        switch(d->op){
+            case OP_ADD:
+                value=reg[d->sr1]+(d->imm_flag?d->imm:reg[d->sr2]);
+                goto set;
+            case OP_AND:
+                value=reg[d->sr1]&(d->imm_flag?d->imm:reg[d->sr2]);
+                goto set;
+            case OP_NOT:
+                value=~reg[d->sr1];
+                goto set;
+            case OP_LEA:
+                value=next+d->imm;
+            set:
+                reg[dr]=value;
+                vm->cond_result=value;
+                break;
+            case OP_LD:
+                value=mem_read(vm,next+d->imm);
+                goto load;
+            case OP_LDI:
+                value=mem_read(vm,mem_read(vm,next+d->imm));
+                goto load;
+            case OP_LDR:
+                value=mem_read(vm,reg[d->sr1]+d->imm);
+            load:
+                reg[dr]=value;
+                vm->cond_result=value;
+                if(value!=old){
+                    tag|=dr+1;
+                    q=trace_varint(q,zigzag((int16_t)(value-old)));
+                }
+                break;
+            case OP_BR:
+                if(cond_flags(vm)&dr){
+                    next+=d->imm;
+                }
+                break;
+            case OP_JMP:
+                next=reg[d->sr1];
+                break;
+            case OP_JSR:
+                value=d->imm_flag?next+d->imm:reg[d->sr1];
+                reg[R_R7]=next;
+                next=value;
+                break;
+            case OP_ST:
+                mem_write(vm,next+d->imm,old);
+                break;
+            case OP_STR:
+                mem_write(vm,reg[d->sr1]+d->imm,old);
+                break;
+            case OP_STI:
+                {
+                    uint16_t address=mem_read(vm,next+d->imm);
+                    mem_write(vm,address,old);
+                    tag|=TRACE_WRITE;
+                    q=trace_varint(q,zigzag((int16_t)(address-last_write)));
+                    last_write=address;
+                }
+                break;
+            default:
+                /* traps, RTI, RES, idle loops and breakpoints */
+                memcpy(t->reg,reg,sizeof(t->reg));
+                t->next_pc=next_pc;
+                t->cond=vm->cond_result;
+                t->last_write=last_write;
+                running=trace_step_slow(vm,t,pc,&p);
+                if(running<0){
+                    running=0;
+                    goto out;
+                }
+                pc=reg[R_PC];
+                next_pc=t->next_pc;
+                last_write=t->last_write;
+                continue;
+        }
+        if(__builtin_expect(tag&TRACE_INSTR,0)){
+            seen[pc]=instr;
+        }
+        *p=tag;
+        p=q;
+        next_pc=next;
+        pc=next;
+    }
+    reg[R_PC]=pc;
+    t->next_pc=next_pc;
+    t->cond=vm->cond_result;
+    t->last_write=last_write;
+out:
+    t->p=p;
+    memcpy(t->reg,reg,sizeof(t->reg));
+    vm->budget_left=budget;
+    return running;
+}
+
+#else
+void trace_store(lc3_vm* vm,uint16_t address,uint16_t value){
+}
+#endif
+
+/* a step the reader works out itself, returns the pc after it. cond
+ * holds the flags */
+uint16_t trace_compute(uint16_t* reg,uint16_t* cond,uint16_t pc,uint16_t instr){
+    uint16_t next=pc+1;
+    unsigned dr=(instr>>9)&0x7,sr1=(instr>>6)&0x7;
+    uint16_t operand=instr&0x20?sign_extend(instr&0x1F,5):reg[instr&0x7];
+    switch(instr>>12){
+        case OP_ADD:
+            reg[dr]=reg[sr1]+operand;
+            *cond=flags_of(reg[dr]);
+            break;
+        case OP_AND:
+            reg[dr]=reg[sr1]&operand;
+            *cond=flags_of(reg[dr]);
+            break;
+        case OP_NOT:
+            reg[dr]=~reg[sr1];
+            *cond=flags_of(reg[dr]);
+            break;
+        case OP_LEA:
+            reg[dr]=next+sign_extend(instr&0x1FF,9);
+            *cond=flags_of(reg[dr]);
+            break;
+        case OP_BR:
+            if(*cond&dr){
+                next+=sign_extend(instr&0x1FF,9);
+            }
+            break;
+        case OP_JMP:
+            next=reg[sr1];
+            break;
+        case OP_JSR:
+            {
+                uint16_t target=instr&0x800?next+sign_extend(instr&0x7FF,11):reg[sr1];
+                reg[R_R7]=next;
+                next=target;
+            }
+            break;
+    }
+    return next;
+}
+
+/* the reader: one line per step, as the pc, the word, its mnemonic
+ * and what it changed. returns 0 if in is not a whole trace */
+int dump_trace(FILE* in,FILE* out){
+    uint8_t header[sizeof(TRACE_MAGIC)-1+20];
+    uint16_t reg[8],instr[MEMORY_WORDS]={0};
+    uint16_t pc=0,cond=0,last_write=0;
+    uint64_t steps=0,x;
+    int diff=0;
+    if(fread(header,1,sizeof(header),in)!=sizeof(header)||memcmp(header,TRACE_MAGIC,sizeof(TRACE_MAGIC)-1)!=0){
+        return 0;
+    }
+    for(int i=0;i<10;++i){
+        uint16_t v=header[sizeof(TRACE_MAGIC)-1+2*i]|header[sizeof(TRACE_MAGIC)-1+2*i+1]<<8;
+        if(i<8){
+            reg[i]=v;
+        }else if(i==8){
+            pc=v;
+        }else{
+            cond=v;
+        }
+    }
+    for(;;){
+        int tag=getc(in);
+        if(tag==EOF){
+            return 0;
+        }
+        if(tag==TRACE_END){
+            fprintf(out,"%llu steps\n",(unsigned long long)steps);
+            return 1;
+        }
+        if(tag==TRACE_STORE){
+            int lo,hi;
+            if(!get_varint(in,&x)||(lo=getc(in))==EOF||(hi=getc(in))==EOF){
+                return 0;
+            }
+            last_write+=unzigzag(x);
+            fprintf(out,"%21s [x%04X]=x%04X\n","",last_write,lo|hi<<8);
+            continue;
+        }
+        if(tag==TRACE_DIFF){
+            diff=1;
+            continue;
+        }
+        if(tag==TRACE_SYNC){
+            uint8_t bytes[16];
+            if(fread(bytes,1,sizeof(bytes),in)!=sizeof(bytes)){
+                return 0;
+            }
+            for(int r=0;r<8;++r){
+                reg[r]=bytes[2*r]|bytes[2*r+1]<<8;
+            }
+            continue;
+        }
+        if(tag&TRACE_JUMP){
+            if(!get_varint(in,&x)){
+                return 0;
+            }
+            pc+=unzigzag(x);
+        }
+        if(tag&TRACE_INSTR){
+            int lo=getc(in),hi=getc(in);
+            if(hi==EOF){
+                return 0;
+            }
+            instr[pc]=lo|hi<<8;
+        }
+        char name[16];
+        format_instr(name,sizeof(name),instr[pc]);
+        fprintf(out,"x%04X x%04X %-9s",pc,instr[pc],name);
+        int op=instr[pc]>>12;
+        if(tag&TRACE_WRITE){
+            if(!get_varint(in,&x)){
+                return 0;
+            }
+            last_write+=unzigzag(x);
+            fprintf(out," [x%04X]=x%04X",last_write,reg[(instr[pc]>>9)&0x7]);
+        }else if(op==OP_ST||op==OP_STR){
+            uint16_t address=op==OP_ST?pc+1+sign_extend(instr[pc]&0x1FF,9):
+                             reg[(instr[pc]>>6)&0x7]+sign_extend(instr[pc]&0x3F,6);
+            fprintf(out," [x%04X]=x%04X",address,reg[(instr[pc]>>9)&0x7]);
+        }
+        uint16_t before[8],last_cond=cond,next=pc+1;
+        memcpy(before,reg,sizeof(before));
+        int computed=!diff&&(op==OP_ADD||op==OP_AND||op==OP_NOT||op==OP_LEA||
+                             op==OP_BR||op==OP_JMP||op==OP_JSR);
+        if(computed){
+            next=trace_compute(reg,&cond,pc,instr[pc]);
+        }
+        unsigned mask=0;
+        if((tag&0x0F)==TRACE_REGS){
+            int c=getc(in);
+            if(c==EOF){
+                return 0;
+            }
+            mask=c;
+        }else if(tag&0x0F){
+            mask=1u<<((tag&0x0F)-1);
+        }
+        for(int r=0;r<8;++r){
+            if(mask>>r&1){
+                if(!get_varint(in,&x)){
+                    return 0;
+                }
+                reg[r]+=unzigzag(x);
+                if(mask==1u<<r){
+                    cond=flags_of(reg[r]);
+                }
+            }
+        }
+        if(!diff&&(op==OP_LD||op==OP_LDI||op==OP_LDR)){
+            /* the flags follow the load even when it changed nothing */
+            cond=flags_of(reg[(instr[pc]>>9)&0x7]);
+        }
+        if(tag&TRACE_COND){
+            int c=getc(in);
+            if(c==EOF){
+                return 0;
+            }
+            cond=c;
+        }
+        int changed=0;
+        for(int r=0;r<8;++r){
+            if(reg[r]!=before[r]){
+                fprintf(out," R%d=x%04X",r,reg[r]);
+                changed=1;
+            }
+        }
+        if(changed||cond!=last_cond){
+            fprintf(out," %s",cond&FL_NEG?"n":cond&FL_ZRO?"z":"p");
+        }
+        fprintf(out,"\n");
+        pc=next;
+        diff=0;
+        ++steps;
+    }
+}
+
+/** Execution Engines **/
+
+#if defined(__GNUC__)
+#define HAVE_COMPUTED_GOTO 1
+#endif
+
+enum{
+    ENGINE_SWITCH=0,    /* read_and_execute_instruction, portable */
+    ENGINE_THREADED,    /* computed goto dispatch */
+    ENGINE_BLOCK,       /* basic block translation cache */
+    ENGINE_JIT,         /* blocks, hot ones compiled to x86-64 */
+    ENGINE_COUNT
+};
+
+const char* engine_names[ENGINE_COUNT]={
+    "switch",
+    "threaded",
+    "block",
+    "jit"
+};
+
+#ifdef HAVE_COMPUTED_GOTO
+enum{ DEFAULT_ENGINE=ENGINE_THREADED };
+#else
+enum{ DEFAULT_ENGINE=ENGINE_SWITCH };
+#endif
+
+int parse_engine(const char* name){
+    for(int i=0;i<ENGINE_COUNT;++i){
+        if(strcmp(name,engine_names[i])==0){
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* run at most budget instructions, returns 0 once the program halts */
+int run_switch(lc3_vm* vm,uint64_t budget){
+    int running=1;
+    while(running&&budget--){
+        running=read_and_execute_instruction(vm);
+    }
+    vm->budget_left=budget;
+    return running;
+}
+
+#ifdef HAVE_COMPUTED_GOTO
+int run_threaded(lc3_vm* vm,uint64_t budget){
+    /* indexed by op<<1|imm_flag so the register and immediate forms of
+     * ADD/AND and JSR/JSRR get their own handler */
+    static void* const dispatch[36]={
+        &&op_br,    &&op_br,
+        &&op_add,   &&op_add_imm,
+        &&op_ld,    &&op_ld,
+        &&op_st,    &&op_st,
+        &&op_jsrr,  &&op_jsr,
+        &&op_and,   &&op_and_imm,
+        &&op_ldr,   &&op_ldr,
+        &&op_str,   &&op_str,
+        &&op_rti,   &&op_rti,
+        &&op_not,   &&op_not,
+        &&op_ldi,   &&op_ldi,
+        &&op_sti,   &&op_sti,
+        &&op_jmp,   &&op_jmp,
+        &&op_res,   &&op_res,
+        &&op_lea,   &&op_lea,
+        &&op_trap,  &&op_trap,
+        &&op_idle,  &&op_idle,
+        &&op_break, &&op_break
+    };
+
+    /* the pc lives in a local and is written back before leaving
+     * the loop or calling out. taken jumps also publish it, so the
+     * sampler sees the start of the running basic block */
+    uint16_t pc=vm->reg[R_PC];
+    decoded_instr* d;
+    decoded_instr head;
+    int running=1;
+
+#define DISPATCH() do{                      \
+        if(!budget--){                      \
+            goto out;                       \
+        }                                   \
+        d=&vm->decoded[pc];                     \
+        if(!d->valid){                      \
+            decode_instr(vm,pc,mem_read(vm,pc));   \
+        }                                   \
+        ++pc;                               \
+        goto *dispatch[d->op<<1|d->imm_flag]; \
+    }while(0)
+
+    DISPATCH();
+
+op_add:
+    vm->reg[d->dr]=vm->reg[d->sr1]+vm->reg[d->sr2];
+    update_flags(vm,d->dr);
+    DISPATCH();
+op_add_imm:
+    vm->reg[d->dr]=vm->reg[d->sr1]+d->imm;
+    update_flags(vm,d->dr);
+    DISPATCH();
+op_and:
+    vm->reg[d->dr]=vm->reg[d->sr1]&vm->reg[d->sr2];
+    update_flags(vm,d->dr);
+    DISPATCH();
+op_and_imm:
+    vm->reg[d->dr]=vm->reg[d->sr1]&d->imm;
+    update_flags(vm,d->dr);
+    DISPATCH();
+op_not:
+    vm->reg[d->dr]=~vm->reg[d->sr1];
+    update_flags(vm,d->dr);
+    DISPATCH();
+op_br:
+    if(cond_flags(vm)&d->dr){
+        pc+=d->imm;
+        vm->reg[R_PC]=pc;
+    }
+    DISPATCH();
+op_jmp:
+    pc=vm->reg[d->sr1];
+    vm->reg[R_PC]=pc;
+    DISPATCH();
+op_jsr:
+    vm->reg[R_R7]=pc;
+    pc+=d->imm;
+    vm->reg[R_PC]=pc;
+    DISPATCH();
+op_jsrr:
+    {
+        uint16_t base=vm->reg[d->sr1];
+        vm->reg[R_R7]=pc;
+        pc=base;
+        vm->reg[R_PC]=pc;
+    }
+    DISPATCH();
+op_ld:
+    vm->reg[d->dr]=mem_read(vm,pc+d->imm);
+    update_flags(vm,d->dr);
+    DISPATCH();
+op_ldi:
+    vm->reg[d->dr]=mem_read(vm,mem_read(vm,pc+d->imm));
+    update_flags(vm,d->dr);
+    DISPATCH();
+op_ldr:
+    vm->reg[d->dr]=mem_read(vm,vm->reg[d->sr1]+d->imm);
+    update_flags(vm,d->dr);
+    DISPATCH();
+op_lea:
+    vm->reg[d->dr]=pc+d->imm;
+    update_flags(vm,d->dr);
+    DISPATCH();
+op_st:
+    mem_write(vm,pc+d->imm,vm->reg[d->dr]);
+    DISPATCH();
+op_sti:
+    mem_write(vm,mem_read(vm,pc+d->imm),vm->reg[d->dr]);
+    DISPATCH();
+op_str:
+    mem_write(vm,vm->reg[d->sr1]+d->imm,vm->reg[d->dr]);
+    DISPATCH();
+op_trap:
+    vm->reg[R_PC]=pc;
+    running=execute_trap(vm,d->imm,vm->in,vm->out);
+    if(!running){
+        goto out;
+    }
+    pc=vm->reg[R_PC];
+    DISPATCH();
+op_idle:
+    /* run the loop head itself once the wait is over */
+    vm->reg[R_PC]=pc;
+    idle_wait(vm,pc-1);
+    head=decode_word(vm->memory[(uint16_t)(pc-1)]);
+    d=&head;
+    goto *dispatch[d->op<<1|d->imm_flag];
+op_break:
+    pc--;
+    vm->stop=vm->stop?vm->stop:STOP_BREAK;
+    running=0;
+    goto out;
+op_rti:
+    vm->reg[R_PC]=pc;
+    os_rti(vm);
+    pc=vm->reg[R_PC];
+    DISPATCH();
+op_res:
+    vm->reg[R_PC]=pc;
+    os_reserved(vm);
+    pc=vm->reg[R_PC];
+    DISPATCH();
+
+#undef DISPATCH
+
+out:
+    vm->reg[R_PC]=pc;
+    /* an exhausted budget has wrapped in DISPATCH */
+    vm->budget_left=running?0:budget;
+    return running;
+}
+#else
+int run_threaded(lc3_vm* vm,uint64_t budget){
+    return run_switch(vm,budget);
+}
+#endif
+
+/** Block Translation **/
+
+void free_retired_blocks(lc3_vm* vm){
+    while(vm->retired_blocks){
+        block* b=vm->retired_blocks;
+        vm->retired_blocks=b->next_retired;
+        free(b);
+    }
+    vm->code_modified=0;
+}
+
+/* like retire_blocks for every block */
+void retire_all_blocks(lc3_vm* vm){
+    for(int i=0;vm->block_count&&i<=UINT16_MAX;++i){
+        if(vm->blocks[i]){
+            vm->blocks[i]->next_retired=vm->retired_blocks;
+            vm->retired_blocks=vm->blocks[i];
+            vm->blocks[i]=NULL;
+            vm->block_count--;
+        }
+    }
+}
+
+/* drop every cached decode and translation */
+void reset_code_caches(lc3_vm* vm){
+    retire_all_blocks(vm);
+    free_retired_blocks(vm);
+    lc3_zero(vm->decoded,MEMORY_WORDS*sizeof(decoded_instr));
+    lc3_zero(vm->code_words,MEMORY_WORDS*sizeof(uint8_t));
+}
+
+/* returns NULL when no instruction at start can be translated */
+block* translate_block(lc3_vm* vm,uint16_t start){
+    uop uops[MAX_BLOCK_LEN+1];     /* room for a trailing UOP_EXIT */
+    int n=0;
+    int len=0;
+    uint16_t pc=start;
+    int done=0;
+
+    while(!done){
+        /* cut long runs, never wrap around the address space and leave
+         * device pages to the interpreter, reading them early would
+         * have side effects */
+        if(len==MAX_BLOCK_LEN||(len>0&&pc==0)||vm->device_page[pc>>MEMORY_PAGE_SHIFT]){
+            if(len==0){
+                return NULL;
+            }
+            uops[n++]=(uop){.kind=UOP_EXIT,.count=len,.next=pc};
+            break;
+        }
+
+        decoded_instr* d=&vm->decoded[pc];
+        if(!d->valid){
+            decode_instr(vm,pc,vm->memory[pc]);
+        }
+        decoded_instr head;
+        if(d->op==OP_BREAK){
+            /* the interpreter stops there */
+            if(len==0){
+                return NULL;
+            }
+            uops[n++]=(uop){.kind=UOP_EXIT,.count=len,.next=pc};
+            break;
+        }
+        if(d->op==OP_IDLE){
+            if(len>0){
+                /* a polling loop always starts a block of its own */
+                uops[n++]=(uop){.kind=UOP_EXIT,.count=len,.next=pc};
+                break;
+            }
+            uops[n++]=(uop){.kind=UOP_IDLE,.imm=pc,.next=pc};
+            head=decode_word(vm->memory[pc]);
+            d=&head;
+        }
+        uint16_t next=pc+1;
+        uop u={.a=d->dr,.b=d->sr1,.c=d->sr2,.imm=d->imm,.next=next};
+
+        switch(d->op){
+            case OP_ADD:
+                u.kind=d->imm_flag?UOP_ADD_IMM:UOP_ADD;
+                break;
+            case OP_AND:
+                u.kind=d->imm_flag?UOP_AND_IMM:UOP_AND;
+                break;
+            case OP_NOT:
+                u.kind=UOP_NOT;
+                break;
+            case OP_LD:
+                u.kind=UOP_LD;
+                u.imm=next+d->imm;
+                break;
+            case OP_LDI:
+                u.kind=UOP_LDI;
+                u.imm=next+d->imm;
+                break;
+            case OP_LDR:
+                u.kind=UOP_LDR;
+                break;
+            case OP_LEA:
+                u.kind=UOP_LEA;
+                u.imm=next+d->imm;
+                break;
+            case OP_ST:
+                u.kind=UOP_ST;
+                u.imm=next+d->imm;
+                break;
+            case OP_STI:
+                u.kind=UOP_STI;
+                u.imm=next+d->imm;
+                break;
+            case OP_STR:
+                u.kind=UOP_STR;
+                break;
+            case OP_BR:
+                u.kind=UOP_BR;
+                u.imm=next+d->imm;
+                done=1;
+                break;
+            case OP_JMP:
+                u.kind=UOP_JMP;
+                u.a=d->sr1;
+                done=1;
+                break;
+            case OP_JSR:
+                u.kind=d->imm_flag?UOP_JSR:UOP_JSRR;
+                u.imm=next+d->imm;
+                u.a=d->sr1;
+                done=1;
+                break;
+            case OP_TRAP:
+                u.kind=UOP_TRAP;
+                done=1;
+                break;
+            default:
+                /* RTI/RES are left to the interpreter */
+                if(len==0){
+                    return NULL;
+                }
+                uops[n++]=(uop){.kind=UOP_EXIT,.count=len,.next=pc};
+                done=1;
+                continue;
+        }
+        u.count=++len;
+        pc=next;
+
+        /* fuse with the previous uop */
+        uop* prev=n>0?&uops[n-1]:NULL;
+        if(prev&&u.kind==UOP_ADD_IMM&&prev->kind==UOP_AND_IMM&&prev->imm==0&&
+           prev->a==u.a&&u.b==u.a){
+            prev->kind=UOP_CONST;
+            prev->imm=u.imm;
+        }else if(prev&&u.kind==UOP_ADD_IMM&&prev->kind==UOP_LDR){
+            prev->kind=UOP_LDR_ADD_IMM;
+            prev->d=u.a;
+            prev->e=u.b;
+            prev->imm2=u.imm;
+        }else if(prev&&u.kind==UOP_BR&&prev->kind==UOP_ADD_IMM){
+            prev->kind=UOP_ADD_IMM_BR;
+            prev->c=u.a;
+            prev->imm2=u.imm;
+        }else{
+            uops[n++]=u;
+            continue;
+        }
+        prev->count=u.count;
+        prev->next=u.next;
+    }
+
+    block* b=malloc(sizeof(block)+n*sizeof(uop));
+    if(!b){
+        return NULL;
+    }
+    b->next_retired=NULL;
+    b->native=NULL;
+    b->hits=0;
+    b->start=start;
+    b->len=len;
+    memcpy(b->uops,uops,n*sizeof(uop));
+    for(int i=0;i<len;++i){
+        vm->code_words[(uint16_t)(start+i)]=1;
+    }
+    vm->blocks[start]=b;
+    vm->block_count++;
+    return b;
+}
+
+/* returns 0 once the program halts, *retired gets the instructions run */
+int execute_block(lc3_vm* vm,block* b,uint64_t* retired){
+    uop* u=b->uops;
+    for(;;++u){
+        switch(u->kind){
+            case UOP_ADD:
+                vm->reg[u->a]=vm->reg[u->b]+vm->reg[u->c];
+                update_flags(vm,u->a);
+                break;
+            case UOP_ADD_IMM:
+                vm->reg[u->a]=vm->reg[u->b]+u->imm;
+                update_flags(vm,u->a);
+                break;
+            case UOP_AND:
+                vm->reg[u->a]=vm->reg[u->b]&vm->reg[u->c];
+                update_flags(vm,u->a);
+                break;
+            case UOP_AND_IMM:
+                vm->reg[u->a]=vm->reg[u->b]&u->imm;
+                update_flags(vm,u->a);
+                break;
+            case UOP_NOT:
+                vm->reg[u->a]=~vm->reg[u->b];
+                update_flags(vm,u->a);
+                break;
+            case UOP_LD:
+                vm->reg[u->a]=mem_read(vm,u->imm);
+                update_flags(vm,u->a);
+                if(vm->stop){
+                    goto leave;
+                }
+                break;
+            case UOP_LDI:
+                vm->reg[u->a]=mem_read(vm,mem_read(vm,u->imm));
+                update_flags(vm,u->a);
+                if(vm->stop){
+                    goto leave;
+                }
+                break;
+            case UOP_LDR:
+                vm->reg[u->a]=mem_read(vm,vm->reg[u->b]+u->imm);
+                update_flags(vm,u->a);
+                if(vm->stop){
+                    goto leave;
+                }
+                break;
+            case UOP_LEA:
+                vm->reg[u->a]=u->imm;
+                update_flags(vm,u->a);
+                break;
+            case UOP_ST:
+                mem_write(vm,u->imm,vm->reg[u->a]);
+                if(vm->code_modified||vm->stop){
+                    goto leave;
+                }
+                break;
+            case UOP_STI:
+                mem_write(vm,mem_read(vm,u->imm),vm->reg[u->a]);
+                if(vm->code_modified||vm->stop){
+                    goto leave;
+                }
+                break;
+            case UOP_STR:
+                mem_write(vm,vm->reg[u->b]+u->imm,vm->reg[u->a]);
+                if(vm->code_modified||vm->stop){
+                    goto leave;
+                }
+                break;
+            case UOP_CONST:
+                vm->reg[u->a]=u->imm;
+                update_flags(vm,u->a);
+                break;
+            case UOP_LDR_ADD_IMM:
+                vm->reg[u->a]=mem_read(vm,vm->reg[u->b]+u->imm);
+                if(vm->stop){
+                    /* in front of the fused ADD */
+                    update_flags(vm,u->a);
+                    vm->reg[R_PC]=u->next-1;
+                    *retired=u->count-1;
+                    return 1;
+                }
+                vm->reg[u->d]=vm->reg[u->e]+u->imm2;
+                update_flags(vm,u->d);
+                break;
+            case UOP_BR:
+                vm->reg[R_PC]=(cond_flags(vm)&u->a)?u->imm:u->next;
+                *retired=u->count;
+                return 1;
+            case UOP_ADD_IMM_BR:
+                vm->reg[u->a]=vm->reg[u->b]+u->imm;
+                update_flags(vm,u->a);
+                vm->reg[R_PC]=(cond_flags(vm)&u->c)?u->imm2:u->next;
+                *retired=u->count;
+                return 1;
+            case UOP_JMP:
+                vm->reg[R_PC]=vm->reg[u->a];
+                *retired=u->count;
+                return 1;
+            case UOP_JSR:
+                vm->reg[R_R7]=u->next;
+                vm->reg[R_PC]=u->imm;
+                *retired=u->count;
+                return 1;
+            case UOP_JSRR:
+                vm->reg[R_PC]=vm->reg[u->a];
+                vm->reg[R_R7]=u->next;
+                *retired=u->count;
+                return 1;
+            case UOP_TRAP:
+                vm->reg[R_PC]=u->next;
+                *retired=u->count;
+                return execute_trap(vm,u->imm,vm->in,vm->out);
+            case UOP_IDLE:
+                idle_wait(vm,u->imm);
+                break;
+            case UOP_EXIT:
+            default:
+                vm->reg[R_PC]=u->next;
+                *retired=u->count;
+                return 1;
+        }
+    }
+
+leave:
+    /* the block may have rewritten itself, or a device stopped the
+     * machine, leave before the next uop */
+    vm->reg[R_PC]=u->next;
+    *retired=u->count;
+    return 1;
+}
+
+int run_blocks(lc3_vm* vm,uint64_t budget){
+    int running=1;
+    while(running&&budget){
+        if(vm->retired_blocks||vm->code_modified){
+            free_retired_blocks(vm);
+        }
+        uint16_t pc=vm->reg[R_PC];
+        block* b=vm->blocks[pc];
+        if(!b){
+            b=translate_block(vm,pc);
+        }
+        if(!b||b->len>budget){
+            /* not translatable, or the caller wants fewer instructions */
+            running=read_and_execute_instruction(vm);
+            --budget;
+            continue;
+        }
+        uint64_t retired;
+        running=execute_block(vm,b,&retired);
+        budget-=retired;
+    }
+    vm->budget_left=budget;
+    return running;
+}
+
+/** JIT **/
+
+/* hot blocks are compiled to x86-64. LC-3 R0-R7 live in r8w-r15w and
+ * cond_result lives in esi, tested with the host flags at each BR. the
+ * interpreter stays the tier-0 path and anything unusual (device
+ * registers, self-modifying stores, traps) calls back into C. */
+#if defined(__x86_64__) && !defined(_WIN32)
+#define HAVE_JIT 1
+#endif
+
+enum{
+    JIT_THRESHOLD=1000,         /* block executions before compiling */
+    JIT_ARENA_SIZE=8<<20
+};
+
+int jit_threshold=JIT_THRESHOLD;
+
+#ifdef HAVE_JIT
+
+typedef struct{
+    uint8_t* start;
+    uint8_t* p;
+    uint8_t* end;
+    /* jumps to the common epilogue */
+    uint8_t* exits[2*MAX_BLOCK_LEN+8];
+    int nexits;
+    const uint8_t* device_page; /* of the machine the code is for */
+} jit_buf;
+
+enum{
+    H_RAX=0, H_RCX, H_RDX, H_RBX, H_RSP, H_RBP, H_RSI, H_RDI
+};
+
+/* host register holding an LC-3 register */
+#define H_REG(r) (8+(r))
+
+/* rbp holds the machine, these are displacements from it */
+#define VM_REG(r) ((int32_t)(offsetof(lc3_vm,reg)+(r)*sizeof(uint16_t)))
+#define VM_FIELD(f) ((int32_t)offsetof(lc3_vm,f))
+
+/* stack frame slots */
+enum{
+    SLOT_RETIRED=0,     /* instructions retired by earlier loop iterations */
+    SLOT_BUDGET=8,
+    SLOT_COUNT=16,
+    SLOT_COND=24,
+    FRAME_SIZE=40
+};
+
+/* x86 condition codes */
+enum{
+    CC_B=0x2, CC_AE=0x3, CC_E=0x4, CC_NE=0x5, CC_S=0x8, CC_NS=0x9,
+    CC_LE=0xE, CC_G=0xF
+};
+
+void jit_emit(jit_buf* b,const uint8_t* bytes,int n){
+    if(b->p+n>b->end){
+        b->p=b->end+1;
+        return;
+    }
+    if(b->p<=b->end){
+        memcpy(b->p,bytes,n);
+        b->p+=n;
+    }
+}
+
+void jit_8(jit_buf* b,uint8_t x){
+    jit_emit(b,&x,1);
+}
+
+void jit_16(jit_buf* b,uint16_t x){
+    jit_emit(b,(uint8_t*)&x,2);
+}
+
+void jit_32(jit_buf* b,uint32_t x){
+    jit_emit(b,(uint8_t*)&x,4);
+}
+
+void jit_64(jit_buf* b,uint64_t x){
+    jit_emit(b,(uint8_t*)&x,8);
+}
+
+int jit_overflow(jit_buf* b){
+    return b->p>b->end;
+}
+
+void jit_rex(jit_buf* b,int w,int reg,int rm){
+    uint8_t rex=0x40|(w<<3)|((reg>>3)<<2)|(rm>>3);
+    if(rex!=0x40){
+        jit_8(b,rex);
+    }
+}
+
+void jit_modrm(jit_buf* b,int mod,int reg,int rm){
+    jit_8(b,(mod<<6)|((reg&7)<<3)|(rm&7));
+}
+
+/* op r/m16, r16 (add/and/test/mov) */
+void jit_op16_rr(jit_buf* b,uint8_t op,int dst,int src){
+    jit_8(b,0x66);
+    jit_rex(b,0,src,dst);
+    jit_8(b,op);
+    jit_modrm(b,3,src,dst);
+}
+
+/* 81 /ext r/m16, imm16 */
+void jit_op16_ri(jit_buf* b,int ext,int dst,uint16_t imm){
+    jit_8(b,0x66);
+    jit_rex(b,0,0,dst);
+    jit_8(b,0x81);
+    jit_modrm(b,3,ext,dst);
+    jit_16(b,imm);
+}
+
+void jit_not16(jit_buf* b,int dst){
+    jit_8(b,0x66);
+    jit_rex(b,0,0,dst);
+    jit_8(b,0xF7);
+    jit_modrm(b,3,2,dst);
+}
+
+/* 32 bit moves keep the upper half of every host register zero */
+void jit_mov32_rr(jit_buf* b,int dst,int src){
+    if(dst!=src){
+        jit_rex(b,0,src,dst);
+        jit_8(b,0x89);
+        jit_modrm(b,3,src,dst);
+    }
+}
+
+void jit_mov32_ri(jit_buf* b,int dst,uint32_t imm){
+    jit_rex(b,0,0,dst);
+    jit_8(b,0xB8+(dst&7));
+    jit_32(b,imm);
+}
+
+/* movzx dst, word [base+disp] */
+void jit_load16(jit_buf* b,int dst,int base,int32_t disp){
+    jit_rex(b,0,dst,base);
+    jit_8(b,0x0F);
+    jit_8(b,0xB7);
+    jit_modrm(b,2,dst,base);
+    jit_32(b,disp);
+}
+
+/* mov word [base+disp], src */
+void jit_store16(jit_buf* b,int src,int base,int32_t disp){
+    jit_8(b,0x66);
+    jit_rex(b,0,src,base);
+    jit_8(b,0x89);
+    jit_modrm(b,2,src,base);
+    jit_32(b,disp);
+}
+
+/* mov word [rbp+disp], imm16 */
+void jit_store16_imm(jit_buf* b,int32_t disp,uint16_t imm){
+    jit_8(b,0x66);
+    jit_8(b,0xC7);
+    jit_modrm(b,2,0,H_RBP);
+    jit_32(b,disp);
+    jit_16(b,imm);
+}
+
+/* movzx dst, word [rbx+rax*2] */
+void jit_load16_idx(jit_buf* b,int dst){
+    jit_rex(b,0,dst,0);
+    jit_8(b,0x0F);
+    jit_8(b,0xB7);
+    jit_modrm(b,0,dst,4);
+    jit_8(b,0x43);
+}
+
+/* mov word [rbx+rax*2], src */
+void jit_store16_idx(jit_buf* b,int src){
+    jit_8(b,0x66);
+    jit_rex(b,0,src,0);
+    jit_8(b,0x89);
+    jit_modrm(b,0,src,4);
+    jit_8(b,0x43);
+}
+
+void jit_call(jit_buf* b,void* fn){
+    static const uint8_t call_rax[]={0xFF,0xD0};
+    jit_8(b,0x48);
+    jit_8(b,0xB8);
+    jit_64(b,(uint64_t)(uintptr_t)fn);
+    jit_emit(b,call_rax,sizeof(call_rax));
+}
+
+/* returns the rel32 field to patch */
+uint8_t* jit_jcc(jit_buf* b,int cc){
+    jit_8(b,0x0F);
+    jit_8(b,0x80+cc);
+    jit_32(b,0);
+    return b->p-4;
+}
+
+uint8_t* jit_jmp(jit_buf* b){
+    jit_8(b,0xE9);
+    jit_32(b,0);
+    return b->p-4;
+}
+
+void jit_patch(jit_buf* b,uint8_t* rel,uint8_t* target){
+    if(!jit_overflow(b)){
+        int32_t off=(int32_t)(target-(rel+4));
+        memcpy(rel,&off,4);
+    }
+}
+
+/* cond_result=si */
+void jit_store_cond(jit_buf* b){
+    jit_store16(b,H_RSI,H_RBP,VM_FIELD(cond_result));
+}
+
+/* write every LC-3 register back to reg before calling out */
+void jit_spill(jit_buf* b){
+    static const uint8_t save_cond[]={0x89,0x74,0x24,SLOT_COND};   /* mov [rsp+SLOT_COND], esi */
+    for(int r=R_R0;r<=R_R7;++r){
+        jit_store16(b,H_REG(r),H_RBP,VM_REG(r));
+    }
+    jit_store_cond(b);
+    jit_emit(b,save_cond,sizeof(save_cond));
+}
+
+void jit_reload(jit_buf* b){
+    static const uint8_t load_cond[]={0x8B,0x74,0x24,SLOT_COND};   /* mov esi, [rsp+SLOT_COND] */
+    for(int r=R_R0;r<=R_R7;++r){
+        jit_load16(b,H_REG(r),H_RBP,VM_REG(r));
+    }
+    jit_emit(b,load_cond,sizeof(load_cond));
+}
+
+/* rax = instructions retired once count more have run */
+void jit_count(jit_buf* b,uint32_t count){
+    static const uint8_t load[]={0x48,0x8B,0x04,0x24};     /* mov rax, [rsp] */
+    jit_emit(b,load,sizeof(load));
+    jit_8(b,0x48);
+    jit_8(b,0x05);                                          /* add rax, imm32 */
+    jit_32(b,count);
+}
+
+/* leave with PC=pc after count instructions of this pass */
+void jit_exit(jit_buf* b,uint16_t pc,uint32_t count){
+    jit_store16_imm(b,VM_REG(R_PC),pc);
+    jit_count(b,count);
+    if(b->nexits<(int)(sizeof(b->exits)/sizeof(b->exits[0]))){
+        b->exits[b->nexits++]=jit_jmp(b);
+    }else{
+        b->p=b->end+1;
+    }
+}
+
+void jit_set_cond(jit_buf* b,int r){
+    jit_mov32_rr(b,H_RSI,r);
+}
+
+/* rdi = vm for a call out */
+void jit_vm_arg(jit_buf* b){
+    static const uint8_t mov[]={0x48,0x89,0xEF};           /* mov rdi, rbp */
+    jit_emit(b,mov,sizeof(mov));
+}
+
+/* a device read may have stopped the machine (a read watchpoint): then
+ * dst=eax, unless dst is -1, and leave with the instruction retired
+ * like a device store does */
+void jit_stop_check(jit_buf* b,int dst,uint16_t pc,uint32_t count){
+    static const uint8_t cmp[]={0x83,0xBD};                 /* cmp dword [rbp+stop], 0 */
+    jit_emit(b,cmp,sizeof(cmp));
+    jit_32(b,VM_FIELD(stop));
+    jit_8(b,0);
+    uint8_t* running=jit_jcc(b,CC_E);
+    if(dst>=0){
+        jit_mov32_rr(b,H_REG(dst),H_RAX);
+        jit_set_cond(b,H_REG(dst));
+    }
+    jit_exit(b,pc,count);
+    jit_patch(b,running,b->p);
+}
+
+/* eax = mem_read(vm,address), known at compile time */
+void jit_load_abs(jit_buf* b,uint16_t address){
+    if(b->device_page[address>>MEMORY_PAGE_SHIFT]){
+        static const uint8_t zext[]={0x0F,0xB7,0xC0};      /* movzx eax, ax */
+        jit_spill(b);
+        jit_vm_arg(b);
+        jit_8(b,0xBE);
+        jit_32(b,address);                                  /* mov esi, address */
+        jit_call(b,(void*)mem_read);
+        jit_emit(b,zext,sizeof(zext));
+        jit_reload(b);
+    }else{
+        jit_load16(b,H_RAX,H_RBX,address*2);
+    }
+}
+
+/* jump taken when eax points into a device page */
+uint8_t* jit_device_check(jit_buf* b){
+    static const uint8_t page[]={
+        0x89,0xC2,                  /* mov edx, eax */
+        0xC1,0xEA,MEMORY_PAGE_SHIFT,/* shr edx, MEMORY_PAGE_SHIFT */
+        0x80,0xBC,0x15,             /* cmp byte [rbp+rdx+device_page], 0 */
+    };
+    jit_emit(b,page,sizeof(page));
+    jit_32(b,VM_FIELD(device_page));
+    jit_8(b,0);
+    return jit_jcc(b,CC_NE);
+}
+
+/* eax = mem_read(vm,eax). a device read that stops the machine leaves
+ * with dst loaded, as the instruction retiring at pc after count */
+void jit_load_var(jit_buf* b,int dst,uint16_t pc,uint32_t count){
+    static const uint8_t slow[]={
+        0x48,0x89,0xEF,             /* mov rdi, rbp */
+        0x89,0xC6,                  /* mov esi, eax */
+    };
+    static const uint8_t zext[]={0x0F,0xB7,0xC0};          /* movzx eax, ax */
+    uint8_t* to_slow=jit_device_check(b);
+    jit_load16_idx(b,H_RAX);
+    uint8_t* to_done=jit_jmp(b);
+    jit_patch(b,to_slow,b->p);
+    jit_spill(b);
+    jit_emit(b,slow,sizeof(slow));
+    jit_call(b,(void*)mem_read);
+    jit_emit(b,zext,sizeof(zext));
+    jit_reload(b);
+    jit_stop_check(b,dst,pc,count);
+    jit_patch(b,to_done,b->p);
+}
+
+/* eax = reg[base]+offset, wrapped to 16 bits */
+void jit_address(jit_buf* b,int base,uint16_t offset){
+    jit_mov32_rr(b,H_RAX,H_REG(base));
+    jit_8(b,0x66);
+    jit_8(b,0x05);
+    jit_16(b,offset);                                       /* add ax, offset */
+}
+
+/* mem_write(vm,eax,src) for a device page, then leave the block */
+void jit_store_device(jit_buf* b,int src,const uop* u){
+    static const uint8_t args[]={
+        0x48,0x89,0xEF,             /* mov rdi, rbp */
+        0x89,0xC6,                  /* mov esi, eax */
+    };
+    jit_spill(b);
+    jit_mov32_rr(b,H_RDX,src);
+    jit_emit(b,args,sizeof(args));
+    jit_call(b,(void*)mem_write);
+    jit_reload(b);
+    jit_exit(b,u->next,u->count);
+}
+
+/* memory[eax]=src for a plain page, leaving the block if eax held cached code.
+ * the page is known at compile time, or is -1 when jit_device_check left it in edx */
+void jit_store_ram(jit_buf* b,int src,int page,const uop* u){
+    static const uint8_t dirty_abs[]={
+        0xC6,0x85,                  /* mov byte [rbp+dirty_page+page], 1 */
+    };
+    static const uint8_t dirty_var[]={
+        0xC6,0x84,0x15,             /* mov byte [rbp+rdx+dirty_page], 1 */
+    };
+    static const uint8_t check[]={
+        0x48,0x8B,0x95,             /* mov rdx, [rbp+code_words] */
+    };
+    static const uint8_t test[]={
+        0x80,0x3C,0x02,0x00,        /* cmp byte [rdx+rax], 0 */
+    };
+    static const uint8_t slow[]={
+        0x48,0x89,0xEF,             /* mov rdi, rbp */
+        0x89,0xC6,                  /* mov esi, eax */
+    };
+    jit_store16_idx(b,src);
+    if(page>=0){
+        jit_emit(b,dirty_abs,sizeof(dirty_abs));
+        jit_32(b,VM_FIELD(dirty_page)+page);
+    }else{
+        jit_emit(b,dirty_var,sizeof(dirty_var));
+        jit_32(b,VM_FIELD(dirty_page));
+    }
+    jit_8(b,1);
+    jit_emit(b,check,sizeof(check));
+    jit_32(b,VM_FIELD(code_words));
+    jit_emit(b,test,sizeof(test));
+    uint8_t* skip=jit_jcc(b,CC_E);
+    jit_spill(b);
+    jit_emit(b,slow,sizeof(slow));
+    jit_call(b,(void*)invalidate_code);
+    jit_reload(b);
+    jit_exit(b,u->next,u->count);
+    jit_patch(b,skip,b->p);
+}
+
+/* mem_write(vm,eax,src) */
+void jit_store_var(jit_buf* b,int src,const uop* u){
+    uint8_t* to_device=jit_device_check(b);
+    jit_store_ram(b,src,-1,u);
+    uint8_t* done=jit_jmp(b);
+    jit_patch(b,to_device,b->p);
+    jit_store_device(b,src,u);
+    jit_patch(b,done,b->p);
+}
+
+void jit_store_abs(jit_buf* b,int src,uint16_t address,const uop* u){
+    jit_mov32_ri(b,H_RAX,address);
+    if(b->device_page[address>>MEMORY_PAGE_SHIFT]){
+        jit_store_device(b,src,u);
+    }else{
+        jit_store_ram(b,src,address>>MEMORY_PAGE_SHIFT,u);
+    }
+}
+
+/* x86 condition for an LC-3 nzp mask after test si,si */
+int jit_nzp_cc(int nzp){
+    static const int cc[8]={-1,CC_G,CC_E,CC_NS,CC_S,CC_NE,CC_LE,-1};
+    return cc[nzp&7];
+}
+
+void jit_branch(jit_buf* b,block* blk,uint8_t* loop_top,int nzp,uint16_t target,const uop* u){
+    static const uint8_t test_si[]={0x66,0x85,0xF6};
+    uint8_t* taken=NULL;
+    if(nzp==0){
+        jit_exit(b,u->next,u->count);
+        return;
+    }
+    if(nzp!=7){
+        jit_emit(b,test_si,sizeof(test_si));
+        taken=jit_jcc(b,jit_nzp_cc(nzp));
+        jit_exit(b,u->next,u->count);
+        jit_patch(b,taken,b->p);
+    }
+    if(target==blk->start&&u->count==blk->len){
+        /* tight loop: stay native while the budget allows another pass */
+        static const uint8_t back[]={
+            0x48,0x8B,0x04,0x24,        /* mov rax, [rsp] */
+        };
+        static const uint8_t save[]={
+            0x48,0x89,0x04,0x24,        /* mov [rsp], rax */
+        };
+        static const uint8_t cmp[]={
+            0x48,0x3B,0x44,0x24,SLOT_BUDGET,    /* cmp rax, [rsp+SLOT_BUDGET] */
+        };
+        jit_emit(b,back,sizeof(back));
+        jit_8(b,0x48);
+        jit_8(b,0x05);
+        jit_32(b,blk->len);
+        jit_emit(b,save,sizeof(save));
+        jit_8(b,0x48);
+        jit_8(b,0x05);
+        jit_32(b,blk->len);
+        jit_emit(b,cmp,sizeof(cmp));
+        uint8_t* again=jit_jcc(b,0x6);          /* jbe */
+        jit_patch(b,again,loop_top);
+        jit_exit(b,target,0);
+    }else{
+        jit_exit(b,target,u->count);
+    }
+}
+
+void jit_alu_rr(jit_buf* b,uint8_t op,int dst,int src1,int src2){
+    if(dst==src2){
+        jit_op16_rr(b,op,H_REG(dst),H_REG(src1));
+    }else{
+        jit_mov32_rr(b,H_REG(dst),H_REG(src1));
+        jit_op16_rr(b,op,H_REG(dst),H_REG(src2));
+    }
+    jit_set_cond(b,H_REG(dst));
+}
+
+void jit_alu_ri(jit_buf* b,int ext,int dst,int src,uint16_t imm){
+    jit_mov32_rr(b,H_REG(dst),H_REG(src));
+    jit_op16_ri(b,ext,H_REG(dst),imm);
+    jit_set_cond(b,H_REG(dst));
+}
+
+int jit_trap(lc3_vm* vm,uint16_t vector){
+    return execute_trap(vm,vector,vm->in,vm->out);
+}
+
+/* the arena is never writable and executable at once. compiling
+ * opens the pages from the one holding jit_used to the end for
+ * writing, and jit_seal turns the used part back to read and execute
+ * before any of it runs. both happen between blocks. */
+uint8_t* jit_open(lc3_vm* vm){
+    size_t page=sysconf(_SC_PAGESIZE);
+    uint8_t* open=vm->jit_arena+vm->jit_used/page*page;
+    if(mprotect(open,vm->jit_arena+JIT_ARENA_SIZE-open,PROT_READ|PROT_WRITE)!=0){
+        return NULL;
+    }
+    return open;
+}
+
+int jit_seal(lc3_vm* vm,uint8_t* open){
+    size_t page=sysconf(_SC_PAGESIZE);
+    uint8_t* end=vm->jit_arena+(vm->jit_used+page-1)/page*page;
+    return end<=open||mprotect(open,end-open,PROT_READ|PROT_EXEC)==0;
+}
+
+void jit_compile(lc3_vm* vm,block* blk){
+    static const uint8_t prologue[]={
+        0x53,                           /* push rbx */
+        0x55,                           /* push rbp */
+        0x41,0x54,                      /* push r12 */
+        0x41,0x55,                      /* push r13 */
+        0x41,0x56,                      /* push r14 */
+        0x41,0x57,                      /* push r15 */
+        0x48,0x83,0xEC,FRAME_SIZE,      /* sub rsp, FRAME_SIZE */
+        0x48,0x89,0xFD,                 /* mov rbp, rdi */
+        0x48,0x89,0x74,0x24,SLOT_BUDGET,    /* mov [rsp+SLOT_BUDGET], rsi */
+        0x48,0xC7,0x04,0x24,0,0,0,0,    /* mov qword [rsp], 0 */
+        0x48,0x8B,0x9D,                 /* mov rbx, [rbp+memory] */
+    };
+    static const uint8_t save_count[]={
+        0x48,0x89,0x44,0x24,SLOT_COUNT, /* mov [rsp+SLOT_COUNT], rax */
+    };
+    static const uint8_t load_count[]={
+        0x48,0x8B,0x44,0x24,SLOT_COUNT, /* mov rax, [rsp+SLOT_COUNT] */
+    };
+    static const uint8_t epilogue[]={
+        0x48,0x83,0xC4,FRAME_SIZE,      /* add rsp, FRAME_SIZE */
+        0x41,0x5F,                      /* pop r15 */
+        0x41,0x5E,                      /* pop r14 */
+        0x41,0x5D,                      /* pop r13 */
+        0x41,0x5C,                      /* pop r12 */
+        0x5D,                           /* pop rbp */
+        0x5B,                           /* pop rbx */
+        0xC3,                           /* ret */
+    };
+    static const uint8_t trap_result[]={
+        0x89,0xC1,                      /* mov ecx, eax */
+    };
+    static const uint8_t trap_halt[]={
+        0x85,0xC9,                      /* test ecx, ecx */
+        0x75,0x03,                      /* jnz done */
+        0x48,0xF7,0xD8,                 /* neg rax */
+    };
+
+    if(!vm->jit_arena){
+        void* p=mmap(NULL,JIT_ARENA_SIZE,PROT_READ|PROT_WRITE,
+                     MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+        if(p==MAP_FAILED){
+            /* stay on the block interpreter */
+            vm->jit_disabled=1;
+            return;
+        }
+        vm->jit_arena=p;
+    }
+    uint8_t* open=jit_open(vm);
+    if(!open){
+        vm->jit_disabled=1;
+        return;
+    }
+
+    jit_buf buf={.start=vm->jit_arena+vm->jit_used,.p=vm->jit_arena+vm->jit_used,
+                 .end=vm->jit_arena+JIT_ARENA_SIZE,.nexits=0,.device_page=vm->device_page};
+    jit_buf* b=&buf;
+    uint8_t* no_store=NULL;
+
+    jit_emit(b,prologue,sizeof(prologue));
+    jit_32(b,VM_FIELD(memory));
+    for(int r=R_R0;r<=R_R7;++r){
+        jit_load16(b,H_REG(r),H_RBP,VM_REG(r));
+    }
+    jit_load16(b,H_RSI,H_RBP,VM_FIELD(cond_result));
+    uint8_t* loop_top=b->p;
+
+    for(uop* u=blk->uops;;++u){
+        int done=1;
+        switch(u->kind){
+            case UOP_ADD:
+                jit_alu_rr(b,0x01,u->a,u->b,u->c);
+                done=0;
+                break;
+            case UOP_ADD_IMM:
+                jit_alu_ri(b,0,u->a,u->b,u->imm);
+                done=0;
+                break;
+            case UOP_AND:
+                jit_alu_rr(b,0x21,u->a,u->b,u->c);
+                done=0;
+                break;
+            case UOP_AND_IMM:
+                jit_alu_ri(b,4,u->a,u->b,u->imm);
+                done=0;
+                break;
+            case UOP_NOT:
+                jit_mov32_rr(b,H_REG(u->a),H_REG(u->b));
+                jit_not16(b,H_REG(u->a));
+                jit_set_cond(b,H_REG(u->a));
+                done=0;
+                break;
+            case UOP_LD:
+                jit_load_abs(b,u->imm);
+                if(b->device_page[u->imm>>MEMORY_PAGE_SHIFT]){
+                    jit_stop_check(b,u->a,u->next,u->count);
+                }
+                jit_mov32_rr(b,H_REG(u->a),H_RAX);
+                jit_set_cond(b,H_REG(u->a));
+                done=0;
+                break;
+            case UOP_LDI:
+                jit_load_abs(b,u->imm);
+                jit_load_var(b,u->a,u->next,u->count);
+                if(b->device_page[u->imm>>MEMORY_PAGE_SHIFT]){
+                    /* the pointer read may have stopped it */
+                    jit_stop_check(b,u->a,u->next,u->count);
+                }
+                jit_mov32_rr(b,H_REG(u->a),H_RAX);
+                jit_set_cond(b,H_REG(u->a));
+                done=0;
+                break;
+            case UOP_LDR:
+            case UOP_LDR_ADD_IMM:
+                jit_address(b,u->b,u->imm);
+                if(u->kind==UOP_LDR_ADD_IMM){
+                    /* stop in front of the fused ADD */
+                    jit_load_var(b,u->a,u->next-1,u->count-1);
+                }else{
+                    jit_load_var(b,u->a,u->next,u->count);
+                }
+                jit_mov32_rr(b,H_REG(u->a),H_RAX);
+                jit_set_cond(b,H_REG(u->a));
+                if(u->kind==UOP_LDR_ADD_IMM){
+                    jit_alu_ri(b,0,u->d,u->e,u->imm2);
+                }
+                done=0;
+                break;
+            case UOP_LEA:
+            case UOP_CONST:
+                jit_mov32_ri(b,H_REG(u->a),u->imm);
+                jit_set_cond(b,H_REG(u->a));
+                done=0;
+                break;
+            case UOP_ST:
+                jit_store_abs(b,H_REG(u->a),u->imm,u);
+                done=0;
+                break;
+            case UOP_STI:
+                jit_load_abs(b,u->imm);
+                jit_store_var(b,H_REG(u->a),u);
+                if(b->device_page[u->imm>>MEMORY_PAGE_SHIFT]){
+                    jit_stop_check(b,-1,u->next,u->count);
+                }
+                done=0;
+                break;
+            case UOP_STR:
+                jit_address(b,u->b,u->imm);
+                jit_store_var(b,H_REG(u->a),u);
+                done=0;
+                break;
+            case UOP_BR:
+                jit_branch(b,blk,loop_top,u->a,u->imm,u);
+                break;
+            case UOP_ADD_IMM_BR:
+                jit_alu_ri(b,0,u->a,u->b,u->imm);
+                jit_branch(b,blk,loop_top,u->c,u->imm2,u);
+                break;
+            case UOP_JMP:
+                jit_store16(b,H_REG(u->a),H_RBP,VM_REG(R_PC));
+                jit_count(b,u->count);
+                b->exits[b->nexits++]=jit_jmp(b);
+                break;
+            case UOP_JSR:
+                jit_mov32_ri(b,H_REG(R_R7),u->next);
+                jit_exit(b,u->imm,u->count);
+                break;
+            case UOP_JSRR:
+                jit_store16(b,H_REG(u->a),H_RBP,VM_REG(R_PC));
+                jit_mov32_ri(b,H_REG(R_R7),u->next);
+                jit_count(b,u->count);
+                b->exits[b->nexits++]=jit_jmp(b);
+                break;
+            case UOP_TRAP:
+                /* the trap may change registers, so they are not stored again */
+                jit_store16_imm(b,VM_REG(R_PC),u->next);
+                jit_spill(b);
+                jit_vm_arg(b);
+                jit_8(b,0xBE);
+                jit_32(b,u->imm);                   /* mov esi, vector */
+                jit_call(b,(void*)jit_trap);
+                jit_emit(b,trap_result,sizeof(trap_result));
+                jit_count(b,u->count);
+                jit_emit(b,trap_halt,sizeof(trap_halt));
+                no_store=jit_jmp(b);
+                break;
+            case UOP_IDLE:
+                /* the wait may credit loop counters, so reload them */
+                jit_spill(b);
+                jit_vm_arg(b);
+                jit_8(b,0xBE);
+                jit_32(b,u->imm);                   /* mov esi, head */
+                jit_call(b,(void*)idle_wait);
+                jit_reload(b);
+                done=0;
+                break;
+            case UOP_EXIT:
+            default:
+                jit_exit(b,u->next,u->count);
+                break;
+        }
+        if(done){
+            break;
+        }
+    }
+
+    /* common epilogue, rax holds the instructions retired */
+    uint8_t* store=b->p;
+    jit_emit(b,save_count,sizeof(save_count));
+    for(int r=R_R0;r<=R_R7;++r){
+        jit_store16(b,H_REG(r),H_RBP,VM_REG(r));
+    }
+    jit_store_cond(b);
+    jit_emit(b,load_count,sizeof(load_count));
+    uint8_t* leave=b->p;
+    jit_emit(b,epilogue,sizeof(epilogue));
+
+    if(jit_overflow(b)){
+        vm->jit_full=1;
+        jit_seal(vm,open);
+        return;
+    }
+    for(int i=0;i<b->nexits;++i){
+        jit_patch(b,b->exits[i],store);
+    }
+    if(no_store){
+        jit_patch(b,no_store,leave);
+    }
+
+    vm->jit_used=b->p-vm->jit_arena;
+    if(!jit_seal(vm,open)){
+        /* code on those pages cannot run, drop all of it */
+        vm->jit_disabled=1;
+        vm->jit_full=1;
+        return;
+    }
+    blk->native=(jit_fn)(void*)buf.start;
+}
+
+/* only called between blocks, when no native code is running */
+void jit_flush(lc3_vm* vm){
+    for(int i=0;i<=UINT16_MAX;++i){
+        if(vm->blocks[i]){
+            vm->blocks[i]->native=NULL;
+            vm->blocks[i]->hits=0;
+        }
+    }
+    vm->jit_used=0;
+    vm->jit_full=0;
+}
+
+int run_jit(lc3_vm* vm,uint64_t budget){
+    int running=1;
+    while(running&&budget){
+        if(vm->retired_blocks||vm->code_modified){
+            free_retired_blocks(vm);
+        }
+        if(vm->jit_full){
+            jit_flush(vm);
+        }
+        uint16_t pc=vm->reg[R_PC];
+        block* b=vm->blocks[pc];
+        if(!b){
+            b=translate_block(vm,pc);
+        }
+        if(!b||b->len>budget){
+            running=read_and_execute_instruction(vm);
+            --budget;
+            continue;
+        }
+        if(!b->native&&!vm->jit_disabled&&jit_threshold&&++b->hits>=(uint32_t)jit_threshold){
+            jit_compile(vm,b);
+        }
+        if(b->native){
+            int64_t retired=b->native(vm,budget);
+            if(retired<0){
+                running=0;
+                retired=-retired;
+            }
+            budget-=retired;
+        }else{
+            uint64_t retired;
+            running=execute_block(vm,b,&retired);
+            budget-=retired;
+        }
+    }
+    vm->budget_left=budget;
+    return running;
+}
+#else
+int run_jit(lc3_vm* vm,uint64_t budget){
+    return run_blocks(vm,budget);
+}
+#endif
+
+int run_slice(lc3_vm* vm,uint64_t budget){
+    int running;
+    switch(vm->profile?-1:vm->trace?-2:vm->engine){
+        case -1:
+            running=run_profiled(vm,budget);
+            break;
+#ifdef HAVE_TRACE
+        case -2:
+            running=run_traced(vm,budget);
+            break;
+#endif
+        case ENGINE_THREADED:
+            running=run_threaded(vm,budget);
+            break;
+        case ENGINE_BLOCK:
+            running=run_blocks(vm,budget);
+            break;
+        case ENGINE_JIT:
+            running=run_jit(vm,budget);
+            break;
+        case ENGINE_SWITCH:
+        default:
+            running=run_switch(vm,budget);
+            break;
+    }
+    /* a machine that keeps running used all of its budget */
+    vm->icount+=running?budget:budget-vm->budget_left;
+    if(__builtin_expect(vm->stop,0)){
+        /* an engine stopped by OP_BREAK counted it as an instruction */
+        vm->icount-=!running;
+        if(vm->stop==STOP_HALT){
+            vm->stop=STOP_NONE;
+            return 0;
+        }
+        return 1;
+    }
+    return running;
+}
+
+int run_engine(lc3_vm* vm,uint64_t budget){
+#ifdef HAVE_SAMPLER
+    /* the ring holds about a minute of samples, so a sampled machine
+     * runs in slices and drains between them whoever is driving it */
+    if(__builtin_expect(sampler.vm==vm,0)){
+        int running;
+        do{
+            uint64_t slice=budget<SAMPLE_SLICE?budget:SAMPLE_SLICE;
+            running=run_slice(vm,slice);
+            budget-=slice;
+            sample_drain();
+        }while(running&&budget&&!vm->stop);
+        return running;
+    }
+#endif
+    return run_slice(vm,budget);
+}
+
+/* a recording needs the count at every input, so it runs one
+ * instruction at a time. the user types far slower than that. */
+int run_recorded(lc3_vm* vm,uint64_t max_instructions){
+    int running=1;
+    uint64_t start=vm->icount;
+    recording_vm=vm;
+    signal(SIGINT,handle_record_interrupt);
+    while(running&&(!max_instructions||vm->icount-start<max_instructions)){
+        running=run_engine(vm,1);
+    }
+    record_end(vm);
+    return running;
+}
+
+/* runs from event to event: the engines never see vm->icount move
+ * inside a run, so a byte becomes ready exactly at the run boundary
+ * that reaches its count */
+int run_replay(lc3_vm* vm){
+    replay_log* r=vm->replay;
+    int running=1;
+    while(running&&!r->done){
+        while(r->pos<r->count&&r->events[r->pos].icount<=vm->icount&&r->events[r->pos].value>=EVENT_IDLE){
+            replay_event* e=&r->events[r->pos++];
+            if(e->value==EVENT_END){
+                r->done=1;
+            }else{
+                r->idle_due=1;
+                r->idle_iterations=e->iterations;
+            }
+        }
+        uint64_t budget=REPLAY_CHUNK;
+        for(size_t i=r->pos;i<r->count;++i){
+            if(r->events[i].icount>vm->icount){
+                budget=r->events[i].icount-vm->icount;
+                break;
+            }
+        }
+        if(!r->done){
+            running=run_engine(vm,budget);
+        }
+    }
+    return running;
+}
+
+
+/** Machine Lifetime **/
+
+void page_release(struct snapshot_page* page);
+
+void lc3_vm_destroy(lc3_vm* vm){
+    if(!vm){
+        return;
+    }
+    if(vm->blocks){
+        for(int i=0;vm->block_count&&i<=UINT16_MAX;++i){
+            if(vm->blocks[i]){
+                free(vm->blocks[i]);
+                vm->block_count--;
+            }
+        }
+    }
+    free_retired_blocks(vm);
+    for(int p=0;p<MEMORY_PAGES;++p){
+        page_release(vm->snapshot_pages[p]);
+    }
+    free(vm->debug);
+    free(vm->output);
+#ifdef HAVE_TRACE
+    if(vm->trace){
+        lc3_trace_stop(vm);
+    }
+#endif
+    lc3_free(vm->memory,MEMORY_WORDS*sizeof(uint16_t));
+    lc3_free(vm->decoded,MEMORY_WORDS*sizeof(decoded_instr));
+    lc3_free(vm->blocks,MEMORY_WORDS*sizeof(block*));
+    lc3_free(vm->code_words,MEMORY_WORDS*sizeof(uint8_t));
+#ifdef HAVE_JIT
+    lc3_free(vm->jit_arena,JIT_ARENA_SIZE);
+#endif
+    free(vm);
+}
+
+/* hand reads and writes of a page to dev
+ * code translated for the old layout is dropped */
+void lc3_map_device(lc3_vm* vm,uint8_t page,lc3_device dev){
+    vm->device_page[page]=1;
+    vm->devices[page]=dev;
+    reset_code_caches(vm);
+}
+
+void lc3_unmap_device(lc3_vm* vm,uint8_t page){
+    vm->device_page[page]=0;
+    vm->devices[page]=(lc3_device){0};
+    reset_code_caches(vm);
+}
+
+lc3_vm* lc3_vm_create(){
+    lc3_vm* vm=calloc(1,sizeof(lc3_vm));
+    if(!vm){
+        return NULL;
+    }
+    vm->memory=lc3_alloc(MEMORY_WORDS*sizeof(uint16_t));
+    vm->decoded=lc3_alloc(MEMORY_WORDS*sizeof(decoded_instr));
+    vm->blocks=lc3_alloc(MEMORY_WORDS*sizeof(block*));
+    vm->code_words=lc3_alloc(MEMORY_WORDS*sizeof(uint8_t));
+    if(!vm->memory||!vm->decoded||!vm->blocks||!vm->code_words){
+        lc3_vm_destroy(vm);
+        return NULL;
+    }
+    vm->in=stdin;
+    vm->out=stdout;
+    vm->engine=DEFAULT_ENGINE;
+    vm->idle_iterations=IDLE_ITERATIONS;
+    vm->reg[R_PC]=PC_START;
+    /* nothing is translated yet, no caches to drop */
+    vm->device_page[MR_KBSR>>MEMORY_PAGE_SHIFT]=1;
+    vm->devices[MR_KBSR>>MEMORY_PAGE_SHIFT]=(lc3_device){keyboard_device_read,NULL,NULL};
+    return vm;
+}
+
+/** Snapshots **/
+
+/* a snapshot holds the registers and one pointer per memory page.
+ * pages are reference counted and shared between snapshots and the
+ * machines restored from them, a page is only copied once it has been
+ * stored to. zero pages are not kept at all. */
+typedef struct snapshot_page{
+    int refs;
+    uint16_t words[1<<MEMORY_PAGE_SHIFT];
+} snapshot_page;
+
+typedef struct lc3_snap{
+    uint16_t reg[R_COUNT];
+    uint16_t cond_result;
+    uint16_t psr;
+    uint16_t saved_ssp;
+    uint16_t saved_usp;
+    snapshot_page* pages[MEMORY_PAGES];
+} lc3_snap;
+
+void page_retain(snapshot_page* page){
+    if(page){
+        __atomic_add_fetch(&page->refs,1,__ATOMIC_RELAXED);
+    }
+}
+
+void page_release(snapshot_page* page){
+    if(page&&__atomic_sub_fetch(&page->refs,1,__ATOMIC_ACQ_REL)==0){
+        free(page);
+    }
+}
+
+void lc3_snap_free(lc3_snap* s){
+    if(!s){
+        return;
+    }
+    for(int p=0;p<MEMORY_PAGES;++p){
+        page_release(s->pages[p]);
+    }
+    free(s);
+}
+
+/* the cost is one page copy per page stored to since the last
+ * snapshot or restore. device pages change behind mem_write's back
+ * and are always copied. */
+lc3_snap* lc3_snapshot(lc3_vm* vm){
+    lc3_snap* s=malloc(sizeof(lc3_snap));
+    if(!s){
+        return NULL;
+    }
+    size_t page_size=sizeof(((snapshot_page*)0)->words);
+    for(int p=0;p<MEMORY_PAGES;++p){
+        const uint16_t* words=vm->memory+(p<<MEMORY_PAGE_SHIFT);
+        snapshot_page* old=vm->snapshot_pages[p];
+        if((vm->dirty_page[p]||vm->device_page[p])&&
+           !(old?memcmp(old->words,words,page_size)==0:bytes_zero((const char*)words,page_size))){
+            snapshot_page* page=malloc(sizeof(snapshot_page));
+            if(!page){
+                for(int k=0;k<p;++k){
+                    page_release(s->pages[k]);
+                }
+                free(s);
+                return NULL;
+            }
+            page->refs=1;
+            memcpy(page->words,words,page_size);
+            page_release(old);
+            vm->snapshot_pages[p]=page;
+        }
+        vm->dirty_page[p]=0;
+        s->pages[p]=vm->snapshot_pages[p];
+        page_retain(s->pages[p]);
+    }
+    memcpy(s->reg,vm->reg,sizeof(s->reg));
+    s->cond_result=vm->cond_result;
+    s->psr=vm->psr;
+    s->saved_ssp=vm->saved_ssp;
+    s->saved_usp=vm->saved_usp;
+    return s;
+}
+
+/* put vm back to s, only pages that differ are copied */
+void lc3_restore(lc3_vm* vm,const lc3_snap* s){
+    size_t page_size=sizeof(((snapshot_page*)0)->words);
+    for(int p=0;p<MEMORY_PAGES;++p){
+        if(vm->snapshot_pages[p]==s->pages[p]&&!vm->dirty_page[p]&&!vm->device_page[p]){
+            continue;
+        }
+        uint16_t* words=vm->memory+(p<<MEMORY_PAGE_SHIFT);
+        if(s->pages[p]){
+            memcpy(words,s->pages[p]->words,page_size);
+        }else{
+            memset(words,0,page_size);
+        }
+        for(int i=0;i<1<<MEMORY_PAGE_SHIFT;++i){
+            invalidate_code(vm,(p<<MEMORY_PAGE_SHIFT)+i);
+        }
+        page_retain(s->pages[p]);
+        page_release(vm->snapshot_pages[p]);
+        vm->snapshot_pages[p]=s->pages[p];
+        vm->dirty_page[p]=0;
+    }
+    memcpy(vm->reg,s->reg,sizeof(vm->reg));
+    vm->cond_result=s->cond_result;
+    vm->psr=s->psr;
+    vm->saved_ssp=s->saved_ssp;
+    vm->saved_usp=s->saved_usp;
+}
+
+void debug_fork_devices(lc3_vm* vm,lc3_vm* child);
+
+/* a new machine in the same state, sharing every page until either
+ * side stores to it. breakpoints and watches stay with vm */
+lc3_vm* lc3_fork(lc3_vm* vm){
+    output_flush(vm);
+    lc3_snap* s=lc3_snapshot(vm);
+    lc3_vm* child=s?lc3_vm_create():NULL;
+    if(child){
+        child->in=vm->in;
+        child->out=vm->out;
+        child->engine=vm->engine;
+        child->idle_policy=vm->idle_policy;
+        child->idle_iterations=vm->idle_iterations;
+        child->output_policy=vm->output_policy;
+        child->jit_disabled=vm->jit_disabled;
+        child->os=vm->os;
+        child->hle=vm->hle;
+        memcpy(child->os_vectors,vm->os_vectors,sizeof(child->os_vectors));
+        memcpy(child->device_page,vm->device_page,sizeof(child->device_page));
+        memcpy(child->devices,vm->devices,sizeof(child->devices));
+        debug_fork_devices(vm,child);
+        lc3_restore(child,s);
+    }
+    lc3_snap_free(s);
+    return child;
+}
+
+/** Debugger **/
+
+/* breakpoints patch the decoded stream: decode_instr turns a marked
+ * word into OP_BREAK, which each engine treats as one more opcode, so
+ * nothing is checked per instruction. a watched word maps its page as
+ * a device, so only loads and stores to that page leave the fast path.
+ * a watch hit stops the machine with stop_at_next_fetch. */
+
+enum{
+    DEBUG_BREAK=1,
+    DEBUG_WATCH_READ=2,
+    DEBUG_WATCH_WRITE=4,
+    DEBUG_WATCH=DEBUG_WATCH_READ|DEBUG_WATCH_WRITE
+};
+
+enum{ DEBUG_SLICE=1<<20 };     /* instructions between looks at SIGINT */
+
+typedef struct lc3_debugger{
+    uint8_t flags[MEMORY_WORDS];
+    uint16_t watched[MEMORY_PAGES];     /* watched words on each page */
+    lc3_device inner[MEMORY_PAGES];     /* the device a watch displaced */
+    uint8_t inner_mapped[MEMORY_PAGES];
+    uint16_t hit_address;               /* the access behind STOP_WATCH */
+    uint16_t hit_value;
+    int hit_write;
+} lc3_debugger;
+
+void debug_decode(lc3_vm* vm,uint16_t address,decoded_instr* d){
+    if(vm->debug->flags[address]&DEBUG_BREAK){
+        d->op=OP_BREAK;
+    }
+}
+
+void watch_hit(lc3_vm* vm,uint16_t address,uint16_t value,int write){
+    lc3_debugger* dbg=vm->debug;
+    if(vm->stop){
+        return;
+    }
+    dbg->hit_address=address;
+    dbg->hit_value=value;
+    dbg->hit_write=write;
+    stop_at_next_fetch(vm,STOP_WATCH);
+}
+
+/* a machine without the debugger, such as a fork, sees plain memory */
+uint16_t watch_device_read(lc3_vm* vm,void* ctx,uint16_t address){
+    lc3_debugger* dbg=vm->debug;
+    if(!dbg){
+        return vm->memory[address];
+    }
+    lc3_device* inner=&dbg->inner[address>>MEMORY_PAGE_SHIFT];
+    uint16_t value=inner->read?inner->read(vm,inner->ctx,address):vm->memory[address];
+    if(dbg->flags[address]&DEBUG_WATCH_READ){
+        watch_hit(vm,address,value,0);
+    }
+    return value;
+}
+
+void watch_device_write(lc3_vm* vm,void* ctx,uint16_t address,uint16_t val){
+    lc3_debugger* dbg=vm->debug;
+    if(!dbg){
+        vm->memory[address]=val;
+        return;
+    }
+    lc3_device* inner=&dbg->inner[address>>MEMORY_PAGE_SHIFT];
+    if(inner->write){
+        inner->write(vm,inner->ctx,address,val);
+    }else{
+        vm->memory[address]=val;
+    }
+    if(dbg->flags[address]&DEBUG_WATCH_WRITE){
+        watch_hit(vm,address,val,1);
+    }
+}
+
+/* give child the devices of vm with the watches taken off */
+void debug_fork_devices(lc3_vm* vm,lc3_vm* child){
+    lc3_debugger* dbg=vm->debug;
+    for(int page=0;dbg&&page<MEMORY_PAGES;++page){
+        if(dbg->watched[page]){
+            child->device_page[page]=dbg->inner_mapped[page];
+            child->devices[page]=dbg->inner_mapped[page]?dbg->inner[page]:(lc3_device){0};
+        }
+    }
+}
+
+/* returns 0 if the debugger cannot be allocated */
+int lc3_debug_attach(lc3_vm* vm){
+    if(!vm->debug){
+        vm->debug=calloc(1,sizeof(lc3_debugger));
+        reset_code_caches(vm);
+    }
+    return vm->debug!=NULL;
+}
+
+void lc3_debug_detach(lc3_vm* vm){
+    lc3_debugger* dbg=vm->debug;
+    if(!dbg){
+        return;
+    }
+    for(int page=0;page<MEMORY_PAGES;++page){
+        if(dbg->watched[page]&&dbg->inner_mapped[page]){
+            lc3_map_device(vm,page,dbg->inner[page]);
+        }else if(dbg->watched[page]){
+            lc3_unmap_device(vm,page);
+        }
+    }
+    free(dbg);
+    vm->debug=NULL;
+    vm->stop=STOP_NONE;
+    reset_code_caches(vm);
+}
+
+void lc3_break(lc3_vm* vm,uint16_t address,int on){
+    lc3_debugger* dbg=vm->debug;
+    dbg->flags[address]=on?dbg->flags[address]|DEBUG_BREAK:dbg->flags[address]&~DEBUG_BREAK;
+    invalidate_code(vm,address);
+}
+
+/* kinds is DEBUG_WATCH_READ and/or DEBUG_WATCH_WRITE, 0 to stop watching */
+void lc3_watch(lc3_vm* vm,uint16_t address,int kinds){
+    lc3_debugger* dbg=vm->debug;
+    uint8_t page=address>>MEMORY_PAGE_SHIFT;
+    int was=(dbg->flags[address]&DEBUG_WATCH)!=0;
+    dbg->flags[address]=(dbg->flags[address]&~DEBUG_WATCH)|(kinds&DEBUG_WATCH);
+    if(!was&&kinds&&dbg->watched[page]++==0){
+        dbg->inner_mapped[page]=vm->device_page[page];
+        dbg->inner[page]=vm->devices[page];
+        lc3_map_device(vm,page,(lc3_device){watch_device_read,watch_device_write,NULL});
+    }else if(was&&!kinds&&--dbg->watched[page]==0){
+        if(dbg->inner_mapped[page]){
+            lc3_map_device(vm,page,dbg->inner[page]);
+        }else{
+            lc3_unmap_device(vm,page);
+        }
+    }
+}
+
+/* runs on from a stop, first stepping over a breakpoint under the pc */
+int lc3_continue(lc3_vm* vm,uint64_t budget){
+    uint16_t pc=vm->reg[R_PC];
+    int running=1;
+    vm->stop=STOP_NONE;
+    if(budget&&vm->debug->flags[pc]&DEBUG_BREAK){
+        lc3_break(vm,pc,0);
+        running=run_engine(vm,1);
+        lc3_break(vm,pc,1);
+        --budget;
+    }
+    if(running&&budget&&!vm->stop){
+        running=run_engine(vm,budget);
+    }
+    return running;
+}
+
+/* an interactive prompt on stdin and stdout, between runs of the
+ * program on the same terminal */
+volatile sig_atomic_t debug_interrupted;
+
+void handle_debug_interrupt(int signal){
+    debug_interrupted=1;
+}
+
+/* x3000, #12288, or a label */
+int debug_address(const symbol_table* symbols,const char* token,uint16_t* address){
+    int32_t v;
+    if(asm_number(token,&v)){
+        *address=(uint16_t)v;
+        return 1;
+    }
+    for(size_t i=0;i<symbols->count;++i){
+        if(strcmp(symbols->symbols[i].name,token)==0){
+            *address=symbols->symbols[i].address;
+            return 1;
+        }
+    }
+    printf("no label %s\n",token);
+    return 0;
+}
+
+void debug_where(lc3_vm* vm,const symbol_table* symbols){
+    uint16_t pc=vm->reg[R_PC];
+    const lc3_symbol* near=NULL;
+    char name[16];
+    format_instr(name,sizeof(name),vm->memory[pc]);
+    for(size_t i=0;i<symbols->count&&symbols->symbols[i].address<=pc;++i){
+        near=&symbols->symbols[i];
+    }
+    if(!near){
+        printf("x%04X  %s\n",pc,name);
+    }else if(near->address==pc){
+        printf("x%04X %s  %s\n",pc,near->name,name);
+    }else{
+        printf("x%04X %s+%d  %s\n",pc,near->name,pc-near->address,name);
+    }
+}
+
+void debug_registers(lc3_vm* vm){
+    for(int r=0;r<8;++r){
+        printf("R%d x%04X%s",r,vm->reg[r],r==3?"\n":"  ");
+    }
+    int flags=cond_flags(vm);
+    printf("\nPC x%04X  %s  icount %llu\n",vm->reg[R_PC],
+           flags&FL_NEG?"n":flags&FL_ZRO?"z":"p",(unsigned long long)vm->icount);
+}
+
+const char* debug_help=
+    "break|b addr, delete|d addr, watch addr, rwatch addr, awatch addr,\n"
+    "unwatch addr, continue|c, step|s [n], regs|r, x addr [n], quit|q\n"
+    "addresses are x3000, #12288 or labels\n";
+
+/* returns once the program halts or the user quits */
+int run_debugger(lc3_vm* vm,const symbol_table* symbols){
+    char line[256];
+    int running=1;
+    if(!lc3_debug_attach(vm)){
+        printf("failed to allocate the debugger\n");
+        return 1;
+    }
+    signal(SIGINT,handle_debug_interrupt);
+    debug_where(vm,symbols);
+    for(;;){
+        printf("(lc3) ");
+        fflush(stdout);
+        if(!fgets(line,sizeof(line),stdin)){
+            break;
+        }
+        char* args[ASM_TOKENS];
+        int n=asm_tokenize(line,args);
+        uint16_t address;
+        if(!n){
+            continue;
+        }
+        const char* cmd=args[0];
+        int have=n>1&&debug_address(symbols,args[1],&address);
+        if(strcmp(cmd,"q")==0||strcmp(cmd,"quit")==0){
+            break;
+        }else if(strcmp(cmd,"b")==0||strcmp(cmd,"break")==0){
+            if(have){
+                lc3_break(vm,address,1);
+            }
+        }else if(strcmp(cmd,"d")==0||strcmp(cmd,"delete")==0){
+            if(have){
+                lc3_break(vm,address,0);
+            }
+        }else if(strcmp(cmd,"watch")==0||strcmp(cmd,"rwatch")==0||strcmp(cmd,"awatch")==0||strcmp(cmd,"unwatch")==0){
+            if(have){
+                lc3_watch(vm,address,cmd[0]=='w'?DEBUG_WATCH_WRITE:cmd[0]=='r'?DEBUG_WATCH_READ:
+                          cmd[0]=='a'?DEBUG_WATCH:0);
+            }
+        }else if(strcmp(cmd,"r")==0||strcmp(cmd,"regs")==0){
+            debug_registers(vm);
+        }else if(strcmp(cmd,"x")==0){
+            int32_t count=8;
+            if(have&&n>2&&!asm_number(args[2],&count)){
+                count=8;
+            }
+            for(int32_t i=0;have&&i<count;++i){
+                uint16_t a=address+i;
+                char name[16];
+                format_instr(name,sizeof(name),vm->memory[a]);
+                printf("x%04X x%04X %-9s",a,vm->memory[a],name);
+                if(vm->memory[a]>=' '&&vm->memory[a]<0x7f){
+                    printf(" '%c'",vm->memory[a]);
+                }
+                printf("\n");
+            }
+        }else if(strcmp(cmd,"c")==0||strcmp(cmd,"continue")==0||strcmp(cmd,"s")==0||strcmp(cmd,"step")==0){
+            int32_t steps=1;
+            int step=cmd[0]=='s';
+            if(step&&n>1&&!asm_number(args[1],&steps)){
+                steps=1;
+            }
+            if(!running){
+                printf("the program has halted\n");
+                continue;
+            }
+            disable_input_buffering();
+            debug_interrupted=0;
+            running=lc3_continue(vm,step?(uint64_t)steps:DEBUG_SLICE);
+            while(!step&&running&&!vm->stop&&!debug_interrupted){
+                running=run_engine(vm,DEBUG_SLICE);
+            }
+            output_flush(vm);
+            restore_input_buffering();
+            if(!running){
+                printf("\nhalted after %llu instructions\n",(unsigned long long)vm->icount);
+                continue;
+            }
+            if(vm->stop==STOP_WATCH){
+                lc3_debugger* dbg=vm->debug;
+                printf("\nwatch: %s x%04X = x%04X\n",dbg->hit_write?"write":"read",dbg->hit_address,dbg->hit_value);
+            }else if(vm->stop==STOP_BREAK){
+                printf("\nbreakpoint\n");
+            }else if(debug_interrupted){
+                vm->stop=STOP_INTERRUPT;
+                printf("\ninterrupted\n");
+            }
+            debug_where(vm,symbols);
+        }else{
+            printf("%s",debug_help);
+        }
+    }
+    signal(SIGINT,SIG_DFL);
+    return 0;
+}
+
+/** GDB Stub **/
+
+/* a gdb remote serial protocol server on a localhost socket. a thread
+ * frames packets and hands each one to the machine's thread, which
+ * answers between runs, so registers and memory only change at
+ * instruction boundaries and the engines carry no extra checks.
+ * gdb has no LC-3 target: registers go out as R0-R7, PC and PSR, each
+ * 16 bits little endian, and memory is byte addressed with word w at
+ * bytes 2w and 2w+1. */
+
+#ifndef _WIN32
+#define HAVE_GDB 1
+#endif
+
+#ifdef HAVE_GDB
+
+enum{
+    GDB_PACKET=4096,        /* largest packet either way */
+    GDB_SLICE=1<<16,        /* instructions between looks for ^C */
+    GDB_REGS=10
+};
+
+typedef struct{
+    int fd;
+    char in[GDB_PACKET];
+    size_t in_len,in_pos;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int wake[2];                /* the reply is ready, for the socket thread */
+    char request[GDB_PACKET];
+    int has_request;
+    char reply[GDB_PACKET];
+    atomic_int interrupt;       /* ^C from gdb while the machine runs */
+} gdb_stub;
+
+int hex_value(int c){
+    return c>='0'&&c<='9'?c-'0':c>='a'&&c<='f'?c-'a'+10:c>='A'&&c<='F'?c-'A'+10:-1;
+}
+
+/* the next byte from gdb, -1 once it hangs up */
+int gdb_getc(gdb_stub* g){
+    if(g->in_pos==g->in_len){
+        ssize_t n=read(g->fd,g->in,sizeof(g->in));
+        if(n<=0){
+            return -1;
+        }
+        g->in_len=n;
+        g->in_pos=0;
+    }
+    return (unsigned char)g->in[g->in_pos++];
+}
+
+void gdb_write(int fd,const char* data,size_t size){
+    while(size){
+        /* gdb may be gone, that is not worth a SIGPIPE */
+        ssize_t n=send(fd,data,size,MSG_NOSIGNAL);
+        if(n<0&&errno==EINTR){
+            continue;
+        }
+        if(n<=0){
+            return;
+        }
+        data+=n;
+        size-=n;
+    }
+}
+
+void gdb_send(int fd,const char* payload){
+    char packet[GDB_PACKET+4];
+    uint8_t sum=0;
+    for(const char* p=payload;*p;++p){
+        sum+=(uint8_t)*p;
+    }
+    int n=snprintf(packet,sizeof(packet),"$%s#%02x",payload,sum);
+    gdb_write(fd,packet,n);
+}
+
+/* the next packet, acknowledged, 0 once gdb hangs up. a ^C outside
+ * a packet comes back as the one byte packet "\x03" */
+int gdb_read_packet(gdb_stub* g,char* out){
+    for(;;){
+        int c=gdb_getc(g);
+        if(c<0){
+            return 0;
+        }
+        if(c==0x03){
+            out[0]=0x03;
+            out[1]=0;
+            return 1;
+        }
+        if(c!='$'){
+            /* an ack of ours */
+            continue;
+        }
+        size_t n=0;
+        uint8_t sum=0;
+        while((c=gdb_getc(g))>=0&&c!='#'){
+            if(n<GDB_PACKET-1){
+                out[n++]=c;
+            }
+            sum+=c;
+        }
+        int hi=gdb_getc(g),lo=gdb_getc(g);
+        if(lo<0){
+            return 0;
+        }
+        out[n]=0;
+        if((hex_value(hi)<<4|hex_value(lo))!=sum){
+            gdb_write(g->fd,"-",1);
+            continue;
+        }
+        gdb_write(g->fd,"+",1);
+        return 1;
+    }
+}
+
+void* gdb_socket_thread(void* arg){
+    gdb_stub* g=arg;
+    char packet[GDB_PACKET];
+    for(;;){
+        int open=gdb_read_packet(g,packet);
+        if(open&&packet[0]==0x03){
+            /* the machine is already stopped */
+            continue;
+        }
+        pthread_mutex_lock(&g->lock);
+        strcpy(g->request,open?packet:"k");
+        g->has_request=1;
+        pthread_cond_signal(&g->cond);
+        pthread_mutex_unlock(&g->lock);
+        if(!open){
+            return NULL;
+        }
+
+        /* a continue can take a while, gdb may send ^C meanwhile */
+        struct pollfd fds[2]={{g->fd,POLLIN,0},{g->wake[0],POLLIN,0}};
+        while(!fds[1].revents){
+            if(g->in_pos==g->in_len&&poll(fds,2,-1)<0){
+                continue;
+            }
+            if(g->in_pos<g->in_len||fds[0].revents){
+                int c=gdb_getc(g);
+                if(c==0x03||c<0){
+                    atomic_store(&g->interrupt,1);
+                }
+                if(c<0){
+                    fds[0].fd=-1;
+                }
+                fds[0].revents=0;
+            }
+        }
+        char b;
+        if(read(g->wake[0],&b,1)!=1||packet[0]=='k'){
+            return NULL;
+        }
+        pthread_mutex_lock(&g->lock);
+        gdb_send(g->fd,g->reply);
+        pthread_mutex_unlock(&g->lock);
+        if(packet[0]=='D'){
+            return NULL;
+        }
+    }
+}
+
+/* 16 bits, little endian, as four hex digits */
+char* gdb_put_word(char* out,uint16_t value){
+    sprintf(out,"%02x%02x",value&0xFF,value>>8);
+    return out+4;
+}
+
+int gdb_get_word(const char* in,uint16_t* value){
+    int d[4];
+    for(int i=0;i<4;++i){
+        if((d[i]=hex_value(in[i]))<0){
+            return 0;
+        }
+    }
+    *value=(d[0]<<4|d[1])|(d[2]<<4|d[3])<<8;
+    return 1;
+}
+
+uint16_t* gdb_register(lc3_vm* vm,unsigned r,uint16_t* psr){
+    *psr=cond_flags(vm);
+    return r<8?&vm->reg[r]:r==8?&vm->reg[R_PC]:psr;
+}
+
+void gdb_set_register(lc3_vm* vm,unsigned r,uint16_t value){
+    if(r<8){
+        vm->reg[r]=value;
+    }else if(r==8){
+        vm->reg[R_PC]=value;
+    }else{
+        set_cond_flags(vm,value&(FL_NEG|FL_ZRO|FL_POS));
+    }
+}
+
+/* byte addresses in gdb, words in the machine */
+uint8_t gdb_peek(lc3_vm* vm,uint32_t address){
+    uint16_t word=vm->memory[(address>>1)&0xFFFF];
+    return address&1?word>>8:word&0xFF;
+}
+
+void gdb_poke(lc3_vm* vm,uint32_t address,uint8_t value){
+    uint16_t a=(address>>1)&0xFFFF;
+    uint16_t word=address&1?(vm->memory[a]&0x00FF)|value<<8:(vm->memory[a]&0xFF00)|value;
+    mem_write(vm,a,word);
+}
+
+void gdb_stop_reply(lc3_vm* vm,int running,char* reply){
+    lc3_debugger* dbg=vm->debug;
+    if(!running){
+        strcpy(reply,"W00");
+    }else if(vm->stop==STOP_WATCH){
+        int kind=dbg->flags[dbg->hit_address]&DEBUG_WATCH;
+        sprintf(reply,"T05%s:%x;",kind==DEBUG_WATCH?"awatch":dbg->hit_write?"watch":"rwatch",dbg->hit_address*2);
+    }else if(vm->stop==STOP_INTERRUPT){
+        strcpy(reply,"S02");
+    }else{
+        strcpy(reply,"S05");
+    }
+}
+
+/* answers one packet. a continue or step runs the machine first.
+ * returns 0 once the session is over */
+int gdb_handle(gdb_stub* g,lc3_vm* vm,const char* p,char* reply,int* running){
+    unsigned long address=0,length=0;
+    unsigned r,kind;
+    uint16_t psr,value;
+    char* out=reply;
+    *reply=0;
+    switch(p[0]){
+        case '?':
+            gdb_stop_reply(vm,*running,reply);
+            break;
+        case 'g':
+            for(r=0;r<GDB_REGS;++r){
+                out=gdb_put_word(out,*gdb_register(vm,r,&psr));
+            }
+            break;
+        case 'G':
+            for(r=0;r<GDB_REGS&&gdb_get_word(p+1+4*r,&value);++r){
+                gdb_set_register(vm,r,value);
+            }
+            strcpy(reply,"OK");
+            break;
+        case 'p':
+            if(sscanf(p+1,"%x",&r)==1&&r<GDB_REGS){
+                gdb_put_word(reply,*gdb_register(vm,r,&psr));
+            }else{
+                strcpy(reply,"E01");
+            }
+            break;
+        case 'P':
+            if(sscanf(p+1,"%x",&r)==1&&r<GDB_REGS&&strchr(p,'=')&&gdb_get_word(strchr(p,'=')+1,&value)){
+                gdb_set_register(vm,r,value);
+                strcpy(reply,"OK");
+            }else{
+                strcpy(reply,"E01");
+            }
+            break;
+        case 'm':
+            if(sscanf(p+1,"%lx,%lx",&address,&length)!=2||length>GDB_PACKET/2-1){
+                strcpy(reply,"E01");
+                break;
+            }
+            for(unsigned long i=0;i<length;++i){
+                out+=sprintf(out,"%02x",gdb_peek(vm,address+i));
+            }
+            break;
+        case 'M':{
+            const char* data=strchr(p,':');
+            if(sscanf(p+1,"%lx,%lx",&address,&length)!=2||!data||strlen(data+1)<2*length){
+                strcpy(reply,"E01");
+                break;
+            }
+            for(unsigned long i=0;i<length;++i){
+                gdb_poke(vm,address+i,hex_value(data[1+2*i])<<4|hex_value(data[2+2*i]));
+            }
+            strcpy(reply,"OK");
+            break;
+        }
+        case 'c':
+        case 's':
+            if(sscanf(p+1,"%lx",&address)==1){
+                vm->reg[R_PC]=address>>1;
+            }
+            if(*running){
+                atomic_store(&g->interrupt,0);
+                *running=lc3_continue(vm,p[0]=='s'?1:GDB_SLICE);
+                while(p[0]=='c'&&*running&&!vm->stop&&!atomic_load(&g->interrupt)){
+                    *running=run_engine(vm,GDB_SLICE);
+                }
+                if(*running&&!vm->stop&&p[0]=='c'){
+                    vm->stop=STOP_INTERRUPT;
+                }
+                output_flush(vm);
+            }
+            gdb_stop_reply(vm,*running,reply);
+            break;
+        case 'Z':
+        case 'z':
+            if(sscanf(p+1,"%u,%lx,%lx",&kind,&address,&length)!=3||kind>4){
+                break;
+            }
+            for(unsigned long a=address>>1;a<=(address+(length?length:1)-1)>>1&&a<MEMORY_WORDS;++a){
+                if(kind<2){
+                    lc3_break(vm,a,p[0]=='Z');
+                }else{
+                    /* Z2 writes, Z3 reads, Z4 both */
+                    int bits=kind==2?DEBUG_WATCH_WRITE:kind==3?DEBUG_WATCH_READ:DEBUG_WATCH;
+                    int now=vm->debug->flags[a]&DEBUG_WATCH;
+                    lc3_watch(vm,a,p[0]=='Z'?now|bits:now&~bits);
+                }
+            }
+            strcpy(reply,"OK");
+            break;
+        case 'H':
+            strcpy(reply,"OK");
+            break;
+        case 'q':
+            if(strncmp(p,"qSupported",10)==0){
+                sprintf(reply,"PacketSize=%x",GDB_PACKET);
+            }else if(strcmp(p,"qAttached")==0){
+                strcpy(reply,"1");
+            }
+            break;
+        case 'D':
+            strcpy(reply,"OK");
+            return 0;
+        case 'k':
+            *running=0;
+            return 0;
+    }
+    return 1;
+}
+
+/* waits for one gdb to connect to a TCP port on localhost, or to a
+ * unix socket at a path. returns the connection or -1 */
+int gdb_accept(const char* where){
+    char* end;
+    long port=strtol(where,&end,10);
+    int tcp=*where&&!*end;
+    int server=socket(tcp?AF_INET:AF_UNIX,SOCK_STREAM,0);
+    if(server<0){
+        return -1;
+    }
+    int bound;
+    if(tcp){
+        struct sockaddr_in addr={0};
+        int on=1;
+        setsockopt(server,SOL_SOCKET,SO_REUSEADDR,&on,sizeof(on));
+        addr.sin_family=AF_INET;
+        addr.sin_port=htons((uint16_t)port);
+        addr.sin_addr.s_addr=htonl(INADDR_LOOPBACK);
+        bound=bind(server,(struct sockaddr*)&addr,sizeof(addr))==0;
+    }else{
+        struct sockaddr_un addr={0};
+        addr.sun_family=AF_UNIX;
+        snprintf(addr.sun_path,sizeof(addr.sun_path),"%s",where);
+        unlink(where);
+        bound=bind(server,(struct sockaddr*)&addr,sizeof(addr))==0;
+    }
+    int fd=-1;
+    if(bound&&listen(server,1)==0){
+        fprintf(stderr,"waiting for gdb on %s%s\n",tcp?"localhost:":"",where);
+        fd=accept(server,NULL,NULL);
+    }
+    close(server);
+    if(!tcp){
+        unlink(where);
+    }
+    return fd;
+}
+
+/* serves gdb on fd until it kills or detaches, then closes fd.
+ * returns whether the machine is still running */
+int run_gdb(lc3_vm* vm,int fd){
+    gdb_stub* g=calloc(1,sizeof(gdb_stub));
+    int running=1;
+    if(!g||!lc3_debug_attach(vm)||pipe(g->wake)!=0){
+        printf("failed to start the gdb stub\n");
+        free(g);
+        close(fd);
+        return running;
+    }
+    g->fd=fd;
+    pthread_mutex_init(&g->lock,NULL);
+    pthread_cond_init(&g->cond,NULL);
+    int serving=pthread_create(&g->thread,NULL,gdb_socket_thread,g)==0;
+    if(!serving){
+        printf("failed to start the gdb stub\n");
+    }
+    char packet[GDB_PACKET],reply[GDB_PACKET];
+    int started=serving;
+    while(serving){
+        pthread_mutex_lock(&g->lock);
+        while(!g->has_request){
+            pthread_cond_wait(&g->cond,&g->lock);
+        }
+        strcpy(packet,g->request);
+        g->has_request=0;
+        pthread_mutex_unlock(&g->lock);
+
+        serving=gdb_handle(g,vm,packet,reply,&running);
+        pthread_mutex_lock(&g->lock);
+        strcpy(g->reply,reply);
+        pthread_mutex_unlock(&g->lock);
+        if(write(g->wake[1],"",1)!=1){
+            break;
+        }
+    }
+    if(started){
+        pthread_join(g->thread,NULL);
+    }
+    close(g->wake[0]);
+    close(g->wake[1]);
+    close(fd);
+    pthread_mutex_destroy(&g->lock);
+    pthread_cond_destroy(&g->cond);
+    free(g);
+    lc3_debug_detach(vm);
+    return running;
+}
+
+#endif
+
+/** Lockstep Lanes **/
+
+/* many machines running the same image, stepped together. registers
+ * are kept lane-major, so one decoded instruction runs as a single
+ * vector op over every lane that sits at the same PC. loads, stores
+ * and traps still go lane by lane against each lane's own memory.
+ * the lanes stepped next are always those at the lowest PC, so lanes
+ * that split at a BR run on their own until the others catch up. */
+
+enum{ LOCKSTEP_LANES=16 };
+
+typedef uint16_t lane_vec[LOCKSTEP_LANES];
+
+struct lc3_lockstep;
+
+/* masked lane arithmetic, only lanes with 0xFFFF in mask are written */
+typedef struct{
+    const char* name;
+    void (*add)(uint16_t* dst,const uint16_t* a,const uint16_t* b,const uint16_t* mask);
+    void (*add_imm)(uint16_t* dst,const uint16_t* a,uint16_t imm,const uint16_t* mask);
+    void (*and)(uint16_t* dst,const uint16_t* a,const uint16_t* b,const uint16_t* mask);
+    void (*and_imm)(uint16_t* dst,const uint16_t* a,uint16_t imm,const uint16_t* mask);
+    void (*not)(uint16_t* dst,const uint16_t* a,const uint16_t* mask);
+    void (*mov)(uint16_t* dst,const uint16_t* a,const uint16_t* mask);
+    void (*set)(uint16_t* dst,uint16_t imm,const uint16_t* mask);
+    /* mask=lanes of active at pc, returns them as bits */
+    uint32_t (*select)(uint16_t* mask,const uint16_t* pc,const uint16_t* active,uint16_t at);
+    /* pc=target for masked lanes whose cond matches nzp, returns them as bits */
+    uint32_t (*branch)(uint16_t* pc,const uint16_t* cond,const uint16_t* mask,int nzp,uint16_t target);
+    /* run_lockstep built on these ops */
+    void (*run)(struct lc3_lockstep* s,uint64_t budget);
+} lane_ops;
+
+void run_lockstep_generic(struct lc3_lockstep* s,uint64_t budget);
+void run_lockstep_sse2(struct lc3_lockstep* s,uint64_t budget);
+void run_lockstep_avx2(struct lc3_lockstep* s,uint64_t budget);
+
+void lanes_add_generic(uint16_t* dst,const uint16_t* a,const uint16_t* b,const uint16_t* mask){
+    for(int i=0;i<LOCKSTEP_LANES;++i){
+        dst[i]=(dst[i]&~mask[i])|((a[i]+b[i])&mask[i]);
+    }
+}
+
+void lanes_add_imm_generic(uint16_t* dst,const uint16_t* a,uint16_t imm,const uint16_t* mask){
+    for(int i=0;i<LOCKSTEP_LANES;++i){
+        dst[i]=(dst[i]&~mask[i])|((a[i]+imm)&mask[i]);
+    }
+}
+
+void lanes_and_generic(uint16_t* dst,const uint16_t* a,const uint16_t* b,const uint16_t* mask){
+    for(int i=0;i<LOCKSTEP_LANES;++i){
+        dst[i]=(dst[i]&~mask[i])|(a[i]&b[i]&mask[i]);
+    }
+}
+
+void lanes_and_imm_generic(uint16_t* dst,const uint16_t* a,uint16_t imm,const uint16_t* mask){
+    for(int i=0;i<LOCKSTEP_LANES;++i){
+        dst[i]=(dst[i]&~mask[i])|(a[i]&imm&mask[i]);
+    }
+}
+
+void lanes_not_generic(uint16_t* dst,const uint16_t* a,const uint16_t* mask){
+    for(int i=0;i<LOCKSTEP_LANES;++i){
+        dst[i]=(dst[i]&~mask[i])|(~a[i]&mask[i]);
+    }
+}
+
+void lanes_mov_generic(uint16_t* dst,const uint16_t* a,const uint16_t* mask){
+    for(int i=0;i<LOCKSTEP_LANES;++i){
+        dst[i]=(dst[i]&~mask[i])|(a[i]&mask[i]);
+    }
+}
+
+void lanes_set_generic(uint16_t* dst,uint16_t imm,const uint16_t* mask){
+    for(int i=0;i<LOCKSTEP_LANES;++i){
+        dst[i]=(dst[i]&~mask[i])|(imm&mask[i]);
+    }
+}
+
+uint32_t lanes_select_generic(uint16_t* mask,const uint16_t* pc,const uint16_t* active,uint16_t at){
+    uint32_t bits=0;
+    for(int i=0;i<LOCKSTEP_LANES;++i){
+        mask[i]=pc[i]==at?active[i]:0;
+        bits|=(uint32_t)(mask[i]&1)<<i;
+    }
+    return bits;
+}
+
+uint32_t lanes_branch_generic(uint16_t* pc,const uint16_t* cond,const uint16_t* mask,int nzp,uint16_t target){
+    uint32_t bits=0;
+    for(int i=0;i<LOCKSTEP_LANES;++i){
+        uint16_t flags=FL_POS<<((cond[i]>>15<<1)|(cond[i]==0));
+        if(mask[i]&&(flags&nzp)){
+            pc[i]=target;
+            bits|=1u<<i;
+        }
+    }
+    return bits;
+}
+
+const lane_ops lanes_generic={
+    "generic",
+    lanes_add_generic,
+    lanes_add_imm_generic,
+    lanes_and_generic,
+    lanes_and_imm_generic,
+    lanes_not_generic,
+    lanes_mov_generic,
+    lanes_set_generic,
+    lanes_select_generic,
+    lanes_branch_generic,
+    run_lockstep_generic
+};
+
+#if defined(__GNUC__)&&(defined(__x86_64__)||defined(__i386__))
+#define HAVE_LANE_SIMD 1
+#endif
+
+#ifdef HAVE_LANE_SIMD
+/* SSE2 covers the lanes in two halves, AVX2 in one register.
+ * both are built with target attributes and picked at run time. */
+
+#define SSE2 __attribute__((target("sse2")))
+#define AVX2 __attribute__((target("avx2")))
+
+#define SSE2_LANES(body) \
+    for(int i=0;i<LOCKSTEP_LANES;i+=8){ \
+        __m128i m=_mm_loadu_si128((const __m128i*)(mask+i)); \
+        __m128i d=_mm_loadu_si128((const __m128i*)(dst+i)); \
+        __m128i v; \
+        body; \
+        _mm_storeu_si128((__m128i*)(dst+i),_mm_or_si128(_mm_andnot_si128(m,d),_mm_and_si128(m,v))); \
+    }
+
+#define SSE2_LOAD(p) _mm_loadu_si128((const __m128i*)((p)+i))
+
+SSE2 void lanes_add_sse2(uint16_t* dst,const uint16_t* a,const uint16_t* b,const uint16_t* mask){
+    SSE2_LANES(v=_mm_add_epi16(SSE2_LOAD(a),SSE2_LOAD(b)))
+}
+
+SSE2 void lanes_add_imm_sse2(uint16_t* dst,const uint16_t* a,uint16_t imm,const uint16_t* mask){
+    SSE2_LANES(v=_mm_add_epi16(SSE2_LOAD(a),_mm_set1_epi16((short)imm)))
+}
+
+SSE2 void lanes_and_sse2(uint16_t* dst,const uint16_t* a,const uint16_t* b,const uint16_t* mask){
+    SSE2_LANES(v=_mm_and_si128(SSE2_LOAD(a),SSE2_LOAD(b)))
+}
+
+SSE2 void lanes_and_imm_sse2(uint16_t* dst,const uint16_t* a,uint16_t imm,const uint16_t* mask){
+    SSE2_LANES(v=_mm_and_si128(SSE2_LOAD(a),_mm_set1_epi16((short)imm)))
+}
+
+SSE2 void lanes_not_sse2(uint16_t* dst,const uint16_t* a,const uint16_t* mask){
+    SSE2_LANES(v=_mm_xor_si128(SSE2_LOAD(a),_mm_set1_epi16(-1)))
+}
+
+SSE2 void lanes_mov_sse2(uint16_t* dst,const uint16_t* a,const uint16_t* mask){
+    SSE2_LANES(v=SSE2_LOAD(a))
+}
+
+SSE2 void lanes_set_sse2(uint16_t* dst,uint16_t imm,const uint16_t* mask){
+    SSE2_LANES(v=_mm_set1_epi16((short)imm))
+}
+
+SSE2 uint32_t lanes_select_sse2(uint16_t* mask,const uint16_t* pc,const uint16_t* active,uint16_t at){
+    __m128i target=_mm_set1_epi16((short)at);
+    __m128i lo=_mm_and_si128(_mm_cmpeq_epi16(_mm_loadu_si128((const __m128i*)pc),target),
+        _mm_loadu_si128((const __m128i*)active));
+    __m128i hi=_mm_and_si128(_mm_cmpeq_epi16(_mm_loadu_si128((const __m128i*)(pc+8)),target),
+        _mm_loadu_si128((const __m128i*)(active+8)));
+    _mm_storeu_si128((__m128i*)mask,lo);
+    _mm_storeu_si128((__m128i*)(mask+8),hi);
+    return (uint32_t)_mm_movemask_epi8(_mm_packs_epi16(lo,hi));
+}
+
+/* lanes of cond that match nzp */
+SSE2 __m128i lanes_taken_sse2(__m128i cond,int nzp){
+    __m128i zero=_mm_setzero_si128();
+    __m128i neg=_mm_cmplt_epi16(cond,zero);
+    __m128i zro=_mm_cmpeq_epi16(cond,zero);
+    __m128i pos=_mm_cmpgt_epi16(cond,zero);
+    __m128i taken=zero;
+    if(nzp&FL_NEG){
+        taken=_mm_or_si128(taken,neg);
+    }
+    if(nzp&FL_ZRO){
+        taken=_mm_or_si128(taken,zro);
+    }
+    if(nzp&FL_POS){
+        taken=_mm_or_si128(taken,pos);
+    }
+    return taken;
+}
+
+SSE2 uint32_t lanes_branch_sse2(uint16_t* pc,const uint16_t* cond,const uint16_t* mask,int nzp,uint16_t target){
+    __m128i t=_mm_set1_epi16((short)target);
+    __m128i taken[2];
+    for(int i=0;i<LOCKSTEP_LANES;i+=8){
+        __m128i m=_mm_and_si128(SSE2_LOAD(mask),lanes_taken_sse2(SSE2_LOAD(cond),nzp));
+        __m128i p=SSE2_LOAD(pc);
+        _mm_storeu_si128((__m128i*)(pc+i),_mm_or_si128(_mm_andnot_si128(m,p),_mm_and_si128(m,t)));
+        taken[i/8]=m;
+    }
+    return (uint32_t)_mm_movemask_epi8(_mm_packs_epi16(taken[0],taken[1]));
+}
+
+const lane_ops lanes_sse2={
+    "sse2",
+    lanes_add_sse2,
+    lanes_add_imm_sse2,
+    lanes_and_sse2,
+    lanes_and_imm_sse2,
+    lanes_not_sse2,
+    lanes_mov_sse2,
+    lanes_set_sse2,
+    lanes_select_sse2,
+    lanes_branch_sse2,
+    run_lockstep_sse2
+};
+
+#define AVX2_LANES(body) \
+    __m256i m=_mm256_loadu_si256((const __m256i*)mask); \
+    __m256i d=_mm256_loadu_si256((const __m256i*)dst); \
+    __m256i v; \
+    body; \
+    _mm256_storeu_si256((__m256i*)dst,_mm256_blendv_epi8(d,v,m));
+
+#define AVX2_LOAD(p) _mm256_loadu_si256((const __m256i*)(p))
+
+/* one bit per 16 bit lane */
+AVX2 uint32_t lanes_bits_avx2(__m256i m){
+    return (uint32_t)_mm_movemask_epi8(_mm_packs_epi16(_mm256_castsi256_si128(m),_mm256_extracti128_si256(m,1)));
+}
+
+AVX2 void lanes_add_avx2(uint16_t* dst,const uint16_t* a,const uint16_t* b,const uint16_t* mask){
+    AVX2_LANES(v=_mm256_add_epi16(AVX2_LOAD(a),AVX2_LOAD(b)))
+}
+
+AVX2 void lanes_add_imm_avx2(uint16_t* dst,const uint16_t* a,uint16_t imm,const uint16_t* mask){
+    AVX2_LANES(v=_mm256_add_epi16(AVX2_LOAD(a),_mm256_set1_epi16((short)imm)))
+}
+
+AVX2 void lanes_and_avx2(uint16_t* dst,const uint16_t* a,const uint16_t* b,const uint16_t* mask){
+    AVX2_LANES(v=_mm256_and_si256(AVX2_LOAD(a),AVX2_LOAD(b)))
+}
+
+AVX2 void lanes_and_imm_avx2(uint16_t* dst,const uint16_t* a,uint16_t imm,const uint16_t* mask){
+    AVX2_LANES(v=_mm256_and_si256(AVX2_LOAD(a),_mm256_set1_epi16((short)imm)))
+}
+
+AVX2 void lanes_not_avx2(uint16_t* dst,const uint16_t* a,const uint16_t* mask){
+    AVX2_LANES(v=_mm256_xor_si256(AVX2_LOAD(a),_mm256_set1_epi16(-1)))
+}
+
+AVX2 void lanes_mov_avx2(uint16_t* dst,const uint16_t* a,const uint16_t* mask){
+    AVX2_LANES(v=AVX2_LOAD(a))
+}
+
+AVX2 void lanes_set_avx2(uint16_t* dst,uint16_t imm,const uint16_t* mask){
+    AVX2_LANES(v=_mm256_set1_epi16((short)imm))
+}
+
+AVX2 uint32_t lanes_select_avx2(uint16_t* mask,const uint16_t* pc,const uint16_t* active,uint16_t at){
+    __m256i m=_mm256_and_si256(_mm256_cmpeq_epi16(AVX2_LOAD(pc),_mm256_set1_epi16((short)at)),AVX2_LOAD(active));
+    _mm256_storeu_si256((__m256i*)mask,m);
+    return lanes_bits_avx2(m);
+}
+
+AVX2 uint32_t lanes_branch_avx2(uint16_t* pc,const uint16_t* cond,const uint16_t* mask,int nzp,uint16_t target){
+    __m256i c=AVX2_LOAD(cond);
+    __m256i zero=_mm256_setzero_si256();
+    __m256i taken=zero;
+    if(nzp&FL_NEG){
+        taken=_mm256_or_si256(taken,_mm256_cmpgt_epi16(zero,c));
+    }
+    if(nzp&FL_ZRO){
+        taken=_mm256_or_si256(taken,_mm256_cmpeq_epi16(c,zero));
+    }
+    if(nzp&FL_POS){
+        taken=_mm256_or_si256(taken,_mm256_cmpgt_epi16(c,zero));
+    }
+    taken=_mm256_and_si256(taken,AVX2_LOAD(mask));
+    _mm256_storeu_si256((__m256i*)pc,_mm256_blendv_epi8(AVX2_LOAD(pc),_mm256_set1_epi16((short)target),taken));
+    return lanes_bits_avx2(taken);
+}
+
+const lane_ops lanes_avx2={
+    "avx2",
+    lanes_add_avx2,
+    lanes_add_imm_avx2,
+    lanes_and_avx2,
+    lanes_and_imm_avx2,
+    lanes_not_avx2,
+    lanes_mov_avx2,
+    lanes_set_avx2,
+    lanes_select_avx2,
+    lanes_branch_avx2,
+    run_lockstep_avx2
+};
+#endif
+
+/* the widest lane ops this cpu runs */
+const lane_ops* lane_ops_best(){
+#ifdef HAVE_LANE_SIMD
+    if(__builtin_cpu_supports("avx2")){
+        return &lanes_avx2;
+    }
+    if(__builtin_cpu_supports("sse2")){
+        return &lanes_sse2;
+    }
+#endif
+    return &lanes_generic;
+}
+
+typedef struct lc3_lockstep{
+    lane_vec reg[R_COUNT];
+    lane_vec cond;              /* cond_result of each lane */
+    lane_vec active;            /* 0xFFFF while a lane runs */
+    uint32_t running;           /* active as bits */
+    int lanes;
+    lc3_vm* vm[LOCKSTEP_LANES]; /* memory and I/O of each lane */
+    int halted[LOCKSTEP_LANES];
+    const lane_ops* ops;
+
+    /* decoded instructions shared by every lane, memory[] holds the
+     * word each entry was decoded from. lanes start from the same
+     * image, so words only differ where some lane has stored */
+    lc3_vm* code;
+    uint8_t* stored;            /* set for words any lane has written */
+} lc3_lockstep;
+
+void lc3_lockstep_destroy(lc3_lockstep* s){
+    if(s){
+        lc3_vm_destroy(s->code);
+        lc3_free(s->stored,MEMORY_WORDS*sizeof(uint8_t));
+        free(s);
+    }
+}
+
+lc3_lockstep* lc3_lockstep_create(){
+    lc3_lockstep* s=calloc(1,sizeof(lc3_lockstep));
+    if(!s){
+        return NULL;
+    }
+    s->code=lc3_vm_create();
+    s->stored=lc3_alloc(MEMORY_WORDS*sizeof(uint8_t));
+    if(!s->code||!s->stored){
+        lc3_lockstep_destroy(s);
+        return NULL;
+    }
+    s->ops=lane_ops_best();
+    return s;
+}
+
+/* copy the lane registers back to their machines */
+void lockstep_sync(lc3_lockstep* s,int lane){
+    lc3_vm* vm=s->vm[lane];
+    for(int r=0;r<R_COUNT;++r){
+        vm->reg[r]=s->reg[r][lane];
+    }
+    vm->cond_result=s->cond[lane];
+}
+
+/* the machine joins with its current registers, returns its lane or -1 */
+int lockstep_add_lane(lc3_lockstep* s,lc3_vm* vm){
+    if(s->lanes==LOCKSTEP_LANES){
+        return -1;
+    }
+    int lane=s->lanes++;
+    s->vm[lane]=vm;
+    for(int r=0;r<R_COUNT;++r){
+        s->reg[r][lane]=vm->reg[r];
+    }
+    s->cond[lane]=vm->cond_result;
+    s->active[lane]=0xFFFF;
+    s->running|=1u<<lane;
+    return lane;
+}
+
+/* stop stepping a lane, its machine is left in sync and not touched again */
+void lockstep_retire(lc3_lockstep* s,int lane){
+    lockstep_sync(s,lane);
+    s->active[lane]=0;
+    s->running&=~(1u<<lane);
+}
+
+void lockstep_store(lc3_lockstep* s,int lane,uint16_t address,uint16_t val){
+    mem_write(s->vm[lane],address,val);
+    s->stored[address]=1;
+}
+
+/* the stepping loop, instantiated once per lane_ops so the ops inline */
+static inline __attribute__((always_inline)) void lockstep_steps(lc3_lockstep* s,uint64_t budget,const lane_ops* ops){
+    lane_vec mask;
+    int converged=0;
+    while(s->running&&budget--){
+        int lead=0;
+        while(!(s->running>>lead&1)){
+            ++lead;
+        }
+        uint16_t pc=s->reg[R_PC][lead];
+        if(!converged){
+            for(int l=lead+1;l<s->lanes;++l){
+                if((s->running>>l&1)&&s->reg[R_PC][l]<pc){
+                    pc=s->reg[R_PC][l];
+                    lead=l;
+                }
+            }
+        }
+        uint32_t group=ops->select(mask,s->reg[R_PC],s->active,pc);
+        converged=group==s->running;
+
+
+        /* FETCH */
+        lc3_vm* vm=s->vm[lead];
+        decoded_instr* d=&s->code->decoded[pc];
+        if(s->stored[pc]){
+            /* lanes whose copy of the code differs wait their turn */
+            for(int l=0;l<s->lanes;++l){
+                if((group>>l&1)&&s->vm[l]->memory[pc]!=vm->memory[pc]){
+                    mask[l]=0;
+                    group&=~(1u<<l);
+                    converged=0;
+                }
+            }
+            if(d->valid&&s->code->memory[pc]!=vm->memory[pc]){
+                d->valid=0;
+            }
+        }
+        if(!d->valid){
+            uint16_t instr=mem_read(vm,pc);
+            s->code->memory[pc]=instr;
+            decode_instr(s->code,pc,instr);
+        }
+        decoded_instr head;
+        if(d->op==OP_IDLE){
+            /* lanes read in-memory input, there is nothing to wait for */
+            head=decode_word(s->code->memory[pc]);
+            d=&head;
+        }
+
+        uint16_t next=pc+1;
+        ops->set(s->reg[R_PC],next,mask);
+        switch(d->op){
+            case OP_ADD:
+                if(d->imm_flag){
+                    ops->add_imm(s->reg[d->dr],s->reg[d->sr1],d->imm,mask);
+                }else{
+                    ops->add(s->reg[d->dr],s->reg[d->sr1],s->reg[d->sr2],mask);
+                }
+                ops->mov(s->cond,s->reg[d->dr],mask);
+                break;
+            case OP_AND:
+                if(d->imm_flag){
+                    ops->and_imm(s->reg[d->dr],s->reg[d->sr1],d->imm,mask);
+                }else{
+                    ops->and(s->reg[d->dr],s->reg[d->sr1],s->reg[d->sr2],mask);
+                }
+                ops->mov(s->cond,s->reg[d->dr],mask);
+                break;
+            case OP_NOT:
+                ops->not(s->reg[d->dr],s->reg[d->sr1],mask);
+                ops->mov(s->cond,s->reg[d->dr],mask);
+                break;
+            case OP_BR:
+                {
+                    uint32_t taken=ops->branch(s->reg[R_PC],s->cond,mask,d->dr,next+d->imm);
+                    if(taken&&taken!=group){
+                        converged=0;
+                    }
+                }
+                break;
+            case OP_JMP:
+                ops->mov(s->reg[R_PC],s->reg[d->sr1],mask);
+                converged=0;
+                break;
+            case OP_JSR:
+                if(d->imm_flag){
+                    ops->set(s->reg[R_PC],next+d->imm,mask);
+                }else{
+                    /* read the base before R7 is written */
+                    ops->mov(s->reg[R_PC],s->reg[d->sr1],mask);
+                    converged=0;
+                }
+                ops->set(s->reg[R_R7],next,mask);
+                break;
+            case OP_LEA:
+                ops->set(s->reg[d->dr],next+d->imm,mask);
+                ops->mov(s->cond,s->reg[d->dr],mask);
+                break;
+            case OP_LD:
+            case OP_LDI:
+            case OP_LDR:
+                for(int l=0;l<s->lanes;++l){
+                    if(group>>l&1){
+                        uint16_t address=d->op==OP_LDR?s->reg[d->sr1][l]+d->imm:next+d->imm;
+                        if(d->op==OP_LDI){
+                            address=mem_read(s->vm[l],address);
+                        }
+                        s->reg[d->dr][l]=s->cond[l]=mem_read(s->vm[l],address);
+                    }
+                }
+                break;
+            case OP_ST:
+            case OP_STI:
+            case OP_STR:
+                for(int l=0;l<s->lanes;++l){
+                    if(group>>l&1){
+                        uint16_t address=d->op==OP_STR?s->reg[d->sr1][l]+d->imm:next+d->imm;
+                        if(d->op==OP_STI){
+                            address=mem_read(s->vm[l],address);
+                        }
+                        lockstep_store(s,l,address,s->reg[d->dr][l]);
+                    }
+                }
+                break;
+            case OP_TRAP:
+                for(int l=0;l<s->lanes;++l){
+                    if(group>>l&1){
+                        lc3_vm* lane=s->vm[l];
+                        lane->reg[R_R0]=s->reg[R_R0][l];
+                        int running=execute_trap(lane,d->imm,lane->in,lane->out);
+                        s->reg[R_R0][l]=lane->reg[R_R0];
+                        if(!running){
+                            s->halted[l]=1;
+                            lockstep_retire(s,l);
+                        }
+                    }
+                }
+                break;
+            case OP_RES:
+            case OP_RTI:
+            default:
+                abort();
+                break;
+        }
+    }
+}
+
+void run_lockstep_generic(lc3_lockstep* s,uint64_t budget){
+    lockstep_steps(s,budget,&lanes_generic);
+}
+
+#ifdef HAVE_LANE_SIMD
+SSE2 void run_lockstep_sse2(lc3_lockstep* s,uint64_t budget){
+    lockstep_steps(s,budget,&lanes_sse2);
+}
+
+AVX2 void run_lockstep_avx2(lc3_lockstep* s,uint64_t budget){
+    lockstep_steps(s,budget,&lanes_avx2);
+}
+#endif
+
+/* run at most budget steps, returns 0 once every lane has stopped.
+ * each step retires one instruction in every lane at the chosen PC */
+int run_lockstep(lc3_lockstep* s,uint64_t budget){
+    s->ops->run(s,budget);
+    for(int l=0;l<s->lanes;++l){
+        if(s->running>>l&1){
+            lockstep_sync(s,l);
+        }
+    }
+    return s->running!=0;
+}
+
+/** Batch Runner **/
+
+/* many independent image+input jobs spread over worker threads.
+ * jobs are dealt out round robin to one deque per worker. a worker
+ * keeps a small window of live machines and runs each for a slice
+ * before moving to the next, refilling the window from the front of
+ * its own deque and, once that is empty, from the back of another's. */
+
+#ifndef _WIN32
+#define HAVE_BATCH 1
+#endif
+
+#ifdef HAVE_BATCH
+
+enum{
+    BATCH_SLICE=100000,     /* instructions a machine runs before yielding */
+    BATCH_WINDOW=4,         /* live machines per worker */
+    BATCH_LINE=4096
+};
+
+enum{
+    JOB_PENDING=0,
+    JOB_HALTED,
+    JOB_INPUT_EXHAUSTED,    /* waited for input after the last byte */
+    JOB_LIMIT,              /* hit the instruction limit */
+    JOB_FAILED
+};
+
+const char* job_status_names[]={
+    "pending",
+    "halted",
+    "input exhausted",
+    "instruction limit",
+    "failed"
+};
+
+typedef struct{
+    int line;
+    char* input_path;       /* "-" for no input */
+    char* output_path;
+    char** images;
+    int image_count;
+
+    lc3_vm* vm;
+    int lanes;              /* jobs stepped together from this one, see --lockstep */
+    lc3_lockstep* lockstep;
+    int lane;
+    char* in_buf;
+    char* out_buf;
+    size_t out_size;
+    uint64_t executed;
+    int status;
+} batch_job;
+
+typedef struct{
+    pthread_mutex_t lock;
+    batch_job** jobs;
+    int head;
+    int count;
+} job_deque;
+
+typedef struct{
+    job_deque* deques;
+    int worker_count;
+    int engine;
+    uint64_t slice;
+    uint64_t max_instructions;     /* 0 for no limit */
+    int lockstep;
+    int output_policy;
+} batch_config;
+
+typedef struct{
+    batch_config* config;
+    int id;
+    pthread_t thread;
+} batch_worker;
+
+/* the owner works from the front */
+batch_job* deque_pop_front(job_deque* d){
+    batch_job* job=NULL;
+    pthread_mutex_lock(&d->lock);
+    if(d->count){
+        job=d->jobs[d->head++];
+        --d->count;
+    }
+    pthread_mutex_unlock(&d->lock);
+    return job;
+}
+
+/* thieves take from the back, away from the owner */
+batch_job* deque_pop_back(job_deque* d){
+    batch_job* job=NULL;
+    pthread_mutex_lock(&d->lock);
+    if(d->count){
+        job=d->jobs[d->head+--d->count];
+    }
+    pthread_mutex_unlock(&d->lock);
+    return job;
+}
+
+batch_job* batch_next_job(batch_config* config,int id){
+    batch_job* job=deque_pop_front(&config->deques[id]);
+    for(int i=1;!job&&i<config->worker_count;++i){
+        job=deque_pop_back(&config->deques[(id+i)%config->worker_count]);
+    }
+    return job;
+}
+
+int open_job(batch_config* config,batch_job* job){
+    job->vm=lc3_vm_create();
+    if(!job->vm){
+        return 0;
+    }
+    job->vm->engine=config->engine;
+    job->vm->output_policy=config->output_policy;
+    if(!read_images(job->vm,job->images,job->image_count)){
+        return 0;
+    }
+
+    size_t size=0;
+    if(strcmp(job->input_path,"-")!=0){
+        job->in_buf=read_whole_file(job->input_path,&size);
+        if(!job->in_buf){
+            return 0;
+        }
+    }
+    /* fmemopen rejects an empty buffer on older libcs */
+    job->vm->in=size?fmemopen(job->in_buf,size,"rb"):fopen("/dev/null","rb");
+    job->vm->out=open_memstream(&job->out_buf,&job->out_size);
+    return job->vm->in&&job->vm->out;
+}
+
+void finish_job(batch_job* job,int status){
+    job->status=status;
+    lc3_vm* vm=job->vm;
+    if(vm){
+        if(vm->in){
+            fclose(vm->in);
+        }
+        if(vm->out){
+            output_flush(vm);
+            fclose(vm->out);
+        }
+        lc3_vm_destroy(vm);
+        job->vm=NULL;
+    }
+    free(job->in_buf);
+    job->in_buf=NULL;
+    if(status!=JOB_FAILED){
+        FILE* file=fopen(job->output_path,"wb");
+        if(!file||fwrite(job->out_buf,1,job->out_size,file)!=job->out_size){
+            job->status=JOB_FAILED;
+        }
+        if(file&&fclose(file)!=0){
+            job->status=JOB_FAILED;
+        }
+    }
+    free(job->out_buf);
+    job->out_buf=NULL;
+}
+
+/* a job and the ones stepped with it, failures are finished here */
+int start_job(batch_config* config,batch_job* job){
+    if(job->lanes<2){
+        if(!open_job(config,job)){
+            finish_job(job,JOB_FAILED);
+            return 0;
+        }
+        return 1;
+    }
+    job->lockstep=lc3_lockstep_create();
+    int live=0;
+    for(int i=0;i<job->lanes;++i){
+        batch_job* member=job+i;
+        if(job->lockstep&&open_job(config,member)){
+            member->lane=lockstep_add_lane(job->lockstep,member->vm);
+            ++live;
+        }else{
+            finish_job(member,JOB_FAILED);
+        }
+    }
+    if(!live){
+        lc3_lockstep_destroy(job->lockstep);
+        job->lockstep=NULL;
+    }
+    return live;
+}
+
+int job_status(batch_config* config,lc3_vm* vm,int running,uint64_t executed){
+    if(!running){
+        return JOB_HALTED;
+    }
+    if(vm->input_eof){
+        return JOB_INPUT_EXHAUSTED;
+    }
+    if(config->max_instructions&&executed>=config->max_instructions){
+        return JOB_LIMIT;
+    }
+    return JOB_PENDING;
+}
+
+/* one slice, returns 0 once the job is finished.
+ * lockstep groups count steps rather than instructions per lane */
+int run_job_slice(batch_config* config,batch_job* job){
+    uint64_t budget=config->slice;
+    if(config->max_instructions&&config->max_instructions-job->executed<budget){
+        budget=config->max_instructions-job->executed;
+    }
+    if(!job->lockstep){
+        int running=run_engine(job->vm,budget);
+        job->executed+=budget;
+        int status=job_status(config,job->vm,running,job->executed);
+        if(status!=JOB_PENDING){
+            finish_job(job,status);
+            return 0;
+        }
+        return 1;
+    }
+
+    lc3_lockstep* s=job->lockstep;
+    run_lockstep(s,budget);
+    job->executed+=budget;
+    for(int i=0;i<job->lanes;++i){
+        batch_job* member=job+i;
+        if(!member->vm){
+            continue;
+        }
+        int status=job_status(config,member->vm,!s->halted[member->lane],job->executed);
+        if(status!=JOB_PENDING){
+            if(s->running>>member->lane&1){
+                lockstep_retire(s,member->lane);
+            }
+            finish_job(member,status);
+        }
+    }
+    if(!s->running){
+        lc3_lockstep_destroy(s);
+        job->lockstep=NULL;
+        return 0;
+    }
+    return 1;
+}
+
+void* batch_worker_main(void* arg){
+    batch_worker* worker=arg;
+    batch_config* config=worker->config;
+    batch_job* live[BATCH_WINDOW];
+    int live_count=0;
+    for(;;){
+        while(live_count<BATCH_WINDOW){
+            batch_job* job=batch_next_job(config,worker->id);
+            if(!job){
+                break;
+            }
+            if(start_job(config,job)){
+                live[live_count++]=job;
+            }
+        }
+        if(!live_count){
+            /* jobs are never requeued, so every deque is empty for good */
+            break;
+        }
+        for(int i=0;i<live_count;){
+            if(run_job_slice(config,live[i])){
+                ++i;
+            }else{
+                live[i]=live[--live_count];
+            }
+        }
+    }
+    return NULL;
+}
+
+/* each line is: input-file|- output-file image-file [image-file...] */
+batch_job* read_job_file(const char* path,int* job_count){
+    FILE* file=fopen(path,"r");
+    if(!file){
+        printf("failed to open job file: %s\n",path);
+        return NULL;
+    }
+    batch_job* jobs=NULL;
+    int count=0,cap=0,line=0,ok=1;
+    char text[BATCH_LINE];
+    while(ok&&fgets(text,sizeof(text),file)){
+        ++line;
+        char* fields[BATCH_LINE/2];
+        int n=0;
+        for(char* tok=strtok(text," \t\r\n");tok&&tok[0]!='#';tok=strtok(NULL," \t\r\n")){
+            fields[n++]=tok;
+        }
+        if(!n){
+            continue;
+        }
+        if(n<3){
+            printf("%s:%d: expected input, output and at least one image\n",path,line);
+            ok=0;
+            break;
+        }
+        if(count==cap){
+            cap=cap?cap*2:64;
+            batch_job* grown=realloc(jobs,cap*sizeof(batch_job));
+            if(!grown){
+                ok=0;
+                break;
+            }
+            jobs=grown;
+        }
+        batch_job* job=&jobs[count++];
+        memset(job,0,sizeof(*job));
+        job->line=line;
+        job->input_path=strdup(fields[0]);
+        job->output_path=strdup(fields[1]);
+        job->image_count=n-2;
+        job->images=malloc(job->image_count*sizeof(char*));
+        ok=job->input_path&&job->output_path&&job->images;
+        for(int i=0;ok&&i<job->image_count;++i){
+            ok=(job->images[i]=strdup(fields[2+i]))!=NULL;
+        }
+    }
+    fclose(file);
+    *job_count=count;
+    if(!ok){
+        free(jobs);
+        return NULL;
+    }
+    return jobs;
+}
+
+/* consecutive jobs on the same images */
+int same_images(const batch_job* a,const batch_job* b){
+    if(a->image_count!=b->image_count){
+        return 0;
+    }
+    for(int i=0;i<a->image_count;++i){
+        if(strcmp(a->images[i],b->images[i])!=0){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* config carries the options, zero for defaults, deques are filled in here */
+int run_batch(const char* path,batch_config config){
+    int job_count=0;
+    batch_job* jobs=read_job_file(path,&job_count);
+    if(!jobs){
+        return 1;
+    }
+    if(config.worker_count<1){
+        long cpus=sysconf(_SC_NPROCESSORS_ONLN);
+        config.worker_count=cpus>0?(int)cpus:1;
+    }
+    if(!config.slice){
+        config.slice=BATCH_SLICE;
+    }
+    int worker_count=config.worker_count;
+    int lockstep=config.lockstep;
+
+    config.deques=calloc(worker_count,sizeof(job_deque));
+    batch_worker* workers=calloc(worker_count,sizeof(batch_worker));
+    if(!config.deques||!workers){
+        return 1;
+    }
+    for(int i=0;i<worker_count;++i){
+        pthread_mutex_init(&config.deques[i].lock,NULL);
+        config.deques[i].jobs=malloc((job_count/worker_count+1)*sizeof(batch_job*));
+    }
+    /* only the first job of a lockstep group is queued */
+    int queued=0;
+    for(int i=0;i<job_count;i+=jobs[i].lanes){
+        jobs[i].lanes=1;
+        while(lockstep&&jobs[i].lanes<LOCKSTEP_LANES&&i+jobs[i].lanes<job_count&&
+            same_images(&jobs[i],&jobs[i+jobs[i].lanes])){
+            ++jobs[i].lanes;
+        }
+        job_deque* d=&config.deques[queued++%worker_count];
+        d->jobs[d->count++]=&jobs[i];
+    }
+
+    int started=0;
+    for(int i=0;i<worker_count;++i){
+        workers[i].config=&config;
+        workers[i].id=i;
+        if(pthread_create(&workers[i].thread,NULL,batch_worker_main,&workers[i])!=0){
+            break;
+        }
+        ++started;
+    }
+    if(!started){
+        /* no threads to be had, run everything here */
+        batch_worker_main(&workers[0]);
+    }
+    for(int i=0;i<started;++i){
+        pthread_join(workers[i].thread,NULL);
+    }
+
+    int failed=0;
+    for(int i=0;i<job_count;++i){
+        batch_job* job=&jobs[i];
+        printf("%s:%d: %s: %s\n",path,job->line,job->output_path,job_status_names[job->status]);
+        failed|=job->status==JOB_FAILED;
+        for(int k=0;k<job->image_count;++k){
+            free(job->images[k]);
+        }
+        free(job->images);
+        free(job->input_path);
+        free(job->output_path);
+    }
+    for(int i=0;i<worker_count;++i){
+        pthread_mutex_destroy(&config.deques[i].lock);
+        free(config.deques[i].jobs);
+    }
+    free(config.deques);
+    free(workers);
+    free(jobs);
+    return failed;
+}
+
+/* a single job with no terminal, for cron and containers: input comes
+ * from memory, output goes to output_path or stdout, and the status and
+ * instruction count go to stderr. returns the exit status, 0 if the
+ * program halted and otherwise the job status */
+int run_headless(lc3_vm* vm,char* in_buf,size_t size,const char* output_path,uint64_t max_instructions){
+    batch_config config={0};
+    config.max_instructions=max_instructions;
+    /* fmemopen rejects an empty buffer on older libcs */
+    vm->in=size?fmemopen(in_buf,size,"rb"):fopen("/dev/null","rb");
+    vm->out=output_path?fopen(output_path,"wb"):stdout;
+    if(!vm->in||!vm->out){
+        fprintf(stderr,"failed to open %s\n",vm->in?output_path:"the input");
+        return JOB_FAILED;
+    }
+
+    uint64_t start=vm->icount;
+    int status=JOB_PENDING;
+    while(status==JOB_PENDING){
+        uint64_t budget=BATCH_SLICE;
+        if(max_instructions&&max_instructions-(vm->icount-start)<budget){
+            budget=max_instructions-(vm->icount-start);
+        }
+        int running=run_engine(vm,budget);
+        status=job_status(&config,vm,running,vm->icount-start);
+    }
+    output_flush(vm);
+    fclose(vm->in);
+    if(vm->out!=stdout&&fclose(vm->out)!=0){
+        status=JOB_FAILED;
+    }
+    vm->in=stdin;
+    vm->out=stdout;
+    fprintf(stderr,"%s after %llu instructions\n",job_status_names[status],(unsigned long long)(vm->icount-start));
+    return status==JOB_HALTED?0:status;
+}
+
+#endif
+
+/** Benchmarks **/
+
+/* a fixed set of workloads timed on every engine, printed as JSON so
+ * runs can be compared across engines, builds and compiler flags.
+ * kernels loop forever and games run on an endless script, so every
+ * timed run retires exactly its instruction count. the machine is put
+ * back to a snapshot before each run; kernels keep their data off the
+ * code page so compiled code survives the restore. */
+
+#ifndef _WIN32
+#define HAVE_BENCH 1
+#endif
+
+#ifdef HAVE_BENCH
+
+enum{
+    BENCH_WARMUP=2,
+    BENCH_RUNS=7,
+    BENCH_KERNEL_INSTRUCTIONS=20000000,
+    BENCH_GAME_INSTRUCTIONS=5000000,
+    BENCH_SCRIPT=65536,         /* bytes of scripted keys fed to a game */
+};
+
+typedef struct{
+    const char* name;
+    const uint16_t* code;       /* loaded at PC_START */
+    size_t words;
+} bench_kernel;
+
+const uint16_t bench_alu[]={
+    0x1261, /* ADD R1, R1, #1 */
+    0x5467, /* AND R2, R1, #7 */
+    0x96BF, /* NOT R3, R2 */
+    0x18C1, /* ADD R4, R3, R1 */
+    0x0FFB, /* BRnzp x3000 */
+};
+
+/* 256 words from x4000 to x5000, over and over */
+const uint16_t bench_copy[]={
+    0x200F, /* LD R0, x3010 */
+    0x220F, /* LD R1, x3011 */
+    0x240F, /* LD R2, x3012 */
+    0x6600, /* LDR R3, R0, #0 */
+    0x7640, /* STR R3, R1, #0 */
+    0x1021, /* ADD R0, R0, #1 */
+    0x1261, /* ADD R1, R1, #1 */
+    0x14BF, /* ADD R2, R2, #-1 */
+    0x03FA, /* BRp x3003 */
+    0x0FF6, /* BRnzp x3000 */
+    0, 0, 0, 0, 0, 0,
+    0x4000, /* source */
+    0x5000, /* destination */
+    0x0100, /* words */
+};
+
+const uint16_t bench_calls[]={
+    0x4803, /* JSR x3004 */
+    0x4802, /* JSR x3004 */
+    0x0FFD, /* BRnzp x3000 */
+    0x0000,
+    0x1021, /* ADD R0, R0, #1 */
+    0xC1C0, /* RET */
+};
+
+const uint16_t bench_indirect[]={
+    0xA003, /* LDI R0, x3004 */
+    0x1021, /* ADD R0, R0, #1 */
+    0xB001, /* STI R0, x3004 */
+    0x0FFC, /* BRnzp x3000 */
+    0x4000, /* counter */
+};
+
+const bench_kernel bench_kernels[]={
+    {"alu",bench_alu,sizeof(bench_alu)/sizeof(uint16_t)},
+    {"copy",bench_copy,sizeof(bench_copy)/sizeof(uint16_t)},
+    {"calls",bench_calls,sizeof(bench_calls)/sizeof(uint16_t)},
+    {"indirect",bench_indirect,sizeof(bench_indirect)/sizeof(uint16_t)},
+};
+
+enum{ BENCH_KERNELS=sizeof(bench_kernels)/sizeof(bench_kernel) };
+
+/* the keys the reference sessions use: answer the terminal prompt,
+ * then walk in circles */
+void bench_script(char* buf,size_t size){
+    const char* keys="wasdwdsa";
+    buf[0]='y';
+    for(size_t i=1;i<size;++i){
+        buf[i]=keys[(i-1)%8];
+    }
+}
+
+int compare_u64(const void* a,const void* b){
+    uint64_t x=*(const uint64_t*)a,y=*(const uint64_t*)b;
+    return x<y?-1:x>y;
+}
+
+/* times vm from its current state, restored before every run. returns
+ * 0 if the machine halts before instructions, which would make the
+ * count a guess */
+int bench_workload(lc3_vm* vm,const char* name,uint64_t instructions,int first){
+    uint64_t ns[BENCH_RUNS];
+    lc3_snap* s=lc3_snapshot(vm);
+    if(!s){
+        return 0;
+    }
+    for(int i=-BENCH_WARMUP;i<BENCH_RUNS;++i){
+        lc3_restore(vm,s);
+        rewind(vm->in);
+        vm->input_eof=0;
+        uint64_t start=monotonic_ns();
+        int running=run_engine(vm,instructions);
+        output_flush(vm);
+        uint64_t elapsed=monotonic_ns()-start;
+        if(!running){
+            fprintf(stderr,"%s halted before %llu instructions on the %s engine\n",
+                    name,(unsigned long long)instructions,engine_names[vm->engine]);
+            lc3_snap_free(s);
+            return 0;
+        }
+        if(i>=0){
+            ns[i]=elapsed?elapsed:1;
+        }
+    }
+    lc3_snap_free(s);
+
+    double mean=0,variance=0;
+    for(int i=0;i<BENCH_RUNS;++i){
+        mean+=instructions*1000.0/ns[i]/BENCH_RUNS;
+    }
+    for(int i=0;i<BENCH_RUNS;++i){
+        double mips=instructions*1000.0/ns[i];
+        variance+=(mips-mean)*(mips-mean)/(BENCH_RUNS-1);
+    }
+    printf("%s\n    {\"workload\": \"%s\", \"engine\": \"%s\", \"instructions\": %llu, \"ns\": [",
+           first?"":",",name,engine_names[vm->engine],(unsigned long long)instructions);
+    for(int i=0;i<BENCH_RUNS;++i){
+        printf("%s%llu",i?", ":"",(unsigned long long)ns[i]);
+    }
+    qsort(ns,BENCH_RUNS,sizeof(uint64_t),compare_u64);
+    uint64_t median=ns[BENCH_RUNS/2];
+    printf("], \"median_ns\": %llu, \"mips\": %.2f, \"ns_per_instruction\": %.3f, \"mips_variance\": %.3f}",
+           (unsigned long long)median,instructions*1000.0/median,(double)median/instructions,variance);
+    fflush(stdout);
+    return 1;
+}
+
+/* a fresh machine with headless input and output */
+lc3_vm* bench_vm(int engine,int output_policy,char* script){
+    lc3_vm* vm=lc3_vm_create();
+    if(!vm){
+        return NULL;
+    }
+    vm->engine=engine;
+    vm->output_policy=output_policy;
+    vm->in=fmemopen(script,BENCH_SCRIPT,"rb");
+    vm->out=fopen("/dev/null","wb");
+    if(!vm->in||!vm->out){
+        if(vm->in){
+            fclose(vm->in);
+        }
+        if(vm->out){
+            fclose(vm->out);
+        }
+        lc3_vm_destroy(vm);
+        return NULL;
+    }
+    return vm;
+}
+
+void bench_vm_destroy(lc3_vm* vm){
+    fclose(vm->in);
+    fclose(vm->out);
+    lc3_vm_destroy(vm);
+}
+
+/* every kernel and then every game image on each engine, or only on
+ * engine if it is not negative. returns nonzero if anything failed */
+int run_bench(int engine,int output_policy,char* const* games,int game_count){
+    char* script=malloc(BENCH_SCRIPT);
+    int failed=0,first=1;
+    if(!script){
+        return 1;
+    }
+    bench_script(script,BENCH_SCRIPT);
+    printf("{\n  \"warmup\": %d,\n  \"runs\": %d,\n",BENCH_WARMUP,BENCH_RUNS);
+#ifdef __VERSION__
+    printf("  \"compiler\": \"%s\",\n",__VERSION__);
+#endif
+    printf("  \"results\": [");
+    for(int e=0;e<ENGINE_COUNT;++e){
+        if(engine>=0&&e!=engine){
+            continue;
+        }
+        for(int k=0;k<BENCH_KERNELS+game_count;++k){
+            lc3_vm* vm=bench_vm(e,output_policy,script);
+            if(!vm){
+                failed=1;
+                continue;
+            }
+            const char* name;
+            uint64_t instructions;
+            int loaded=1;
+            if(k<BENCH_KERNELS){
+                const bench_kernel* kernel=&bench_kernels[k];
+                name=kernel->name;
+                instructions=BENCH_KERNEL_INSTRUCTIONS;
+                memcpy(vm->memory+PC_START,kernel->code,kernel->words*sizeof(uint16_t));
+                mark_dirty(vm,PC_START,kernel->words);
+            }else{
+                name=games[k-BENCH_KERNELS];
+                instructions=BENCH_GAME_INSTRUCTIONS;
+                loaded=read_images(vm,games+k-BENCH_KERNELS,1);
+            }
+            if(!loaded||!bench_workload(vm,name,instructions,first)){
+                failed=1;
+            }else{
+                first=0;
+            }
+            bench_vm_destroy(vm);
+        }
+    }
+    printf("\n  ]\n}\n");
+    free(script);
+    return failed;
+}
+
+#endif
+
+/** Tests **/
+
+/* the machine the tests run on, reset before each one */
+lc3_vm* test_vm;
+
+/* runs a single instruction on the engine under test */
+int step() {
+  return run_engine(test_vm, 1);
+}
+
+int test_add_instr_1() {
+  lc3_vm* vm = test_vm;
+  int pass = 1;
+
+  uint16_t add_instr =
+    ((OP_ADD & 0xf) << 12) |
+    ((R_R0 & 0x7) << 9)    |
+    ((R_R1 & 0x7) << 6)    |
+    (R_R2 & 0x7);
+
+  vm->memory[0x3000] = add_instr;
+  vm->reg[R_R1] = 1;
+  vm->reg[R_R2] = 2;
+
+  int result = step();
+  if (result != 1) {
+    printf("Expected return value to be 1, got %d\n", result);
+    pass = 0;
+  }
+
+  if (vm->reg[R_R0] != 3) {
+    printf("Expected register 0 to contain 3, got %d\n", vm->reg[R_R0]);
+    pass = 0;
+  }
+
+  if (cond_flags(vm) != FL_POS) {
+    printf("Expected condition flags to be %d, got %d\n", FL_POS, cond_flags(vm));
+    pass = 0;
+  }
+
+  return pass;
+}
+
+int test_add_instr_2() {
+  lc3_vm* vm = test_vm;
+  int pass = 1;
+
+  uint16_t add_instr =
     ((OP_ADD & 0xf) << 12) |
     ((R_R0 & 0x7) << 9)    |
     ((R_R1 & 0x7) << 6)    |
-    (R_R2 & 0x7);
+    (1 << 5) |
+    0x2;
+
+  vm->memory[0x3000] = add_instr;
+  vm->reg[R_R1] = 1;
+
+  int result = step();
+  if (result != 1) {
+    printf("Expected return value to be 1, got %d\n", result);
+    pass = 0;
+  }
+
+  if (vm->reg[R_R0] != 3) {
+    printf("Expected register 0 to contain 3, got %d\n", vm->reg[R_R0]);
+    pass = 0;
+  }
+
+  if (cond_flags(vm) != FL_POS) {
+    printf("Expected condition flags to be %d, got %d\n", FL_POS, cond_flags(vm));
+    pass = 0;
+  }
+
+  return pass;
+}
+
+int test_and_instr_1() {
+  lc3_vm* vm = test_vm;
+  int pass = 1;
+
+  uint16_t and_instr =
+    ((OP_AND & 0xf) << 12) |
+    ((R_R0 & 0x7) << 9)    |
+    ((R_R1 & 0x7) << 6)    |
+    (R_R2 & 0x7);
+
+  vm->memory[0x3000] = and_instr;
+  vm->reg[R_R1] = 0xff;
+  vm->reg[R_R2] = 0xf0;
+
+  int result = step();
+  if (result != 1) {
+    printf("Expected return value to be 1, got %d\n", result);
+    pass = 0;
+  }
+
+  if (vm->reg[R_R0] != 0xf0) {
+    printf("Expected register 0 to contain %d, got %d\n", 0xf0, vm->reg[R_R0]);
+    pass = 0;
+  }
+
+  if (cond_flags(vm) != FL_POS) {
+    printf("Expected condition flags to be %d, got %d\n", FL_POS, cond_flags(vm));
+    pass = 0;
+  }
+
+  return pass;
+}
+
+int test_and_instr_2() {
+  lc3_vm* vm = test_vm;
+  int pass = 1;
+
+  uint16_t and_instr =
+    ((OP_AND & 0xf) << 12) |
+    ((R_R0 & 0x7) << 9)    |
+    ((R_R1 & 0x7) << 6)    |
+    (1 << 5) |
+    0x0f;
+
+  vm->memory[0x3000] = and_instr;
+  vm->reg[R_R1] = 0xff;
+
+  int result = step();
+  if (result != 1) {
+    printf("Expected return value to be 1, got %d\n", result);
+    pass = 0;
+  }
+
+  if (vm->reg[R_R0] != 0x0f) {
+    printf("Expected register 0 to contain %d, got %d\n", 0x0f, vm->reg[R_R0]);
+    pass = 0;
+  }
+
+  if (cond_flags(vm) != FL_POS) {
+    printf("Expected condition flags to be %d, got %d\n", FL_POS, cond_flags(vm));
+    pass = 0;
+  }
+
+  return pass;
+}
+
+int test_not_instr() {
+  lc3_vm* vm = test_vm;
+  int pass = 1;
+
+  uint16_t not_instr =
+    ((OP_NOT & 0xf) << 12) |
+    ((R_R0 & 0x7) << 9)    |
+    ((R_R1 & 0x7) << 6)    |
+    0x3f;
+
+  vm->memory[0x3000] = not_instr;
+  vm->reg[R_R1] = 0xf;
+
+  int result = step();
+  if (result != 1) {
+    printf("Expected return value to be 1, got %d\n", result);
+    pass = 0;
+  }
+
+  if (vm->reg[R_R0] != 0xfff0) {
+    printf("Expected register 0 to contain %d, got %d\n", 0xfff0, vm->reg[R_R0]);
+    pass = 0;
+  }
+
+  if (cond_flags(vm) != FL_NEG) {
+    printf("Expected condition flags to be %d, got %d\n", FL_NEG, cond_flags(vm));
+    pass = 0;
+  }
+
+  return pass;
+}
+
+int test_br_instr_1() {
+  lc3_vm* vm = test_vm;
+  int pass = 1;
+
+  uint16_t br_instr =
+    ((OP_BR & 0xf) << 12) |
+    (1 << 11) |
+    0x123;
+
+  vm->memory[0x3000] = br_instr;
+
+  /* BRn is not taken under Z or P */
+  uint16_t flags[] = {FL_ZRO, FL_POS};
+  for (int i = 0; i < 2; ++i) {
+    vm->reg[R_PC] = 0x3000;
+    set_cond_flags(vm, flags[i]);
+    int result = step();
+    if (result != 1) {
+      printf("Expected return value to be 1, got %d\n", result);
+      pass = 0;
+    }
+
+    if (vm->reg[R_PC] != 0x3001) {
+      printf("Expected program counter to contain %d under flags %d, got %d\n", 0x3001, flags[i], vm->reg[R_PC]);
+      pass = 0;
+    }
+  }
+
+  return pass;
+}
+
+int test_br_instr_2() {
+  lc3_vm* vm = test_vm;
+  int pass = 1;
+
+  uint16_t br_instr =
+    ((OP_BR & 0xf) << 12) |
+    (1 << 11) |
+    0x0ff;
+
+  vm->memory[0x3000] = br_instr;
+
+  set_cond_flags(vm, FL_NEG);
+  int result = step();
+  if (result != 1) {
+    printf("Expected return value to be 1, got %d\n", result);
+    pass = 0;
+  }
+
+  if (vm->reg[R_PC] != 0x3100) {
+    printf("Expected program counter to contain %d, got %d\n", 0x3100, vm->reg[R_PC]);
+    pass = 0;
+  }
+
+  return pass;
+}
+
+int test_br_instr_3() {
+  lc3_vm* vm = test_vm;
+  int pass = 1;
+
+  uint16_t br_instr =
+    ((OP_BR & 0xf) << 12) |
+    (1 << 10) |
+    0x0ff;
+
+  vm->memory[0x3000] = br_instr;
+
+  set_cond_flags(vm, FL_ZRO);
+  int result = step();
+  if (result != 1) {
+    printf("Expected return value to be 1, got %d\n", result);
+    pass = 0;
+  }
+
+  if (vm->reg[R_PC] != 0x3100) {
+    printf("Expected program counter to contain %d, got %d\n", 0x3100, vm->reg[R_PC]);
+    pass = 0;
+  }
+
+  return pass;
+}
+
+int test_br_instr_4() {
+  lc3_vm* vm = test_vm;
+  int pass = 1;
+
+  uint16_t br_instr =
+    ((OP_BR & 0xf) << 12) |
+    (1 << 9) |
+    0x0ff;
+
+  vm->memory[0x3000] = br_instr;
+
+  set_cond_flags(vm, FL_POS);
+  int result = step();
+  if (result != 1) {
+    printf("Expected return value to be 1, got %d\n", result);
+    pass = 0;
+  }
+
+  if (vm->reg[R_PC] != 0x3100) {
+    printf("Expected program counter to contain %d, got %d\n", 0x3100, vm->reg[R_PC]);
+    pass = 0;
+  }
+
+  return pass;
+}
+
+int test_jmp_instr() {
+  lc3_vm* vm = test_vm;
+  int pass = 1;
+
+  uint16_t jmp_instr =
+    ((OP_JMP & 0xf) << 12) |
+    ((R_R0 & 0x7) << 6);
+
+  vm->memory[0x3000] = jmp_instr;
+  vm->reg[R_R0] = 0x1234;
+
+  int result = step();
+  if (result != 1) {
+    printf("Expected return value to be 1, got %d\n", result);
+    pass = 0;
+  }
+
+  if (vm->reg[R_PC] != 0x1234) {
+    printf("Expected program counter to contain %d, got %d\n", 0x1234, vm->reg[R_PC]);
+    pass = 0;
+  }
+
+  return pass;
+}
+
+int test_jsr_instr_1() {
+  lc3_vm* vm = test_vm;
+  int pass = 1;
+
+  uint16_t jsr_instr =
+    ((OP_JSR & 0xf) << 12) |
+    (1 << 11) |
+    0xff;
+
+  vm->memory[0x3000] = jsr_instr;
+
+  int result = step();
+  if (result != 1) {
+    printf("Expected return value to be 1, got %d\n", result);
+    pass = 0;
+  }
+
+  if (vm->reg[R_PC] != 0x3100) {
+    printf("Expected program counter to contain %d, got %d\n", 0x3100, vm->reg[R_PC]);
+    pass = 0;
+  }
+
+  if (vm->reg[R_R7] != 0x3001) {
+    printf("Expected register 7 to contain %d, got %d\n", 0x3001, vm->reg[R_R7]);
+    pass = 0;
+  }
+
+  return pass;
+}
+
+int test_jsr_instr_2() {
+  lc3_vm* vm = test_vm;
+  int pass = 1;
+
+  uint16_t jsr_instr =
+    ((OP_JSR & 0xf) << 12) |
+    ((R_R0 & 0x7) << 6);
+
+  vm->memory[0x3000] = jsr_instr;
+  vm->reg[R_R0] = 0x1234;
+
+  int result = step();
+  if (result != 1) {
+    printf("Expected return value to be 1, got %d\n", result);
+    pass = 0;
+  }
+
+  if (vm->reg[R_PC] != 0x1234) {
+    printf("Expected program counter to contain %d, got %d\n", 0x1234, vm->reg[R_PC]);
+    pass = 0;
+  }
+
+  if (vm->reg[R_R7] != 0x3001) {
+    printf("Expected register 7 to contain %d, got %d\n", 0x3001, vm->reg[R_R7]);
+    pass = 0;
+  }
+
+  return pass;
+}
+
+int test_ld_instr() {
+  lc3_vm* vm = test_vm;
+  int pass = 1;
+
+  uint16_t ld_instr =
+    ((OP_LD & 0xf) << 12) |
+    ((R_R0 & 0x7) << 9)   |
+    0xff;
+
+  vm->memory[0x3000] = ld_instr;
+  vm->memory[0x3100] = 0x123;
+
+  int result = step();
+  if (result != 1) {
+    printf("Expected return value to be 1, got %d\n", result);
+    pass = 0;
+  }
+
+  if (vm->reg[R_R0] != 0x123) {
+    printf("Expected register 0 to contain %d, got %d\n", 0x123, vm->reg[R_R0]);
+    pass = 0;
+  }
+
+  if (cond_flags(vm) != FL_POS) {
+    printf("Expected condition flags to be %d, got %d\n", FL_POS, cond_flags(vm));
+    pass = 0;
+  }
+
+  return pass;
+}
+
+int test_ldi_instr() {
+  lc3_vm* vm = test_vm;
+  int pass = 1;
+
+  uint16_t ldi_instr =
+    ((OP_LDI & 0xf) << 12) |
+    ((R_R0 & 0x7) << 9)   |
+    0xff;
+
+  vm->memory[0x3000] = ldi_instr;
+  vm->memory[0x3100] = 0x3200;
+  vm->memory[0x3200] = 0x123;
+
+  int result = step();
+  if (result != 1) {
+    printf("Expected return value to be 1, got %d\n", result);
+    pass = 0;
+  }
+
+  if (vm->reg[R_R0] != 0x123) {
+    printf("Expected register 0 to contain %d, got %d\n", 0x123, vm->reg[R_R0]);
+    pass = 0;
+  }
+
+  if (cond_flags(vm) != FL_POS) {
+    printf("Expected condition flags to be %d, got %d\n", FL_POS, cond_flags(vm));
+    pass = 0;
+  }
+
+  return pass;
+}
+
+int test_ldr_instr() {
+  lc3_vm* vm = test_vm;
+  int pass = 1;
+
+  uint16_t ldr_instr =
+    ((OP_LDR & 0xf) << 12) |
+    ((R_R0 & 0x7) << 9)    |
+    ((R_R1 & 0x7) << 6)    |
+    0xf;
 
-  memory[0x3000] = add_instr;
-  reg[R_R1] = 1;
-  reg[R_R2] = 2;
+  vm->memory[0x3000] = ldr_instr;
+  vm->reg[R_R1] = 0x31f1;
+  vm->memory[0x3200] = 0x123;
 
-  int result = read_and_execute_instruction();
+  int result = step();
   if (result != 1) {
     printf("Expected return value to be 1, got %d\n", result);
     pass = 0;
   }
 
-  if (reg[R_R0] != 3) {
-    printf("Expected register 0 to contain 3, got %d\n", reg[R_R0]);
+  if (vm->reg[R_R0] != 0x123) {
+    printf("Expected register 0 to contain %d, got %d\n", 0x123, vm->reg[R_R0]);
     pass = 0;
   }
 
-  if (reg[R_COND] != FL_POS) {
-    printf("Expected condition flags to be %d, got %d\n", FL_POS, reg[R_COND]);
+  if (cond_flags(vm) != FL_POS) {
+    printf("Expected condition flags to be %d, got %d\n", FL_POS, cond_flags(vm));
     pass = 0;
   }
 
   return pass;
 }
 
-int test_add_instr_2() {
+int test_lea_instr() {
+  lc3_vm* vm = test_vm;
   int pass = 1;
 
-  uint16_t add_instr =
-    ((OP_ADD & 0xf) << 12) |
+  uint16_t lea_instr =
+    ((OP_LEA & 0xf) << 12) |
+    ((R_R0 & 0x7) << 9)    |
+    0xff;
+
+  vm->memory[0x3000] = lea_instr;
+
+  int result = step();
+  if (result != 1) {
+    printf("Expected return value to be 1, got %d\n", result);
+    pass = 0;
+  }
+
+  if (vm->reg[R_R0] != 0x3100) {
+    printf("Expected register 0 to contain %d, got %d\n", 0x3100, vm->reg[R_R0]);
+    pass = 0;
+  }
+
+  if (cond_flags(vm) != FL_POS) {
+    printf("Expected condition flags to be %d, got %d\n", FL_POS, cond_flags(vm));
+    pass = 0;
+  }
+
+  return pass;
+}
+
+int test_st_instr() {
+  lc3_vm* vm = test_vm;
+  int pass = 1;
+
+  uint16_t st_instr =
+    ((OP_ST & 0xf) << 12) |
+    ((R_R0 & 0x7) << 9)    |
+    0xff;
+
+  vm->memory[0x3000] = st_instr;
+  vm->reg[R_R0] = 0x123;
+
+  int result = step();
+  if (result != 1) {
+    printf("Expected return value to be 1, got %d\n", result);
+    pass = 0;
+  }
+
+  if (vm->memory[0x3100] != 0x123) {
+    printf("Expected vm->memory location %d to contain %d, got %d\n", 0x3100, 0x123, vm->reg[R_R0]);
+    pass = 0;
+  }
+
+  return pass;
+}
+
+int test_sti_instr() {
+  lc3_vm* vm = test_vm;
+  int pass = 1;
+
+  uint16_t sti_instr =
+    ((OP_STI & 0xf) << 12) |
+    ((R_R0 & 0x7) << 9)    |
+    0xff;
+
+  vm->memory[0x3000] = sti_instr;
+  vm->memory[0x3100] = 0x3200;
+  vm->reg[R_R0] = 0x123;
+
+  int result = step();
+  if (result != 1) {
+    printf("Expected return value to be 1, got %d\n", result);
+    pass = 0;
+  }
+
+  if (vm->memory[0x3200] != 0x123) {
+    printf("Expected vm->memory location %d to contain %d, got %d\n", 0x3200, 0x123, vm->reg[R_R0]);
+    pass = 0;
+  }
+
+  return pass;
+}
+
+int test_str_instr() {
+  lc3_vm* vm = test_vm;
+  int pass = 1;
+
+  uint16_t str_instr =
+    ((OP_STR & 0xf) << 12) |
     ((R_R0 & 0x7) << 9)    |
     ((R_R1 & 0x7) << 6)    |
-    (1 << 5) |
-    0x2;
+    0xf;
+
+  vm->memory[0x3000] = str_instr;
+  vm->reg[R_R0] = 0x123;
+  vm->reg[R_R1] = 0x31f1;
+
+  int result = step();
+  if (result != 1) {
+    printf("Expected return value to be 1, got %d\n", result);
+    pass = 0;
+  }
+
+  if (vm->memory[0x3200] != 0x123) {
+    printf("Expected vm->memory location %d to contain %d, got %d\n", 0x3200, 0x123, vm->reg[R_R0]);
+    pass = 0;
+  }
+
+  return pass;
+}
+
+int test_trap_getc() {
+  lc3_vm* vm = test_vm;
+  int pass = 1;
+
+  uint16_t trap_getc_instr =
+    ((OP_TRAP & 0xf) << 12) |
+    (TRAP_GETC & 0xff);
+
+  char in_buf[] = {'x'};
+  char out_buf[256] = {0};
+  FILE *in = fmemopen(in_buf, sizeof(in_buf), "r");
+  FILE *out = fmemopen(out_buf, sizeof(out_buf), "w");
+
+  int result = execute_trap(vm, trap_getc_instr, in, out);
+  fclose(in);
+  fclose(out);
+
+  if (result != 1) {
+    printf("Expected return value to be 1, got %d\n", result);
+    pass = 0;
+  }
+
+  if (vm->reg[R_R0] != 'x') {
+    printf("Expected register 0 to contain %d, got %d\n", 'x', vm->reg[R_R0]);
+    pass = 0;
+  }
+
+  if (out_buf[0] != 0) {
+    printf("Expected output buffer to contain %d, got %d\n", 0, out_buf[0]);
+    pass = 0;
+  }
+
+  return pass;
+}
+
+int test_trap_out() {
+  lc3_vm* vm = test_vm;
+  int pass = 1;
+
+  uint16_t trap_out_instr =
+    ((OP_TRAP & 0xf) << 12) |
+    (TRAP_OUT & 0xff);
+
+  char in_buf[] = {0};
+  char out_buf[256];
+  FILE *in = fmemopen(in_buf, sizeof(in_buf), "r");
+  FILE *out = fmemopen(out_buf, sizeof(out_buf), "w");
+
+  vm->reg[R_R0] = 'x';
+
+  int result = execute_trap(vm, trap_out_instr, in, out);
+  fclose(in);
+  fclose(out);
+
+  if (result != 1) {
+    printf("Expected return value to be 1, got %d\n", result);
+    pass = 0;
+  }
+
+  if (out_buf[0] != 'x') {
+    printf("Expected output buffer to contain %d, got %d\n", 'x', out_buf[0]);
+    pass = 0;
+  }
+
+  return pass;
+}
+
+int test_trap_puts() {
+  lc3_vm* vm = test_vm;
+  int pass = 1;
+
+  uint16_t trap_puts_instr =
+    ((OP_TRAP & 0xf) << 12) |
+    (TRAP_PUTS & 0xff);
+
+  char in_buf[] = {0};
+  char out_buf[256];
+  FILE *in = fmemopen(in_buf, sizeof(in_buf), "r");
+  FILE *out = fmemopen(out_buf, sizeof(out_buf), "w");
+
+  vm->reg[R_R0] = 0x3100;
+  vm->memory[0x3100] = 'h';
+  vm->memory[0x3101] = 'e';
+  vm->memory[0x3102] = 'y';
+  vm->memory[0x3103] = 0;
+
+  int result = execute_trap(vm, trap_puts_instr, in, out);
+  fclose(in);
+  fclose(out);
+
+  if (result != 1) {
+    printf("Expected return value to be 1, got %d\n", result);
+    pass = 0;
+  }
+
+  if (strncmp(out_buf, "hey", 3) != 0) {
+    printf("Expected output buffer to contain %s, got %s\n", "hey", out_buf);
+    pass = 0;
+  }
+
+  return pass;
+}
+
+int test_trap_in() {
+  lc3_vm* vm = test_vm;
+  int pass = 1;
+
+  uint16_t trap_in_instr =
+    ((OP_TRAP & 0xf) << 12) |
+    (TRAP_IN & 0xff);
+
+  char in_buf[] = {'x'};
+  char out_buf[256];
+  FILE *in = fmemopen(in_buf, sizeof(in_buf), "r");
+  FILE *out = fmemopen(out_buf, sizeof(out_buf), "w");
 
-  memory[0x3000] = add_instr;
-  reg[R_R1] = 1;
+  int result = execute_trap(vm, trap_in_instr, in, out);
+  fclose(in);
+  fclose(out);
 
-  int result = read_and_execute_instruction();
   if (result != 1) {
     printf("Expected return value to be 1, got %d\n", result);
     pass = 0;
   }
 
-  if (reg[R_R0] != 3) {
-    printf("Expected register 0 to contain 3, got %d\n", reg[R_R0]);
+  if (vm->reg[R_R0] != 'x') {
+    printf("Expected register 0 to contain %d, got %d\n", 'x', vm->reg[R_R0]);
+  }
+
+  if (strncmp(out_buf, "Enter a character: x", 27) != 0) {
+    printf("Expected output buffer to contain %s, got %s\n", "Enter a character: x", out_buf);
+    pass = 0;
+  }
+
+  return pass;
+}
+
+int test_trap_putsp() {
+  lc3_vm* vm = test_vm;
+  int pass = 1;
+
+  uint16_t trap_putsp_instr =
+    ((OP_TRAP & 0xf) << 12) |
+    (TRAP_PUTSP & 0xff);
+
+  char in_buf[] = {0};
+  char out_buf[256];
+  FILE *in = fmemopen(in_buf, sizeof(in_buf), "r");
+  FILE *out = fmemopen(out_buf, sizeof(out_buf), "w");
+
+  vm->reg[R_R0] = 0x3100;
+  vm->memory[0x3100] = 'h' | ('e' << 8);
+  vm->memory[0x3101] = 'y' | (' ' << 8);
+  vm->memory[0x3102] = 'd' | ('u' << 8);
+  vm->memory[0x3103] = 'd' | ('e' << 8);
+  vm->memory[0x3104] = 0;
+
+  int result = execute_trap(vm, trap_putsp_instr, in, out);
+  fclose(in);
+  fclose(out);
+
+  if (result != 1) {
+    printf("Expected return value to be 1, got %d\n", result);
     pass = 0;
   }
 
-  if (reg[R_COND] != FL_POS) {
-    printf("Expected condition flags to be %d, got %d\n", FL_POS, reg[R_COND]);
+  if (strncmp(out_buf, "hey dude", 8) != 0) {
+    printf("Expected output buffer to contain %s, got %s\n", "hey dude", out_buf);
     pass = 0;
   }
 
   return pass;
 }
 
-int test_and_instr_1() {
+int test_trap_halt() {
+  lc3_vm* vm = test_vm;
   int pass = 1;
 
-  uint16_t and_instr =
-    ((OP_AND & 0xf) << 12) |
-    ((R_R0 & 0x7) << 9)    |
-    ((R_R1 & 0x7) << 6)    |
-    (R_R2 & 0x7);
+  uint16_t trap_halt_instr =
+    ((OP_TRAP & 0xf) << 12) |
+    (TRAP_HALT & 0xff);
 
-  memory[0x3000] = and_instr;
-  reg[R_R1] = 0xff;
-  reg[R_R2] = 0xf0;
+  char in_buf[] = {0};
+  char out_buf[256];
+  FILE *in = fmemopen(in_buf, sizeof(in_buf), "r");
+  FILE *out = fmemopen(out_buf, sizeof(out_buf), "w");
 
-  int result = read_and_execute_instruction();
-  if (result != 1) {
-    printf("Expected return value to be 1, got %d\n", result);
-    pass = 0;
-  }
+  int result = execute_trap(vm, trap_halt_instr, in, out);
+  fclose(in);
+  fclose(out);
 
-  if (reg[R_R0] != 0xf0) {
-    printf("Expected register 0 to contain %d, got %d\n", 0xf0, reg[R_R0]);
+  if (result != 0) {
+    printf("Expected return value to be 0, got %d\n", result);
     pass = 0;
   }
 
-  if (reg[R_COND] != FL_POS) {
-    printf("Expected condition flags to be %d, got %d\n", FL_POS, reg[R_COND]);
+  if (strncmp(out_buf, "HALT", 8) != 0) {
+    printf("Expected output buffer to contain %s, got %s\n", "hey dude", out_buf);
     pass = 0;
   }
 
   return pass;
 }
 
-int test_and_instr_2() {
+int test_decode_invalidate() {
+  lc3_vm* vm = test_vm;
   int pass = 1;
 
-  uint16_t and_instr =
-    ((OP_AND & 0xf) << 12) |
+  uint16_t add_instr =
+    ((OP_ADD & 0xf) << 12) |
     ((R_R0 & 0x7) << 9)    |
-    ((R_R1 & 0x7) << 6)    |
+    ((R_R0 & 0x7) << 6)    |
     (1 << 5) |
-    0x0f;
+    0x1;
 
-  memory[0x3000] = and_instr;
-  reg[R_R1] = 0xff;
+  uint16_t not_instr =
+    ((OP_NOT & 0xf) << 12) |
+    ((R_R0 & 0x7) << 9)    |
+    ((R_R0 & 0x7) << 6)    |
+    0x3f;
 
-  int result = read_and_execute_instruction();
-  if (result != 1) {
-    printf("Expected return value to be 1, got %d\n", result);
-    pass = 0;
-  }
+  vm->memory[0x3000] = add_instr;
+  step();
 
-  if (reg[R_R0] != 0x0f) {
-    printf("Expected register 0 to contain %d, got %d\n", 0x0f, reg[R_R0]);
-    pass = 0;
-  }
+  /* overwrite the cached instruction and run it again */
+  mem_write(vm, 0x3000, not_instr);
+  vm->reg[R_PC] = 0x3000;
+  step();
 
-  if (reg[R_COND] != FL_POS) {
-    printf("Expected condition flags to be %d, got %d\n", FL_POS, reg[R_COND]);
+  if (vm->reg[R_R0] != 0xfffe) {
+    printf("Expected register 0 to contain %d, got %d\n", 0xfffe, vm->reg[R_R0]);
     pass = 0;
   }
 
   return pass;
 }
 
-int test_not_instr() {
+int test_program_loop() {
+  lc3_vm* vm = test_vm;
   int pass = 1;
 
-  uint16_t not_instr =
-    ((OP_NOT & 0xf) << 12) |
-    ((R_R0 & 0x7) << 9)    |
-    ((R_R1 & 0x7) << 6)    |
-    0x3f;
-
-  memory[0x3000] = not_instr;
-  reg[R_R1] = 0xf;
+  /* exercises the fused forms: constant, counted loop, pop */
+  uint16_t program[] = {
+    0x5020, /* AND R0, R0, #0 */
+    0x1025, /* ADD R0, R0, #5 */
+    0xEC0D, /* LEA R6, x3010 */
+    0x1261, /* ADD R1, R1, #1 */
+    0x103F, /* ADD R0, R0, #-1 */
+    0x03FD, /* BRp x3003 */
+    0x6580, /* LDR R2, R6, #0 */
+    0x1DA1, /* ADD R6, R6, #1 */
+    0xF025, /* HALT */
+  };
+  memcpy(vm->memory + 0x3000, program, sizeof(program));
+  vm->memory[0x3010] = 42;
 
-  int result = read_and_execute_instruction();
+  /* stop right before the HALT */
+  int result = run_engine(vm, 20);
   if (result != 1) {
     printf("Expected return value to be 1, got %d\n", result);
     pass = 0;
   }
 
-  if (reg[R_R0] != 0xfff0) {
-    printf("Expected register 0 to contain %d, got %d\n", 0xfff0, reg[R_R0]);
+  if (vm->reg[R_PC] != 0x3008) {
+    printf("Expected program counter to contain %d, got %d\n", 0x3008, vm->reg[R_PC]);
+    pass = 0;
+  }
+
+  if (vm->reg[R_R0] != 0 || vm->reg[R_R1] != 5 || vm->reg[R_R2] != 42 || vm->reg[R_R6] != 0x3011) {
+    printf("Expected registers 0, 5, 42, %d, got %d, %d, %d, %d\n", 0x3011,
+           vm->reg[R_R0], vm->reg[R_R1], vm->reg[R_R2], vm->reg[R_R6]);
     pass = 0;
   }
 
-  if (reg[R_COND] != FL_NEG) {
-    printf("Expected condition flags to be %d, got %d\n", FL_NEG, reg[R_COND]);
+  if (cond_flags(vm) != FL_POS) {
+    printf("Expected condition flags to be %d, got %d\n", FL_POS, cond_flags(vm));
     pass = 0;
   }
 
   return pass;
 }
 
-int test_br_instr_1() {
+int test_self_modifying() {
+  lc3_vm* vm = test_vm;
   int pass = 1;
 
-  uint16_t br_instr =
-    ((OP_BR & 0xf) << 12) |
-    (1 << 11) |
-    0x123;
-
-  memory[0x3000] = br_instr;
-
-  /* nothing should happen */
-  reg[R_COND] = 0;
-  int result = read_and_execute_instruction();
-  if (result != 1) {
-    printf("Expected return value to be 1, got %d\n", result);
-    pass = 0;
-  }
-
-  if (reg[R_PC] != 0x3001) {
-    printf("Expected program counter to contain %d, got %d\n", 0x3001, reg[R_PC]);
+  uint16_t program[] = {
+    0x3201, /* ST R1, x3002 */
+    0x1021, /* ADD R0, R0, #1 */
+    0x1022, /* ADD R0, R0, #2, replaced by the ST */
+    0x0FFF, /* BRnzp x3003 */
+  };
+  memcpy(vm->memory + 0x3000, program, sizeof(program));
+  vm->reg[R_R1] = 0x1024; /* ADD R0, R0, #4 */
+
+  /* translate the original block first */
+  run_engine(vm, 4);
+  vm->reg[R_PC] = 0x3000;
+  vm->reg[R_R0] = 0;
+  vm->memory[0x3002] = 0x1022;
+  invalidate_code(vm, 0x3002);
+
+  run_engine(vm, 4);
+  if (vm->reg[R_R0] != 5) {
+    printf("Expected register 0 to contain %d, got %d\n", 5, vm->reg[R_R0]);
     pass = 0;
   }
 
   return pass;
 }
 
-int test_br_instr_2() {
+int test_full_block() {
+  lc3_vm* vm = test_vm;
   int pass = 1;
 
-  uint16_t br_instr =
-    ((OP_BR & 0xf) << 12) |
-    (1 << 11) |
-    0x0ff;
-
-  memory[0x3000] = br_instr;
+  /* MAX_BLOCK_LEN instructions that do not fuse, then the exit */
+  for (int i = 0; i < MAX_BLOCK_LEN; i++) {
+    vm->memory[0x3000 + i] = 0x1021; /* ADD R0, R0, #1 */
+  }
+  vm->memory[0x3000 + MAX_BLOCK_LEN] = 0xF025; /* HALT */
+  vm->out = fopen("/dev/null", "w");
 
-  reg[R_COND] = FL_NEG;
-  int result = read_and_execute_instruction();
-  if (result != 1) {
-    printf("Expected return value to be 1, got %d\n", result);
+  block* b = translate_block(vm, 0x3000);
+  if (!b || b->len != MAX_BLOCK_LEN) {
+    printf("Expected a block of %d instructions, got %d\n", MAX_BLOCK_LEN, b ? b->len : 0);
     pass = 0;
   }
-
-  if (reg[R_PC] != 0x3100) {
-    printf("Expected program counter to contain %d, got %d\n", 0x3100, reg[R_PC]);
+  if (run_engine(vm, MAX_BLOCK_LEN + 1) || vm->reg[R_R0] != MAX_BLOCK_LEN) {
+    printf("Expected register 0 to contain %d, got %d\n", MAX_BLOCK_LEN, vm->reg[R_R0]);
     pass = 0;
   }
 
+  fclose(vm->out);
+  vm->out = stdout;
   return pass;
 }
 
-int test_br_instr_3() {
+int test_jit_threshold() {
+  lc3_vm* vm = test_vm;
   int pass = 1;
 
-  uint16_t br_instr =
-    ((OP_BR & 0xf) << 12) |
-    (1 << 10) |
-    0x0ff;
-
-  memory[0x3000] = br_instr;
+  uint16_t program[] = {
+    0x2204, /* LD R1, x3005 */
+    0x14A1, /* ADD R2, R2, #1 */
+    0x127F, /* ADD R1, R1, #-1 */
+    0x03FD, /* BRp x3001 */
+    0xF025, /* HALT */
+    3 * JIT_THRESHOLD,
+  };
+  memcpy(vm->memory + 0x3000, program, sizeof(program));
+  vm->out = fopen("/dev/null", "w");
+
+  /* run_tests compiles on the first hit, this takes the default path.
+   * with the arena nearly full the first compile overflows, the arena
+   * is flushed and the loop is compiled again a threshold later */
+  int threshold = jit_threshold;
+  jit_threshold = JIT_THRESHOLD;
+#ifdef HAVE_JIT
+  vm->jit_used = JIT_ARENA_SIZE - 16;
+#endif
+  while (run_engine(vm, 1000)) {
+  }
+  jit_threshold = threshold;
 
-  reg[R_COND] = FL_ZRO;
-  int result = read_and_execute_instruction();
-  if (result != 1) {
-    printf("Expected return value to be 1, got %d\n", result);
+  if (vm->reg[R_R2] != 3 * JIT_THRESHOLD) {
+    printf("Expected register 2 to contain %d, got %d\n", 3 * JIT_THRESHOLD, vm->reg[R_R2]);
     pass = 0;
   }
-
-  if (reg[R_PC] != 0x3100) {
-    printf("Expected program counter to contain %d, got %d\n", 0x3100, reg[R_PC]);
+#ifdef HAVE_JIT
+  if (vm->engine == ENGINE_JIT &&
+      (!vm->blocks[0x3001] || !vm->blocks[0x3001]->native || vm->jit_used >= JIT_ARENA_SIZE - 16)) {
+    printf("Expected the loop to be compiled again after a flush, %zu bytes used\n", vm->jit_used);
     pass = 0;
   }
+#endif
 
+  fclose(vm->out);
+  vm->out = stdout;
   return pass;
 }
 
-int test_br_instr_4() {
+typedef struct {
+  int reads;
+  uint16_t write_address, write_val;
+} test_device_state;
+
+uint16_t test_device_read(lc3_vm* vm, void* ctx, uint16_t address) {
+  ((test_device_state*)ctx)->reads++;
+  return address ^ 0x5555;
+}
+
+void test_device_write(lc3_vm* vm, void* ctx, uint16_t address, uint16_t val) {
+  ((test_device_state*)ctx)->write_address = address;
+  ((test_device_state*)ctx)->write_val = val;
+}
+
+int test_device_page() {
+  lc3_vm* vm = test_vm;
   int pass = 1;
 
-  uint16_t br_instr =
-    ((OP_BR & 0xf) << 12) |
-    (1 << 9) |
-    0x0ff;
+  test_device_state state = {0};
+  lc3_map_device(vm, 0x40, (lc3_device){test_device_read, test_device_write, &state});
 
-  memory[0x3000] = br_instr;
+  uint16_t program[] = {
+    0x2003, /* LD R0, x3004 */
+    0x6200, /* LDR R1, R0, #0 */
+    0x7201, /* STR R1, R0, #1 */
+    0xA400, /* LDI R2, x3004 */
+    0x4010,
+  };
+  memcpy(vm->memory + 0x3000, program, sizeof(program));
+  run_engine(vm, 4);
 
-  reg[R_COND] = FL_POS;
-  int result = read_and_execute_instruction();
-  if (result != 1) {
-    printf("Expected return value to be 1, got %d\n", result);
+  uint16_t expected = 0x4010 ^ 0x5555;
+  if (vm->reg[R_R1] != expected || vm->reg[R_R2] != expected || state.reads != 2) {
+    printf("Expected registers 1 and 2 to contain %d from %d reads, got %d, %d from %d\n",
+           expected, 2, vm->reg[R_R1], vm->reg[R_R2], state.reads);
     pass = 0;
   }
-
-  if (reg[R_PC] != 0x3100) {
-    printf("Expected program counter to contain %d, got %d\n", 0x3100, reg[R_PC]);
+  if (state.write_address != 0x4011 || state.write_val != expected || vm->memory[0x4011] != 0) {
+    printf("Expected the device to take %d at %d, got %d at %d\n",
+           expected, 0x4011, state.write_val, state.write_address);
     pass = 0;
   }
 
+  lc3_unmap_device(vm, 0x40);
   return pass;
 }
 
-int test_jmp_instr() {
+int test_profile() {
+  lc3_vm* vm = test_vm;
   int pass = 1;
 
-  uint16_t jmp_instr =
-    ((OP_JMP & 0xf) << 12) |
-    ((R_R0 & 0x7) << 6);
-
-  memory[0x3000] = jmp_instr;
-  reg[R_R0] = 0x1234;
-
-  int result = read_and_execute_instruction();
-  if (result != 1) {
-    printf("Expected return value to be 1, got %d\n", result);
+  uint16_t program[] = {
+    0x5260, /* AND R1, R1, #0 */
+    0x1263, /* ADD R1, R1, #3 */
+    0x127F, /* ADD R1, R1, #-1 */
+    0x03FE, /* BRp x3002 */
+    0xF025, /* HALT */
+  };
+  memcpy(vm->memory + 0x3000, program, sizeof(program));
+  vm->out = fopen("/dev/null", "w");
+  vm->profile = lc3_alloc(sizeof(lc3_profile));
+  run_engine(vm, 100);
+
+  lc3_profile* prof = vm->profile;
+  if (prof->pc[0x3002] != 3 || prof->op[OP_ADD] != 4 || prof->op[OP_BR] != 3 ||
+      prof->taken[0x3003] != 2 || prof->trap[TRAP_HALT] != 1) {
+    printf("Expected address %d to run %d times, got %d\n", 0x3002, 3, (int)prof->pc[0x3002]);
     pass = 0;
   }
 
-  if (reg[R_PC] != 0x1234) {
-    printf("Expected program counter to contain %d, got %d\n", 0x1234, reg[R_PC]);
+  char* report = NULL;
+  size_t size = 0;
+  FILE* out = open_memstream(&report, &size);
+  write_profile(vm, out);
+  fclose(out);
+  if (!strstr(report, "x3003              3  33.33%  BRp        66.7% taken")) {
+    printf("Expected the report to list the branch at %d\n", 0x3003);
     pass = 0;
   }
+  free(report);
 
+  lc3_free(vm->profile, sizeof(lc3_profile));
+  vm->profile = NULL;
+  fclose(vm->out);
+  vm->out = stdout;
   return pass;
 }
 
-int test_jsr_instr_1() {
+int test_sampler() {
   int pass = 1;
-
-  uint16_t jsr_instr =
-    ((OP_JSR & 0xf) << 12) |
-    (1 << 11) |
-    0xff;
-
-  memory[0x3000] = jsr_instr;
-
-  int result = read_and_execute_instruction();
-  if (result != 1) {
-    printf("Expected return value to be 1, got %d\n", result);
+#ifdef HAVE_SAMPLER
+  lc3_vm* vm = test_vm;
+  char sym[] =
+    "// Symbol table\n"
+    "// Scope level 0:\n"
+    "//\tSymbol Name       Page Address\n"
+    "//\t----------------  ------------\n"
+    "//\tSUB               3010\n"
+    "//\tMAIN              3000\n";
+  symbol_table symbols = {0};
+  FILE* f = fmemopen(sym, strlen(sym), "r");
+  if (!read_symbols_file(&symbols, f) || symbols.count != 2 || symbols.symbols[0].address != 0x3000) {
+    printf("Expected %d symbols sorted by address\n", 2);
     pass = 0;
   }
-
-  if (reg[R_PC] != 0x3100) {
-    printf("Expected program counter to contain %d, got %d\n", 0x3100, reg[R_PC]);
+  fclose(f);
+
+  vm->memory[0x3000] = 0x480F; /* JSR SUB */
+
+  /* stand in for SIGPROF: twice inside SUB, once back in MAIN */
+  sampler.vm = vm;
+  vm->reg[R_R7] = 0x3001;
+  vm->reg[R_PC] = 0x3011;
+  handle_sample(SIGPROF);
+  handle_sample(SIGPROF);
+  vm->reg[R_PC] = 0x3001;
+  handle_sample(SIGPROF);
+  /* any run of a sampled machine drains the ring */
+  vm->memory[0x3001] = 0x0000; /* NOP */
+  run_engine(vm, 1);
+  sampler.vm = NULL;
+  if (sampler.count != 3) {
+    printf("Expected run_engine to drain %d samples, got %zu\n", 3, sampler.count);
     pass = 0;
   }
 
-  if (reg[R_R7] != 0x3001) {
-    printf("Expected register 7 to contain %d, got %d\n", 0x3001, reg[R_R7]);
+  char* folded = NULL;
+  size_t size = 0;
+  FILE* out = open_memstream(&folded, &size);
+  write_folded(vm, &symbols, out);
+  fclose(out);
+  if (strcmp(folded, "MAIN 1\nMAIN;SUB 2\n") != 0) {
+    printf("Expected folded stacks, got %s\n", folded);
     pass = 0;
   }
+  free(folded);
 
+  sampler_reset();
+  free_symbols(&symbols);
+#endif
   return pass;
 }
 
-int test_jsr_instr_2() {
+int test_bench_kernels() {
   int pass = 1;
+#ifdef HAVE_BENCH
+  lc3_vm* vm = test_vm;
+
+  /* every kernel must run forever, or a timed run would miscount */
+  for (int k = 0; k < BENCH_KERNELS; k++) {
+    memset(vm->reg, 0, sizeof(vm->reg));
+    vm->reg[R_PC] = PC_START;
+    memcpy(vm->memory + PC_START, bench_kernels[k].code, bench_kernels[k].words * sizeof(uint16_t));
+    reset_code_caches(vm);
+    if (!run_engine(vm, 1000)) {
+      printf("Expected the %s kernel to keep running\n", bench_kernels[k].name);
+      pass = 0;
+    }
+    if (k == 0 && vm->reg[R_R1] != 200) {
+      printf("Expected register 1 to contain %d, got %d\n", 200, vm->reg[R_R1]);
+      pass = 0;
+    }
+  }
+#endif
+  return pass;
+}
 
-  uint16_t jsr_instr =
-    ((OP_JSR & 0xf) << 12) |
-    ((R_R0 & 0x7) << 6);
+int test_halt_count() {
+  lc3_vm* vm = test_vm;
+  int pass = 1;
 
-  memory[0x3000] = jsr_instr;
-  reg[R_R0] = 0x1234;
+  uint16_t program[] = {
+    0x5260, /* AND R1, R1, #0 */
+    0x1262, /* ADD R1, R1, #2 */
+    0x127F, /* ADD R1, R1, #-1 */
+    0x03FE, /* BRp x3002 */
+    0xF025, /* HALT */
+  };
+  memcpy(vm->memory + 0x3000, program, sizeof(program));
+  vm->out = fopen("/dev/null", "w");
+  vm->icount = 0;
 
-  int result = read_and_execute_instruction();
-  if (result != 1) {
-    printf("Expected return value to be 1, got %d\n", result);
+  /* a halted run counts what it retired, not its whole budget */
+  if (run_engine(vm, 100) || vm->icount != 7) {
+    printf("Expected the program to halt after %d instructions, got %d\n", 7, (int)vm->icount);
     pass = 0;
   }
 
-  if (reg[R_PC] != 0x1234) {
-    printf("Expected program counter to contain %d, got %d\n", 0x1234, reg[R_PC]);
+  fclose(vm->out);
+  vm->out = stdout;
+  return pass;
+}
+
+int test_trace() {
+  int pass = 1;
+#ifdef HAVE_TRACE
+  lc3_vm* vm = test_vm;
+
+  uint16_t program[] = {
+    0x5260, /* AND R1, R1, #0 */
+    0x1262, /* ADD R1, R1, #2 */
+    0x3203, /* ST R1, x3006 */
+    0x127F, /* ADD R1, R1, #-1 */
+    0x03FD, /* BRp x3002 */
+    0xF025, /* HALT */
+  };
+  memcpy(vm->memory + 0x3000, program, sizeof(program));
+  vm->out = fopen("/dev/null", "w");
+
+  char* trace_buf = NULL;
+  size_t trace_size = 0;
+  FILE* trace = open_memstream(&trace_buf, &trace_size);
+  lc3_trace_start(vm, trace);
+  run_engine(vm, 100);
+  lc3_trace_stop(vm);
+  fclose(trace);
+
+  /* read it back */
+  char* dump_buf = NULL;
+  size_t dump_size = 0;
+  FILE* in = fmemopen(trace_buf, trace_size, "r");
+  FILE* dump = open_memstream(&dump_buf, &dump_size);
+  int read = dump_trace(in, dump);
+  fclose(in);
+  fclose(dump);
+  if (!read || !strstr(dump_buf, "x3002 x3203 ST        [x3006]=x0001\n") ||
+      strcmp(dump_buf + dump_size - 8, "9 steps\n") != 0) {
+    printf("Expected a trace of %d steps, got %s\n", 9, dump_buf);
     pass = 0;
   }
-
-  if (reg[R_R7] != 0x3001) {
-    printf("Expected register 7 to contain %d, got %d\n", 0x3001, reg[R_R7]);
+  /* two bytes or less a step, after the header and the first visits */
+  if (trace_size > sizeof(TRACE_MAGIC) - 1 + 20 + 2 * 9 + 2 * 6 + 1) {
+    printf("Expected a trace of at most %d bytes, got %d\n", (int)(sizeof(TRACE_MAGIC) - 1 + 20 + 2 * 9 + 2 * 6 + 1), (int)trace_size);
     pass = 0;
   }
 
+  free(trace_buf);
+  free(dump_buf);
+  fclose(vm->out);
+  vm->out = stdout;
+#endif
   return pass;
 }
 
-int test_ld_instr() {
+int test_assembler() {
+  lc3_vm* vm = test_vm;
   int pass = 1;
 
-  uint16_t ld_instr =
-    ((OP_LD & 0xf) << 12) |
-    ((R_R0 & 0x7) << 9)   |
-    0xff;
-
-  memory[0x3000] = ld_instr;
-  memory[0x3100] = 0x123;
-
-  int result = read_and_execute_instruction();
-  if (result != 1) {
-    printf("Expected return value to be 1, got %d\n", result);
+  const char* source =
+    "; counts R1 down from 3\n"
+    ".ORIG x3000\n"
+    "START  LD R1, COUNT\n"
+    "LOOP   ADD R1, R1, #-1 ; again\n"
+    "       BRp LOOP\n"
+    "       LEA R0, TEXT\n"
+    "       PUTS\n"
+    "       HALT\n"
+    "COUNT  .FILL #3\n"
+    "PTR    .FILL LOOP\n"
+    "TEXT   .STRINGZ \"a;\\n\"\n"
+    "       .BLKW 2\n"
+    ".END\n";
+  uint16_t expected[] = {
+    0x2205, 0x127F, 0x03FE, 0xE004, 0xF022, 0xF025,
+    0x0003, 0x3001, 'a', ';', '\n', 0, 0, 0,
+  };
+  symbol_table symbols = {0};
+  image_span span;
+  int contiguous;
+  if (!assemble(vm, "test.asm", source, strlen(source), &symbols, &span, &contiguous) ||
+      memcmp(vm->memory + 0x3000, expected, sizeof(expected)) != 0) {
+    printf("Expected vm->memory location %d to contain %d, got %d\n", 0x3000, expected[0], vm->memory[0x3000]);
     pass = 0;
   }
-
-  if (reg[R_R0] != 0x123) {
-    printf("Expected register 0 to contain %d, got %d\n", 0x123, reg[R_R0]);
+  if (span.origin != 0x3000 || span.words != 14 || !contiguous ||
+      symbols.count != 5 || symbols.symbols[1].address != 0x3001) {
+    printf("Expected %d labels over %d words, got %d over %d\n", 5, 14, (int)symbols.count, (int)span.words);
     pass = 0;
   }
-
-  if (reg[R_COND] != FL_POS) {
-    printf("Expected condition flags to be %d, got %d\n", FL_POS, reg[R_COND]);
+  free_symbols(&symbols);
+
+  /* rejected rather than truncated or wrapped */
+  const char* bad[] = {
+    ".ORIG #-5\nHALT\n.END\n",
+    ".ORIG NOWHERE\nHALT\n.END\n",
+    ".ORIG x3000\nTRAP NOWHERE\n.END\n",
+    ".ORIG x3000\n.FILL #-40000\n.END\n",
+    ".ORIG x3000\n.FILL #70000\n.END\n",
+    ".ORIG xFFFF\n.FILL #1\n.FILL #2\n.END\n",
+  };
+  int saved = dup(STDERR_FILENO);
+  int null = open("/dev/null", O_WRONLY);
+  fflush(stderr);
+  dup2(null, STDERR_FILENO);
+  for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+    vm->memory[0x0000] = 0;
+    if (assemble(vm, "bad.asm", bad[i], strlen(bad[i]), NULL, &span, &contiguous)) {
+      printf("Expected %s to be rejected\n", bad[i]);
+      pass = 0;
+    }
+  }
+  fflush(stderr);
+  dup2(saved, STDERR_FILENO);
+  close(saved);
+  close(null);
+  if (vm->memory[0x0000] != 0) {
+    printf("Expected code past xFFFF not to wrap to x0000, got x%04X\n", vm->memory[0x0000]);
     pass = 0;
   }
-
   return pass;
 }
 
-int test_ldi_instr() {
+int test_debugger() {
+  lc3_vm* vm = test_vm;
   int pass = 1;
 
-  uint16_t ldi_instr =
-    ((OP_LDI & 0xf) << 12) |
-    ((R_R0 & 0x7) << 9)   |
-    0xff;
-
-  memory[0x3000] = ldi_instr;
-  memory[0x3100] = 0x3200;
-  memory[0x3200] = 0x123;
-
-  int result = read_and_execute_instruction();
-  if (result != 1) {
-    printf("Expected return value to be 1, got %d\n", result);
+  uint16_t program[] = {
+    0x5260, /* AND R1, R1, #0 */
+    0x1262, /* ADD R1, R1, #2 */
+    0x3203, /* ST R1, x3006 */
+    0x127F, /* ADD R1, R1, #-1 */
+    0x03FD, /* BRp x3002 */
+    0xF025, /* HALT */
+    0x0000,
+  };
+  memcpy(vm->memory + 0x3000, program, sizeof(program));
+  vm->out = fopen("/dev/null", "w");
+  vm->icount = 0;
+  lc3_debug_attach(vm);
+
+  /* a breakpoint stops in front of its instruction, each time around */
+  lc3_break(vm, 0x3003, 1);
+  if (!run_engine(vm, 100) || vm->stop != STOP_BREAK || vm->reg[R_PC] != 0x3003 || vm->icount != 3) {
+    printf("Expected a breakpoint at x%04X after %d instructions, got x%04X after %d\n", 0x3003, 3, vm->reg[R_PC], (int)vm->icount);
     pass = 0;
   }
-
-  if (reg[R_R0] != 0x123) {
-    printf("Expected register 0 to contain %d, got %d\n", 0x123, reg[R_R0]);
+  if (!lc3_continue(vm, 100) || vm->stop != STOP_BREAK || vm->reg[R_PC] != 0x3003 || vm->icount != 6) {
+    printf("Expected a breakpoint at x%04X after %d instructions, got x%04X after %d\n", 0x3003, 6, vm->reg[R_PC], (int)vm->icount);
     pass = 0;
   }
-
-  if (reg[R_COND] != FL_POS) {
-    printf("Expected condition flags to be %d, got %d\n", FL_POS, reg[R_COND]);
+  lc3_break(vm, 0x3003, 0);
+
+  /* a watched store stops after the store */
+  vm->reg[R_PC] = 0x3000;
+  lc3_watch(vm, 0x3006, DEBUG_WATCH_WRITE);
+  if (!lc3_continue(vm, 100) || vm->stop != STOP_WATCH || vm->memory[0x3006] != 2 ||
+      !vm->debug->hit_write || vm->debug->hit_address != 0x3006 || vm->debug->hit_value != 2) {
+    printf("Expected a watched write of %d, got %d\n", 2, vm->memory[0x3006]);
     pass = 0;
   }
 
-  return pass;
-}
-
-int test_ldr_instr() {
-  int pass = 1;
-
-  uint16_t ldr_instr =
-    ((OP_LDR & 0xf) << 12) |
-    ((R_R0 & 0x7) << 9)    |
-    ((R_R1 & 0x7) << 6)    |
-    0xf;
-
-  memory[0x3000] = ldr_instr;
-  reg[R_R1] = 0x31f1;
-  memory[0x3200] = 0x123;
-
-  int result = read_and_execute_instruction();
-  if (result != 1) {
-    printf("Expected return value to be 1, got %d\n", result);
+  /* a fork leaves the watch behind and runs to the end */
+  lc3_vm* child = lc3_fork(vm);
+  if (!child || child->device_page[0x3006 >> MEMORY_PAGE_SHIFT] || run_engine(child, 100) ||
+      child->stop || child->memory[0x3006] != 1) {
+    printf("Expected the fork to halt with %d stored, got %d\n", 1, child ? child->memory[0x3006] : -1);
     pass = 0;
   }
-
-  if (reg[R_R0] != 0x123) {
-    printf("Expected register 0 to contain %d, got %d\n", 0x123, reg[R_R0]);
+  lc3_vm_destroy(child);
+  lc3_watch(vm, 0x3006, 0);
+  if (lc3_continue(vm, 100) || vm->stop || vm->memory[0x3006] != 1) {
+    printf("Expected the program to halt with %d stored, got %d\n", 1, vm->memory[0x3006]);
     pass = 0;
   }
 
-  if (reg[R_COND] != FL_POS) {
-    printf("Expected condition flags to be %d, got %d\n", FL_POS, reg[R_COND]);
+  /* a watched load inside a self-looping block stops after the load */
+  uint16_t loop[] = {
+    0x6080, /* LDR R0, R2, #0 */
+    0x14A1, /* ADD R2, R2, #1 */
+    0x0FFD, /* BRnzp x3010 */
+  };
+  memcpy(vm->memory + 0x3010, loop, sizeof(loop));
+  vm->memory[0x4010] = 7;
+  vm->reg[R_PC] = 0x3010;
+  vm->reg[R_R2] = 0x4000;
+  vm->icount = 0;
+  lc3_watch(vm, 0x4010, DEBUG_WATCH_READ);
+  if (!lc3_continue(vm, 100000) || vm->stop != STOP_WATCH || vm->reg[R_R2] != 0x4010 ||
+      vm->reg[R_R0] != 7 || vm->reg[R_PC] != 0x3011 || vm->icount != 49) {
+    printf("Expected a watched read at R2=x%04X after %d instructions, got x%04X pc x%04X after %d\n",
+           0x4010, 49, vm->reg[R_R2], vm->reg[R_PC], (int)vm->icount);
     pass = 0;
   }
+  lc3_watch(vm, 0x4010, 0);
 
+  lc3_debug_detach(vm);
+  fclose(vm->out);
+  vm->out = stdout;
   return pass;
 }
 
-int test_lea_instr() {
-  int pass = 1;
+/* runs until the machine halts, returns 0 if it does not */
+int test_os_run(lc3_vm* vm, char* out_buf, size_t size) {
+  int runs = 0;
+  memset(out_buf, 0, size);
+  vm->out = fmemopen(out_buf, size, "w");
+  while (run_engine(vm, 100) && ++runs < 10) {
+  }
+  fclose(vm->out);
+  vm->out = stdout;
+  return runs < 10;
+}
 
-  uint16_t lea_instr =
-    ((OP_LEA & 0xf) << 12) |
-    ((R_R0 & 0x7) << 9)    |
-    0xff;
+int test_os() {
+  lc3_vm* vm = test_vm;
+  int pass = 1;
 
-  memory[0x3000] = lea_instr;
+  const char* source =
+    "       .ORIG x0200\n"
+    "OUTR   ST R1, SAVE1\n"
+    "POLL   LDI R1, DSRP\n"
+    "       BRzp POLL\n"
+    "       STI R0, DDRP\n"
+    "       LD R1, SAVE1\n"
+    "       RTI\n"
+    "HALTR  AND R0, R0, #0\n"
+    "       STI R0, MCRP\n"
+    "       BRnzp HALTR\n"
+    "TRAP26 ADD R0, R0, #1\n"
+    "       RTI\n"
+    "DSRP   .FILL xFE04\n"
+    "DDRP   .FILL xFE06\n"
+    "MCRP   .FILL xFFFE\n"
+    "SAVE1  .BLKW 1\n"
+    ".END\n";
+  uint16_t program[] = {
+    0x5020, /* AND R0, R0, #0 */
+    0xF026, /* TRAP x26 */
+    0x0401, /* BRz x3004 */
+    0xF025, /* HALT */
+    0x2003, /* LD R0, x3008 */
+    0xF021, /* OUT */
+    0xF025, /* HALT */
+    0x8000, /* RTI */
+    'A',
+  };
+  image_span span;
+  int contiguous;
+  if (!assemble(vm, "os.asm", source, strlen(source), NULL, &span, &contiguous)) {
+    printf("Expected the OS to assemble\n");
+    return 0;
+  }
+  memcpy(vm->memory + 0x3000, program, sizeof(program));
+  vm->memory[TRAP_OUT] = 0x0200;
+  vm->memory[TRAP_HALT] = 0x0206;
+  vm->memory[0x26] = 0x0209;
+  vm->memory[0x0100] = 0x0206;
+  lc3_os_start(vm);
+  vm->reg[R_R6] = 0x4000;
+  char out_buf[64];
+#ifdef HAVE_TRACE
+  char* trace_buf = NULL;
+  size_t trace_size = 0;
+  FILE* trace = open_memstream(&trace_buf, &trace_size);
+  lc3_trace_start(vm, trace);
+#endif
 
-  int result = read_and_execute_instruction();
-  if (result != 1) {
-    printf("Expected return value to be 1, got %d\n", result);
+  /* x26 goes through the table and RTI puts back the flags and the
+   * user stack, OUT and HALT still have the OS's entries and run natively */
+  if (!test_os_run(vm, out_buf, sizeof(out_buf)) || strcmp(out_buf, "AHALT\n") != 0) {
+    printf("Expected the program to print %s, got %s\n", "AHALT", out_buf);
     pass = 0;
   }
-
-  if (reg[R_R0] != 0x3100) {
-    printf("Expected register 0 to contain %d, got %d\n", 0x3100, reg[R_R0]);
+#ifdef HAVE_TRACE
+  /* the trap's pushes are in the trace */
+  lc3_trace_stop(vm);
+  fclose(trace);
+  char* dump_buf = NULL;
+  size_t dump_size = 0;
+  FILE* in = fmemopen(trace_buf, trace_size, "r");
+  FILE* dump = open_memstream(&dump_buf, &dump_size);
+  dump_trace(in, dump);
+  fclose(in);
+  fclose(dump);
+  if (!strstr(dump_buf, " [x2FFF]=x8002\n") || !strstr(dump_buf, " [x2FFE]=x3002\n")) {
+    printf("Expected the trap's pushes in the trace, got %s\n", dump_buf);
     pass = 0;
   }
-
-  if (reg[R_COND] != FL_POS) {
-    printf("Expected condition flags to be %d, got %d\n", FL_POS, reg[R_COND]);
+  free(trace_buf);
+  free(dump_buf);
+#endif
+  if (vm->reg[R_R6] != 0x4000 || vm->psr != PSR_USER || vm->saved_ssp != 0x3000 ||
+      vm->memory[0x2FFF] != (PSR_USER | FL_ZRO) || vm->memory[0x2FFE] != 0x3002) {
+    printf("Expected R6 to be x%04X in user mode, got x%04X with PSR x%04X\n", 0x4000, vm->reg[R_R6], vm->psr);
     pass = 0;
   }
 
-  return pass;
-}
-
-int test_st_instr() {
-  int pass = 1;
-
-  uint16_t st_instr =
-    ((OP_ST & 0xf) << 12) |
-    ((R_R0 & 0x7) << 9)    |
-    0xff;
-
-  memory[0x3000] = st_instr;
-  reg[R_R0] = 0x123;
-
-  int result = read_and_execute_instruction();
-  if (result != 1) {
-    printf("Expected return value to be 1, got %d\n", result);
+  /* without HLE the OS's own routines print and clear MCR */
+  vm->hle = 0;
+  vm->reg[R_PC] = 0x3000;
+  if (!test_os_run(vm, out_buf, sizeof(out_buf)) || strcmp(out_buf, "A") != 0 || vm->stop != STOP_NONE) {
+    printf("Expected the OS to print %s and halt, got %s\n", "A", out_buf);
+    pass = 0;
+  }
+  if (vm->reg[R_PC] < 0x0206 || vm->reg[R_PC] > 0x0208 || vm->psr & PSR_USER || vm->memory[MR_MCR] & (1 << 15)) {
+    printf("Expected to halt in the OS, got x%04X with PSR x%04X\n", vm->reg[R_PC], vm->psr);
     pass = 0;
   }
 
-  if (memory[0x3100] != 0x123) {
-    printf("Expected memory location %d to contain %d, got %d\n", 0x3100, 0x123, reg[R_R0]);
+  /* RTI in user mode is a privilege exception */
+  vm->memory[MR_MCR] = 1 << 15;
+  vm->psr = PSR_USER;
+  vm->reg[R_R6] = 0x4000;
+  vm->reg[R_PC] = 0x3007;
+  if (!test_os_run(vm, out_buf, sizeof(out_buf)) || vm->reg[R_R6] != 0x2FFE ||
+      vm->memory[0x2FFE] != 0x3008 || vm->saved_usp != 0x4000) {
+    printf("Expected a privilege exception with R6 x%04X, got x%04X\n", 0x2FFE, vm->reg[R_R6]);
     pass = 0;
   }
 
+  vm->os = 0;
+  vm->hle = 0;
+  vm->psr = 0;
+  lc3_map_device(vm, MR_KBSR >> MEMORY_PAGE_SHIFT, (lc3_device){keyboard_device_read, NULL, NULL});
+  lc3_unmap_device(vm, MR_MCR >> MEMORY_PAGE_SHIFT);
   return pass;
 }
 
-int test_sti_instr() {
-  int pass = 1;
-
-  uint16_t sti_instr =
-    ((OP_STI & 0xf) << 12) |
-    ((R_R0 & 0x7) << 9)    |
-    0xff;
+#ifdef HAVE_GDB
+int test_gdb_fd;
 
-  memory[0x3000] = sti_instr;
-  memory[0x3100] = 0x3200;
-  reg[R_R0] = 0x123;
+void* test_gdb_machine(void* vm) {
+  run_gdb(vm, test_gdb_fd);
+  return NULL;
+}
+#endif
 
-  int result = read_and_execute_instruction();
-  if (result != 1) {
-    printf("Expected return value to be 1, got %d\n", result);
-    pass = 0;
+int test_gdb_stub() {
+  int pass = 1;
+#ifdef HAVE_GDB
+  lc3_vm* vm = test_vm;
+
+  uint16_t program[] = {
+    0x5260, /* AND R1, R1, #0 */
+    0x1262, /* ADD R1, R1, #2 */
+    0x127F, /* ADD R1, R1, #-1 */
+    0x03FE, /* BRp x3002 */
+    0xF025, /* HALT */
+  };
+  memcpy(vm->memory + 0x3000, program, sizeof(program));
+  vm->out = fopen("/dev/null", "w");
+
+  /* play gdb on the other end of a socket pair */
+  int fds[2];
+  pthread_t machine;
+  socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+  test_gdb_fd = fds[0];
+  pthread_create(&machine, NULL, test_gdb_machine, vm);
+  gdb_stub* client = calloc(1, sizeof(gdb_stub));
+  client->fd = fds[1];
+
+  const char* session[][2] = {
+    {"?", "S05"},
+    {"Z0,6006,2", "OK"},
+    {"c", "S05"},
+    {"p8", "0330"},
+    {"g", "0000010000000000000000000000000003300100"},
+    {"m6002,2", "6212"},
+    {"M6002,2:6312", "OK"},
+    {"z0,6006,2", "OK"},
+    {"c", "W00"},
+  };
+  char reply[GDB_PACKET];
+  for (size_t i = 0; i < sizeof(session) / sizeof(session[0]); i++) {
+    gdb_send(client->fd, session[i][0]);
+    if (!gdb_read_packet(client, reply) || strcmp(reply, session[i][1]) != 0) {
+      printf("Expected gdb to get %s for %s, got %s\n", session[i][1], session[i][0], reply);
+      pass = 0;
+    }
   }
-
-  if (memory[0x3200] != 0x123) {
-    printf("Expected memory location %d to contain %d, got %d\n", 0x3200, 0x123, reg[R_R0]);
+  gdb_send(client->fd, "k");
+  pthread_join(machine, NULL);
+  close(fds[1]);
+  free(client);
+
+  /* the store through gdb took, ADD R1, R1, #3 */
+  if (vm->reg[R_R1] != 0 || vm->memory[0x3001] != 0x1263 || vm->debug) {
+    printf("Expected R1 to count down to %d, got %d\n", 0, vm->reg[R_R1]);
     pass = 0;
   }
 
+  fclose(vm->out);
+  vm->out = stdout;
+#endif
   return pass;
 }
 
-int test_str_instr() {
+int test_record_replay() {
+  lc3_vm* vm = test_vm;
   int pass = 1;
-
-  uint16_t str_instr =
-    ((OP_STR & 0xf) << 12) |
-    ((R_R0 & 0x7) << 9)    |
-    ((R_R1 & 0x7) << 6)    |
-    0xf;
-
-  memory[0x3000] = str_instr;
-  reg[R_R0] = 0x123;
-  reg[R_R1] = 0x31f1;
-
-  int result = read_and_execute_instruction();
-  if (result != 1) {
-    printf("Expected return value to be 1, got %d\n", result);
+
+  uint16_t program[] = {
+    0xA004, /* LDI R0, x3005 */
+    0x07FE, /* BRzp x3000 */
+    0xA203, /* LDI R1, x3006 */
+    0xF020, /* GETC */
+    0xF025, /* HALT */
+    MR_KBSR,
+    MR_KBDR,
+  };
+  memcpy(vm->memory + 0x3000, program, sizeof(program));
+
+  /* a key at the first poll, another for GETC */
+  char in_buf[] = {'a', 'b'};
+  char* log_buf = NULL;
+  size_t log_size = 0;
+  FILE* log = open_memstream(&log_buf, &log_size);
+  vm->in = fmemopen(in_buf, sizeof(in_buf), "r");
+  vm->out = fopen("/dev/null", "w");
+  record_start(vm, log);
+  run_recorded(vm, 100);
+  fclose(log);
+  fclose(vm->in);
+  vm->in = stdin;
+
+  uint8_t expected[] = {'L', 'C', '3', 'R', 'E', 'C', '1', '\n', 0, 'a', 3, 'b', 2, 0x82, 0x02};
+  if (log_size != sizeof(expected) || memcmp(log_buf, expected, sizeof(expected)) != 0) {
+    printf("Expected a recording of %d bytes, got %d\n", (int)sizeof(expected), (int)log_size);
     pass = 0;
   }
-
-  if (memory[0x3200] != 0x123) {
-    printf("Expected memory location %d to contain %d, got %d\n", 0x3200, 0x123, reg[R_R0]);
+  free(log_buf);
+
+  /* the same key arriving at instruction 10 leaves the poll loop then */
+  uint8_t later[] = {'L', 'C', '3', 'R', 'E', 'C', '1', '\n', 10, 'a', 3, 'b', 2, 0x82, 0x02};
+  log = fmemopen(later, sizeof(later), "rb");
+  vm->replay = replay_open(log);
+  fclose(log);
+  vm->reg[R_PC] = 0x3000;
+  vm->icount = 0;
+  /* the machine halts at the END's count, leaving only the END */
+  if (run_replay(vm) || vm->reg[R_R1] != 'a' || vm->reg[R_R0] != 'b' || vm->icount != 15 || vm->replay->pos != vm->replay->count - 1) {
+    printf("Expected register 1 to contain %d at instruction %d, got %d at %d\n", 'a', 15, vm->reg[R_R1], (int)vm->icount);
     pass = 0;
   }
+  replay_close(vm->replay);
+  vm->replay = NULL;
+  fclose(vm->out);
+  vm->out = stdout;
 
   return pass;
 }
 
-int test_trap_getc() {
+int test_snapshot() {
+  lc3_vm* vm = test_vm;
   int pass = 1;
 
-  uint16_t trap_getc_instr =
-    ((OP_TRAP & 0xf) << 12) |
-    (TRAP_GETC & 0xff);
-
-  char in_buf[] = {'x'};
-  char out_buf[256];
-  FILE *in = fmemopen(in_buf, sizeof(in_buf), "r");
-  FILE *out = fmemopen(out_buf, sizeof(out_buf), "w");
-
-  int result = execute_trap(trap_getc_instr, in, out);
-  fclose(in);
-  fclose(out);
+  uint16_t program[] = {
+    0x1261, /* ADD R1, R1, #1 */
+    0x7280, /* STR R1, R2, #0 */
+    0x0FFD, /* BRnzp x3000 */
+  };
+  memcpy(vm->memory + 0x3000, program, sizeof(program));
+  mark_dirty(vm, 0, MEMORY_WORDS);
+  vm->reg[R_R2] = 0x4000;
+
+  run_engine(vm, 30);
+  lc3_snap* s = lc3_snapshot(vm);
+  run_engine(vm, 30);
+  lc3_restore(vm, s);
+  if (vm->reg[R_R1] != 10 || vm->memory[0x4000] != 10 || vm->reg[R_PC] != 0x3000) {
+    printf("Expected vm->memory location %d to contain %d after restore, got %d\n", 0x4000, 10, vm->memory[0x4000]);
+    pass = 0;
+  }
 
-  if (result != 1) {
-    printf("Expected return value to be 1, got %d\n", result);
+  /* the restored machine runs on as if nothing happened */
+  run_engine(vm, 30);
+  if (vm->reg[R_R1] != 20 || vm->memory[0x4000] != 20) {
+    printf("Expected vm->memory location %d to contain %d, got %d\n", 0x4000, 20, vm->memory[0x4000]);
     pass = 0;
   }
 
-  if (reg[R_R0] != 'x') {
-    printf("Expected register 0 to contain %d, got %d\n", 'x', reg[R_R0]);
+  /* a fork shares the code page and owns its data once it stores */
+  lc3_vm* child = lc3_fork(vm);
+  if (!child || child->snapshot_pages[0x30] != vm->snapshot_pages[0x30]) {
+    printf("Expected the fork to share page %d\n", 0x30);
     pass = 0;
+  } else {
+    run_engine(child, 30);
+    if (child->memory[0x4000] != 30 || vm->memory[0x4000] != 20) {
+      printf("Expected vm->memory location %d to contain %d and %d, got %d and %d\n",
+             0x4000, 30, 20, child->memory[0x4000], vm->memory[0x4000]);
+      pass = 0;
+    }
   }
+  lc3_vm_destroy(child);
 
-  if (out_buf[0] != 0) {
-    printf("Expected output buffer to contain %d, got %d\n", 0, out_buf[0]);
+  /* nothing stored, nothing copied */
+  lc3_snap* again = lc3_snapshot(vm);
+  lc3_snap* same = lc3_snapshot(vm);
+  if (again->pages[0x40] != same->pages[0x40] || same->pages[0x50] != NULL) {
+    printf("Expected unchanged pages to be shared\n");
     pass = 0;
   }
+  lc3_snap_free(same);
+  lc3_snap_free(again);
+  lc3_snap_free(s);
 
   return pass;
 }
 
-int test_trap_out() {
+int test_image_loader() {
+  lc3_vm* vm = test_vm;
   int pass = 1;
 
-  uint16_t trap_out_instr =
-    ((OP_TRAP & 0xf) << 12) |
-    (TRAP_OUT & 0xff);
+  /* every swap kernel agrees with the scalar one, tails included */
+  swap_fn impls[] = {
+    swap16_words_best(),
+#ifdef HAVE_SWAP_SIMD
+    __builtin_cpu_supports("ssse3") ? swap16_words_ssse3 : NULL,
+    __builtin_cpu_supports("avx2") ? swap16_words_avx2 : NULL,
+#endif
+  };
+  for (size_t k = 0; k < sizeof(impls) / sizeof(impls[0]); k++) {
+    uint16_t words[37];
+    for (int i = 0; i < 37; i++) {
+      words[i] = i * 0x0101 + 0x0102;
+    }
+    if (impls[k]) {
+      impls[k](words, 37);
+    }
+    for (int i = 0; impls[k] && i < 37; i++) {
+      if (words[i] != swap16(i * 0x0101 + 0x0102)) {
+        printf("Expected swapped word %d to contain %d, got %d\n", i, swap16(i * 0x0101 + 0x0102), words[i]);
+        pass = 0;
+        break;
+      }
+    }
+  }
 
-  char in_buf[] = {0};
-  char out_buf[256];
-  FILE *in = fmemopen(in_buf, sizeof(in_buf), "r");
-  FILE *out = fmemopen(out_buf, sizeof(out_buf), "w");
+  struct {
+    uint8_t bytes[8];
+    size_t size;
+    int expected;
+  } cases[] = {
+    {{0x30, 0x00, 0x12, 0x34}, 4, IMAGE_OK},
+    {{0x30}, 1, IMAGE_TRUNCATED},
+    {{0x30, 0x00}, 2, IMAGE_TRUNCATED},
+    {{0x40, 0x00, 0x12, 0x34, 0x56}, 5, IMAGE_ODD_LENGTH},
+    {{0xFF, 0xFF, 0x12, 0x34, 0x56, 0x78}, 6, IMAGE_TOO_LONG},
+    {{0xFF, 0xFF, 0x12, 0x34}, 4, IMAGE_OK},
+  };
+  for (size_t k = 0; k < sizeof(cases) / sizeof(cases[0]); k++) {
+    FILE* file = fmemopen(cases[k].bytes, cases[k].size, "rb");
+    image_span span;
+    int err = read_image_file(vm, file, &span);
+    fclose(file);
+    if (err != cases[k].expected) {
+      printf("Expected image %d to load as %s, got %s\n", (int)k, image_errors[cases[k].expected], image_errors[err]);
+      pass = 0;
+    }
+  }
+  if (vm->memory[0x3000] != 0x1234 || vm->memory[0xFFFF] != 0x1234) {
+    printf("Expected vm->memory location %d to contain %d, got %d\n", 0x3000, 0x1234, vm->memory[0x3000]);
+    pass = 0;
+  }
 
-  reg[R_R0] = 'x';
+  return pass;
+}
 
-  int result = execute_trap(trap_out_instr, in, out);
-  fclose(in);
-  fclose(out);
+int test_image_cache() {
+  lc3_vm* vm = test_vm;
+  int pass = 1;
 
-  if (result != 1) {
-    printf("Expected return value to be 1, got %d\n", result);
-    pass = 0;
+  char dir[] = "/tmp/lc3-test-XXXXXX";
+  char obj_path[64], cache_path[64];
+  if (!mkdtemp(dir)) {
+    printf("Failed to create a scratch directory\n");
+    return 0;
   }
-
-  if (out_buf[0] != 'x') {
-    printf("Expected output buffer to contain %d, got %d\n", 'x', out_buf[0]);
-    pass = 0;
+  snprintf(obj_path, sizeof(obj_path), "%s/t.obj", dir);
+  snprintf(cache_path, sizeof(cache_path), "%s/t.lc3img", dir);
+
+  uint8_t obj[] = {0x30, 0x00, 0x12, 0x34, 0xAB, 0xCD};
+  FILE* file = fopen(obj_path, "wb");
+  fwrite(obj, 1, sizeof(obj), file);
+  fclose(file);
+
+  use_image_cache = 1;
+  for (int run = 0; run < 3; run++) {
+    lc3_zero(vm->memory, MEMORY_WORDS * sizeof(uint16_t));
+    image_span span;
+    int err = read_image(vm, run < 2 ? obj_path : cache_path, &span);
+    if (err != IMAGE_OK || vm->memory[0x3000] != 0x1234 || vm->memory[0x3001] != 0xABCD || vm->memory[0x3002] != 0) {
+      printf("Expected vm->memory location %d to contain %d on load %d, got %d\n", 0x3000, 0x1234, run, vm->memory[0x3000]);
+      pass = 0;
+    }
+    if (access(cache_path, R_OK) != 0) {
+      printf("Expected %s to be written\n", cache_path);
+      pass = 0;
+    }
   }
+  use_image_cache = 0;
 
+  unlink(cache_path);
+  unlink(obj_path);
+  rmdir(dir);
   return pass;
 }
 
-int test_trap_puts() {
+int test_input_exhausted() {
+  lc3_vm* vm = test_vm;
   int pass = 1;
 
-  uint16_t trap_puts_instr =
+  uint16_t trap_getc_instr =
     ((OP_TRAP & 0xf) << 12) |
-    (TRAP_PUTS & 0xff);
-
-  char in_buf[] = {0};
-  char out_buf[256];
-  FILE *in = fmemopen(in_buf, sizeof(in_buf), "r");
-  FILE *out = fmemopen(out_buf, sizeof(out_buf), "w");
-
-  reg[R_R0] = 0x3100;
-  memory[0x3100] = 'h';
-  memory[0x3101] = 'e';
-  memory[0x3102] = 'y';
-  memory[0x3103] = 0;
+    (TRAP_GETC & 0xff);
 
-  int result = execute_trap(trap_puts_instr, in, out);
-  fclose(in);
-  fclose(out);
+  char in_buf[] = {'y'};
+  vm->in = fmemopen(in_buf, sizeof(in_buf), "r");
+  vm->memory[0x3000] = trap_getc_instr;
+  vm->memory[0x3001] = trap_getc_instr;
 
-  if (result != 1) {
-    printf("Expected return value to be 1, got %d\n", result);
+  step();
+  if (vm->reg[R_R0] != 'y' || vm->input_eof) {
+    printf("Expected register 0 to contain %d with input left, got %d\n", 'y', vm->reg[R_R0]);
     pass = 0;
   }
 
-  if (strncmp(out_buf, "hey", 3) != 0) {
-    printf("Expected output buffer to contain %s, got %s\n", "hey", out_buf);
+  step();
+  if (vm->reg[R_R0] != 0xFFFF || !vm->input_eof) {
+    printf("Expected register 0 to contain %d with input exhausted, got %d\n", 0xFFFF, vm->reg[R_R0]);
     pass = 0;
   }
 
+  fclose(vm->in);
+  vm->in = stdin;
   return pass;
 }
 
-int test_trap_in() {
+int test_idle_loop() {
+  lc3_vm* vm = test_vm;
   int pass = 1;
 
-  uint16_t trap_in_instr =
-    ((OP_TRAP & 0xf) << 12) |
-    (TRAP_IN & 0xff);
-
-  char in_buf[] = {'x'};
-  char out_buf[256];
-  FILE *in = fmemopen(in_buf, sizeof(in_buf), "r");
-  FILE *out = fmemopen(out_buf, sizeof(out_buf), "w");
+  uint16_t program[] = {
+    0x1261, /* ADD R1, R1, #1 */
+    0xA001, /* LDI R0, x3003 */
+    0x07FD, /* BRzp x3000 */
+    0xFE00, /* KBSR */
+  };
+  memcpy(vm->memory + 0x3000, program, sizeof(program));
 
-  int result = execute_trap(trap_in_instr, in, out);
-  fclose(in);
-  fclose(out);
+  /* waits are reproducible unless asked otherwise */
+  if (vm->idle_policy != IDLE_FIXED || vm->idle_iterations != IDLE_ITERATIONS) {
+    printf("Expected a fixed credit of %d iterations by default\n", IDLE_ITERATIONS);
+    pass = 0;
+  }
 
-  if (result != 1) {
-    printf("Expected return value to be 1, got %d\n", result);
+  idle_loop loop;
+  if (!idle_loop_at(vm, 0x3000, &loop)) {
+    printf("Expected a polling loop at %d\n", 0x3000);
     pass = 0;
+  } else {
+    idle_fast_forward(vm, &loop, 5);
+    if (vm->reg[R_R1] != 5) {
+      printf("Expected register 1 to contain %d, got %d\n", 5, vm->reg[R_R1]);
+      pass = 0;
+    }
   }
 
-  if (reg[R_R0] != 'x') {
-    printf("Expected register 0 to contain %d, got %d\n", 'x', reg[R_R0]);
+  /* the loop still runs as written once a key is there */
+  char in_buf[] = {'x'};
+  vm->in = fmemopen(in_buf, sizeof(in_buf), "r");
+  run_engine(vm, 3);
+  fclose(vm->in);
+  vm->in = stdin;
+  if (vm->reg[R_PC] != 0x3003 || vm->reg[R_R1] != 6 || vm->memory[MR_KBDR] != 'x') {
+    printf("Expected the loop to leave at %d, got %d\n", 0x3003, vm->reg[R_PC]);
+    pass = 0;
   }
 
-  if (strncmp(out_buf, "Enter a character: x", 27) != 0) {
-    printf("Expected output buffer to contain %s, got %s\n", "Enter a character: x", out_buf);
+  /* a loop that does more than count is left alone */
+  vm->memory[0x3000] = 0x3260; /* ST R1, x3061 */
+  if (idle_loop_at(vm, 0x3000, &loop)) {
+    printf("Expected no polling loop at %d\n", 0x3000);
     pass = 0;
   }
 
   return pass;
 }
 
-int test_trap_putsp() {
+int test_keyboard_queue() {
   int pass = 1;
+#ifdef HAVE_KEYBOARD_THREAD
+  /* stand in for the reader thread */
+  sem_init(&keyboard.available, 0, 0);
+  if (keyboard_ready()) {
+    printf("Expected an empty keyboard queue\n");
+    pass = 0;
+  }
 
-  uint16_t trap_putsp_instr =
-    ((OP_TRAP & 0xf) << 12) |
-    (TRAP_PUTSP & 0xff);
-
-  char in_buf[] = {0};
-  char out_buf[256];
-  FILE *in = fmemopen(in_buf, sizeof(in_buf), "r");
-  FILE *out = fmemopen(out_buf, sizeof(out_buf), "w");
-
-  reg[R_R0] = 0x3100;
-  memory[0x3100] = 'h' | ('e' << 8);
-  memory[0x3101] = 'y' | (' ' << 8);
-  memory[0x3102] = 'd' | ('u' << 8);
-  memory[0x3103] = 'd' | ('e' << 8);
-  memory[0x3104] = 0;
-
-  int result = execute_trap(trap_putsp_instr, in, out);
-  fclose(in);
-  fclose(out);
-
-  if (result != 1) {
-    printf("Expected return value to be 1, got %d\n", result);
+  keyboard_push('k');
+  if (!keyboard_ready() || keyboard_getc() != 'k' || keyboard_ready()) {
+    printf("Expected the keyboard queue to hand back %d once\n", 'k');
     pass = 0;
   }
 
-  if (strncmp(out_buf, "hey dude", 8) != 0) {
-    printf("Expected output buffer to contain %s, got %s\n", "hey dude", out_buf);
+  atomic_store(&keyboard.eof, 1);
+  if (!keyboard_ready() || keyboard_getc() != EOF) {
+    printf("Expected the keyboard queue to report EOF\n");
     pass = 0;
   }
 
+  sem_destroy(&keyboard.available);
+  atomic_store(&keyboard.head, 0);
+  atomic_store(&keyboard.tail, 0);
+  atomic_store(&keyboard.eof, 0);
+#endif
   return pass;
 }
 
-int test_trap_halt() {
+int test_buffered_output() {
+  lc3_vm* vm = test_vm;
   int pass = 1;
 
+  uint16_t trap_puts_instr =
+    ((OP_TRAP & 0xf) << 12) |
+    (TRAP_PUTS & 0xff);
   uint16_t trap_halt_instr =
     ((OP_TRAP & 0xf) << 12) |
     (TRAP_HALT & 0xff);
 
-  char in_buf[] = {0};
-  char out_buf[256];
-  FILE *in = fmemopen(in_buf, sizeof(in_buf), "r");
-  FILE *out = fmemopen(out_buf, sizeof(out_buf), "w");
+  /* a machine that never buffers never pays for the buffer */
+  lc3_vm* fresh = lc3_vm_create();
+  if (!fresh || fresh->output) {
+    printf("Expected a new machine without an output buffer\n");
+    pass = 0;
+  }
+  lc3_vm_destroy(fresh);
 
-  int result = execute_trap(trap_halt_instr, in, out);
-  fclose(in);
-  fclose(out);
+  char out_buf[256] = {0};
+  FILE *out = fmemopen(out_buf, sizeof(out_buf), "w");
+  vm->output_policy = OUTPUT_BUFFERED;
+  vm->reg[R_R0] = 0x4000;
+  vm->memory[0x4000] = 'o';
+  vm->memory[0x4001] = 'k';
 
-  if (result != 0) {
-    printf("Expected return value to be 0, got %d\n", result);
+  /* held back until the program halts */
+  execute_trap(vm, trap_puts_instr, stdin, out);
+  if (out_buf[0] != 0) {
+    printf("Expected output buffer to contain %d, got %d\n", 0, out_buf[0]);
+    pass = 0;
+  }
+  if (!vm->output) {
+    printf("Expected the first held byte to allocate the buffer\n");
     pass = 0;
   }
 
-  if (strncmp(out_buf, "HALT", 8) != 0) {
-    printf("Expected output buffer to contain %s, got %s\n", "hey dude", out_buf);
+  execute_trap(vm, trap_halt_instr, stdin, out);
+  fclose(out);
+  vm->output_policy = OUTPUT_IMMEDIATE;
+  if (strcmp(out_buf, "okHALT\n") != 0) {
+    printf("Expected output buffer to contain %s, got %s\n", "okHALT", out_buf);
     pass = 0;
   }
 
   return pass;
 }
 
+int test_lockstep() {
+  lc3_vm* vm = test_vm;
+  int pass = 1;
+
+  uint16_t program[] = {
+    0x1481, /* ADD R2, R2, R1 */
+    0x0802, /* BRn x3004 */
+    0x7580, /* STR R2, R6, #0 */
+    0x127F, /* ADD R1, R1, #-1 */
+    0x56A5, /* AND R3, R2, #5 */
+    0x98FF, /* NOT R4, R3 */
+    0x6B80, /* LDR R5, R6, #0 */
+    0x1260, /* ADD R1, R1, #0 */
+    0x03F7, /* BRp x3000 */
+    0xF025, /* HALT */
+  };
+
+  const lane_ops* impls[] = {
+    &lanes_generic,
+#ifdef HAVE_LANE_SIMD
+    __builtin_cpu_supports("sse2") ? &lanes_sse2 : NULL,
+    __builtin_cpu_supports("avx2") ? &lanes_avx2 : NULL,
+#endif
+  };
+
+  for (size_t k = 0; k < sizeof(impls) / sizeof(impls[0]); k++) {
+    if (!impls[k]) {
+      continue;
+    }
+    lc3_lockstep* s = lc3_lockstep_create();
+    lc3_vm* lanes[LOCKSTEP_LANES];
+    FILE* out = fopen("/dev/null", "w");
+    s->ops = impls[k];
+
+    /* lanes split at the BRn and leave the loop at different times */
+    for (int l = 0; l < LOCKSTEP_LANES; l++) {
+      lanes[l] = lc3_vm_create();
+      lanes[l]->out = out;
+      memcpy(lanes[l]->memory + 0x3000, program, sizeof(program));
+      lanes[l]->reg[R_R1] = l - 4;
+      lanes[l]->reg[R_R6] = 0x4000;
+      lockstep_add_lane(s, lanes[l]);
+    }
+    while (run_lockstep(s, 1000)) {
+    }
+
+    for (int l = 0; l < LOCKSTEP_LANES; l++) {
+      /* the same machine run alone on the engine under test */
+      memset(vm->reg, 0, sizeof(vm->reg));
+      memcpy(vm->memory + 0x3000, program, sizeof(program));
+      vm->memory[0x4000] = 0;
+      vm->reg[R_PC] = 0x3000;
+      vm->reg[R_R1] = l - 4;
+      vm->reg[R_R6] = 0x4000;
+      reset_code_caches(vm);
+      vm->out = out;
+      while (run_engine(vm, 1000)) {
+      }
+      vm->out = stdout;
+
+      if (!s->halted[l] || memcmp(vm->reg, lanes[l]->reg, sizeof(vm->reg)) != 0 ||
+          vm->cond_result != lanes[l]->cond_result ||
+          vm->memory[0x4000] != lanes[l]->memory[0x4000]) {
+        printf("Expected lane %d on %s lanes to match, R2 %d vs %d\n", l, impls[k]->name, lanes[l]->reg[R_R2], vm->reg[R_R2]);
+        pass = 0;
+      }
+      lc3_vm_destroy(lanes[l]);
+    }
+    lc3_lockstep_destroy(s);
+    fclose(out);
+  }
+
+  return pass;
+}
+
 int run_tests() {
   int (*tests[])(void) = {
     test_add_instr_1,
@@ -1195,64 +8944,455 @@ int run_tests() {
     test_trap_puts,
     test_trap_in,
     test_trap_putsp,
+    test_decode_invalidate,
+    test_program_loop,
+    test_self_modifying,
+    test_full_block,
+    test_jit_threshold,
+    test_input_exhausted,
+    test_lockstep,
+    test_buffered_output,
+    test_keyboard_queue,
+    test_idle_loop,
+    test_device_page,
+    test_image_cache,
+    test_image_loader,
+    test_snapshot,
+    test_record_replay,
+    test_profile,
+    test_sampler,
+    test_bench_kernels,
+    test_halt_count,
+    test_trace,
+    test_assembler,
+    test_debugger,
+    test_gdb_stub,
+    test_os,
     NULL
   };
 
   int i, result, ok = 1;
-  for (i = 0; tests[i] != NULL; i++) {
-    /* clear memory */
-    memset(reg, 0, sizeof(reg));
-    memset(memory, 0, sizeof(memory));
-
-    /* set the PC to starting position */
-    /* 0x3000 is the default */
-    enum { PC_START = 0x3000 };
-    reg[R_PC] = PC_START;
 
+  lc3_vm* vm = test_vm = lc3_vm_create();
+  if (!vm) {
+    printf("failed to create a machine\n");
+    return 1;
+  }
 
-    result = tests[i]();
-    if (!result) {
-      printf("Test %d failed!\n", i);
-      ok = 0;
+  /* compile every block the first time it runs */
+  jit_threshold = 1;
+  for (vm->engine = 0; vm->engine < ENGINE_COUNT; vm->engine++) {
+    for (i = 0; tests[i] != NULL; i++) {
+      /* clear memory */
+      memset(vm->reg, 0, sizeof(vm->reg));
+      lc3_zero(vm->memory, MEMORY_WORDS * sizeof(uint16_t));
+      vm->cond_result = 0;
+      vm->input_eof = 0;
+      reset_code_caches(vm);
+
+      vm->reg[R_PC] = PC_START;
+
+      result = tests[i]();
+      if (!result) {
+        printf("Test %d failed on the %s engine!\n", i, engine_names[vm->engine]);
+        ok = 0;
+      }
     }
   }
 
+  lc3_vm_destroy(vm);
+  test_vm = NULL;
+
   if (ok) {
     printf("All tests passed!\n");
     return 0;
   }
   return 1;
 }
+
+void finish_profile(lc3_vm* vm,const char* path){
+    if(!vm->profile){
+        return;
+    }
+    FILE* out=fopen(path,"w");
+    if(out){
+        write_profile(vm,out);
+        fclose(out);
+    }else{
+        printf("failed to write profile: %s\n",path);
+    }
+    lc3_free(vm->profile,sizeof(lc3_profile));
+    vm->profile=NULL;
+}
+
+#ifdef HAVE_TRACE
+void finish_trace(lc3_vm* vm,FILE* file){
+    if(vm->trace&&!lc3_trace_stop(vm)){
+        printf("failed to write the trace\n");
+    }
+    if(file){
+        fclose(file);
+    }
+}
+#endif
+
+#ifdef HAVE_SAMPLER
+void finish_samples(lc3_vm* vm,const char* path,symbol_table* symbols){
+    if(sampler.vm){
+        sampler_stop();
+        FILE* out=fopen(path,"w");
+        if(out){
+            write_folded(vm,symbols,out);
+            fclose(out);
+        }else{
+            printf("failed to write samples: %s\n",path);
+        }
+        unsigned dropped=atomic_load(&sampler.dropped);
+        if(dropped){
+            fprintf(stderr,"%u samples dropped\n",dropped);
+        }
+        sampler_reset();
+    }
+    free_symbols(symbols);
+}
+#endif
+
+void usage(){
+    printf("lc3 --test | [--engine switch|threaded|block|jit] [--jit-threshold n] [--flush immediate|buffered] [--idle elapsed|off|n] [--image-cache] [--record log | --replay log] [--profile out.txt | --trace out.bin] [--sample out.folded] [--debug | --gdb port|socket] [--sym file.sym] [--asm file.asm] [--os os.obj [--hle on|off]] [image-file1] ...\n");
+#ifdef HAVE_BATCH
+    printf("lc3 [--engine ...] [--input file | --input-string keys] [--output file] [--max-instructions n] image-file1 ...\n");
+#endif
+    printf("lc3 --trace-dump trace.bin\n");
+#ifdef HAVE_BENCH
+    printf("lc3 [--engine ...] [--flush ...] --bench [image-file1] ...\n");
+#endif
+#ifdef HAVE_BATCH
+    printf("lc3 [--engine ...] --batch jobs.txt [-j workers] [--slice n] [--max-instructions n] [--lockstep] [--image-cache]\n");
+#endif
+    exit(2);
+}
+
 int main(int argc,char* argv[]){
-    if(argc<2){
-        printf("lc3 --test | [image-file1] ...\n");
-        exit(2);
+    lc3_vm* vm=lc3_vm_create();
+    if(!vm){
+        printf("failed to create a machine\n");
+        exit(1);
+    }
+    const char* batch_path=NULL;
+    int workers=0;
+    uint64_t slice=0,max_instructions=0;
+    int lockstep=0;
+    int output_policy=OUTPUT_IMMEDIATE;
+    const char* record_path=NULL;
+    const char* replay_path=NULL;
+    const char* profile_path=NULL;
+    const char* trace_path=NULL;
+    int bench=0;
+    const char* asm_path=NULL;
+    const char* input_path=NULL;
+    const char* input_string=NULL;
+    const char* output_path=NULL;
+    int engine=-1;          /* only set by --engine */
+    int debug=0;
+    const char* gdb_address=NULL;
+    const char* os_path=NULL;
+    int hle=1;
+    symbol_table symbols={0};
+#ifdef HAVE_SAMPLER
+    const char* sample_path=NULL;
+#endif
+    int j=1;
+    for(;j<argc&&argv[j][0]=='-';++j){
+        if(strcmp(argv[j],"--test")==0){
+            exit(run_tests());
+        }else if(strcmp(argv[j],"--bench")==0){
+            bench=1;
+        }else if(strcmp(argv[j],"--batch")==0&&j+1<argc){
+            batch_path=argv[++j];
+        }else if(strcmp(argv[j],"--flush")==0&&j+1<argc){
+            output_policy=parse_output_policy(argv[++j]);
+            if(output_policy<0){
+                usage();
+            }
+            vm->output_policy=output_policy;
+        }else if(strcmp(argv[j],"--idle")==0&&j+1<argc){
+            const char* idle=argv[++j];
+            if(strcmp(idle,"elapsed")==0){
+                vm->idle_policy=IDLE_ELAPSED;
+            }else if(strcmp(idle,"off")==0){
+                vm->idle_policy=IDLE_OFF;
+            }else{
+                vm->idle_policy=IDLE_FIXED;
+                vm->idle_iterations=strtoull(idle,NULL,0);
+            }
+        }else if(strcmp(argv[j],"--profile")==0&&j+1<argc){
+            profile_path=argv[++j];
+#ifdef HAVE_TRACE
+        }else if(strcmp(argv[j],"--trace")==0&&j+1<argc){
+            trace_path=argv[++j];
+#endif
+        }else if(strcmp(argv[j],"--trace-dump")==0&&j+1<argc){
+            FILE* in=fopen(argv[++j],"rb");
+            if(!in||!dump_trace(in,stdout)){
+                printf("failed to read trace: %s\n",argv[j]);
+                exit(1);
+            }
+            fclose(in);
+            exit(0);
+#ifdef HAVE_SAMPLER
+        }else if(strcmp(argv[j],"--sample")==0&&j+1<argc){
+            sample_path=argv[++j];
+#endif
+        }else if(strcmp(argv[j],"--debug")==0){
+            debug=1;
+#ifdef HAVE_GDB
+        }else if(strcmp(argv[j],"--gdb")==0&&j+1<argc){
+            gdb_address=argv[++j];
+#endif
+        }else if(strcmp(argv[j],"--sym")==0&&j+1<argc){
+            if(!read_symbols(&symbols,argv[++j])){
+                printf("failed to read symbols: %s\n",argv[j]);
+                exit(1);
+            }
+        }else if(strcmp(argv[j],"--input")==0&&j+1<argc){
+            input_path=argv[++j];
+        }else if(strcmp(argv[j],"--input-string")==0&&j+1<argc){
+            input_string=argv[++j];
+        }else if(strcmp(argv[j],"--output")==0&&j+1<argc){
+            output_path=argv[++j];
+        }else if(strcmp(argv[j],"--record")==0&&j+1<argc){
+            record_path=argv[++j];
+        }else if(strcmp(argv[j],"--replay")==0&&j+1<argc){
+            replay_path=argv[++j];
+        }else if(strcmp(argv[j],"--lockstep")==0){
+            lockstep=1;
+        }else if(strcmp(argv[j],"-j")==0&&j+1<argc){
+            workers=atoi(argv[++j]);
+        }else if(strcmp(argv[j],"--slice")==0&&j+1<argc){
+            slice=strtoull(argv[++j],NULL,0);
+        }else if(strcmp(argv[j],"--max-instructions")==0&&j+1<argc){
+            max_instructions=strtoull(argv[++j],NULL,0);
+        }else if(strcmp(argv[j],"--jit-threshold")==0&&j+1<argc){
+            jit_threshold=atoi(argv[++j]);
+        }else if(strcmp(argv[j],"--asm")==0&&j+1<argc){
+            asm_path=argv[++j];
+        }else if(strcmp(argv[j],"--os")==0&&j+1<argc){
+            os_path=argv[++j];
+        }else if(strcmp(argv[j],"--hle")==0&&j+1<argc){
+            const char* mode=argv[++j];
+            if(strcmp(mode,"on")!=0&&strcmp(mode,"off")!=0){
+                usage();
+            }
+            hle=strcmp(mode,"on")==0;
+        }else if(strcmp(argv[j],"--image-cache")==0){
+            use_image_cache=1;
+        }else if(strcmp(argv[j],"--engine")==0&&j+1<argc){
+            vm->engine=engine=parse_engine(argv[++j]);
+            if(vm->engine<0){
+                usage();
+            }
+        }else{
+            usage();
+        }
+    }
+    if(batch_path){
+#ifdef HAVE_BATCH
+        batch_config config={0};
+        config.worker_count=workers;
+        config.engine=vm->engine;
+        config.slice=slice;
+        config.max_instructions=max_instructions;
+        config.lockstep=lockstep;
+        config.output_policy=output_policy;
+        lc3_vm_destroy(vm);
+        exit(run_batch(batch_path,config));
+#else
+        usage();
+#endif
+    }
+    if(bench){
+#ifdef HAVE_BENCH
+        /* the reference games, when run from the source tree */
+        char* games[]={"2048.obj","rogue.obj"};
+        int game_count=0;
+        for(int i=0;i<2;++i){
+            if(access(games[i],R_OK)==0){
+                games[game_count++]=games[i];
+            }
+        }
+        lc3_vm_destroy(vm);
+        exit(j<argc?run_bench(engine,output_policy,argv+j,argc-j):run_bench(engine,output_policy,games,game_count));
+#else
+        usage();
+#endif
+    }
+    if(j>=argc&&!asm_path){
+        usage();
+    }
+
+    if(os_path){
+        image_span span;
+        int err=read_image(vm,os_path,&span);
+        if(err!=IMAGE_OK){
+            fprintf(stderr,"failed to load image: %s: %s\n",os_path,image_errors[err]);
+            exit(1);
+        }
+        mark_dirty(vm,span.origin,span.words);
+        /* the vectors are taken before a program can replace any */
+        lc3_os_start(vm);
+        vm->hle=hle;
+    }
+    if(!read_images(vm,argv+j,argc-j)){
+        exit(1);
+    }
+    if(asm_path){
+#ifdef HAVE_SAMPLER
+        symbol_table* labels=sample_path||debug?&symbols:NULL;
+#else
+        symbol_table* labels=debug?&symbols:NULL;
+#endif
+        if(!read_asm(vm,asm_path,labels)){
+            exit(1);
+        }
+    }
+    if(profile_path){
+        vm->profile=lc3_alloc(sizeof(lc3_profile));
+        if(!vm->profile){
+            printf("failed to allocate the profile\n");
+            exit(1);
+        }
+    }
+    if(profile_path&&trace_path){
+        usage();
+    }
+#ifdef HAVE_TRACE
+    FILE* trace_file=NULL;
+    if(trace_path){
+        trace_file=fopen(trace_path,"wb");
+        if(!trace_file||!lc3_trace_start(vm,trace_file)){
+            printf("failed to write trace: %s\n",trace_path);
+            exit(1);
+        }
+    }
+#endif
+    if(debug){
+        /* the prompt and the program share the terminal, so stdin is
+         * read directly instead of by the keyboard thread */
+        int status=run_debugger(vm,&symbols);
+        finish_profile(vm,profile_path);
+#ifdef HAVE_TRACE
+        finish_trace(vm,trace_file);
+#endif
+        free_symbols(&symbols);
+        lc3_vm_destroy(vm);
+        return status;
+    }
+#ifdef HAVE_SAMPLER
+    if(sample_path){
+        if(!sampler_start(vm,SAMPLE_INTERVAL_US)){
+            printf("failed to start the sampler\n");
+            exit(1);
+        }
     }
+#endif
 
-    if(strcmp(argv[1],"--test")==0){
-        exit(run_tests());
+    if(input_path||input_string||output_path){
+#ifdef HAVE_BATCH
+        size_t size=input_string?strlen(input_string):0;
+        char* in_buf=input_path?read_whole_file(input_path,&size):NULL;
+        if(input_path&&!in_buf){
+            printf("failed to read input: %s\n",input_path);
+            exit(1);
+        }
+        int status=run_headless(vm,in_buf?in_buf:(char*)input_string,size,output_path,max_instructions);
+        free(in_buf);
+        finish_profile(vm,profile_path);
+#ifdef HAVE_TRACE
+        finish_trace(vm,trace_file);
+#endif
+#ifdef HAVE_SAMPLER
+        finish_samples(vm,sample_path,&symbols);
+#endif
+        lc3_vm_destroy(vm);
+        return status;
+#else
+        usage();
+#endif
+    }
+    if(replay_path){
+        FILE* log=fopen(replay_path,"rb");
+        vm->replay=log?replay_open(log):NULL;
+        if(!vm->replay){
+            printf("failed to read recording: %s\n",replay_path);
+            exit(1);
+        }
+        fclose(log);
+        run_replay(vm);
+        output_flush(vm);
+        finish_profile(vm,profile_path);
+#ifdef HAVE_TRACE
+        finish_trace(vm,trace_file);
+#endif
+#ifdef HAVE_SAMPLER
+        finish_samples(vm,sample_path,&symbols);
+#endif
+        replay_close(vm->replay);
+        lc3_vm_destroy(vm);
+        return 0;
+    }
+    FILE* record=NULL;
+    if(record_path){
+        record=fopen(record_path,"wb");
+        if(!record||!record_start(vm,record)){
+            printf("failed to write recording: %s\n",record_path);
+            exit(1);
+        }
     }
 
-    for(int j=1;j<argc;++j){
-        if(!read_image(argv[j])){
-            printf("failed to load image: %s\n",argv[j]);
+#ifdef HAVE_GDB
+    int gdb_fd=-1;
+    if(gdb_address){
+        gdb_fd=gdb_accept(gdb_address);
+        if(gdb_fd<0){
+            printf("failed to accept gdb on %s\n",gdb_address);
             exit(1);
         }
     }
+#endif
 
     signal(SIGINT,handle_interrupt);
     disable_input_buffering();
+#ifdef HAVE_KEYBOARD_THREAD
+    /* without the thread KBSR falls back to select() */
+    keyboard_start();
+#endif
 
-    /* set the PC to starting position */
-    /* 0x3000 is the default */
-    enum{PC_START=0x3000};
-    reg[R_PC]=PC_START;
-
-    int running=1;
-    while(running){
-        running=read_and_execute_instruction();
+    if(record){
+        run_recorded(vm,max_instructions);
+        fclose(record);
+#ifdef HAVE_GDB
+    }else if(gdb_fd>=0){
+        /* a detached program runs on by itself */
+        if(run_gdb(vm,gdb_fd)){
+            while(run_engine(vm,UINT64_MAX)){
+            }
+        }
+#endif
+    }else if(max_instructions){
+        run_engine(vm,max_instructions);
+    }else{
+        while(run_engine(vm,UINT64_MAX)){
+        }
     }
+    output_flush(vm);
     restore_input_buffering();
+    finish_profile(vm,profile_path);
+#ifdef HAVE_TRACE
+    finish_trace(vm,trace_file);
+#endif
+#ifdef HAVE_SAMPLER
+    finish_samples(vm,sample_path,&symbols);
+#endif
+    lc3_vm_destroy(vm);
     return 0;
 }
-